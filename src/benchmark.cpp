@@ -21,11 +21,13 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <istream>
 #include <vector>
 
+#include "evaluate_nn_kernel.h"
 #include "misc.h"
 #include "position.h"
 #include "search.h"
@@ -112,6 +114,12 @@ benchmark(const Position& current, istream& is)
   }
 
   uint64_t nodes = 0;
+  uint64_t refreshes = 0;
+  uint64_t updates = 0;
+  uint64_t tt_probes = 0;
+  uint64_t tt_hits = 0;
+  uint64_t eval_probes = 0;
+  uint64_t eval_hits = 0;
   TimePoint elapsed = now();
 
   for (size_t i = 0; i < sfens.size(); ++i)
@@ -128,8 +136,32 @@ benchmark(const Position& current, istream& is)
 
   elapsed = now() - elapsed + 1;
 
+  for (Thread *th : Threads)
+  {
+    refreshes += th->feature_refreshes_;
+    updates   += th->feature_updates_;
+    tt_probes += th->tt_probes_;
+    tt_hits   += th->tt_hits_;
+    eval_probes += th->eval_probes_;
+    eval_hits   += th->eval_hits_;
+  }
+
   cerr << "\n==========================="
        << "\nTotal time (ms) : " << elapsed
        << "\nNodes searched  : " << nodes
-       << "\nNodes/second    : " << 1000 * nodes / elapsed << endl;
+       << "\nNodes/second    : " << 1000 * nodes / elapsed
+       << "\nRefresh ratio   : "
+       << 100.0 * refreshes / std::max<uint64_t>(refreshes + updates, 1)
+       << "%"
+       << "\nTT hit rate     : "
+       << 100.0 * tt_hits / std::max<uint64_t>(tt_probes, 1)
+       << "%"
+       << "\nEval hash hit   : "
+       << 100.0 * eval_hits / std::max<uint64_t>(eval_probes, 1)
+       << "%"
+       << "\nNN evals/second : " << 1000 * (eval_probes - eval_hits) / elapsed
+       << "\nEval type       : "
+       << (eval::CurrentBackend() == eval::Backend::kKppt ? "kppt" : "nn")
+       << "\nEval kernel     : " << eval::g_kernel.name
+       << "\nTT large pages  : " << (TT.large_pages() ? "yes" : "no") << endl;
 }
@@ -19,591 +19,231 @@
 #include "evaluate.h"
 #include <algorithm>
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <fstream>
-#include <iomanip>
-#include <sstream>
+#include <iostream>
+#include <vector>
 #include "misc.h"
 #include "position.h"
 #include "search.h"
 #include "thread.h"
 
-#define USE_SIMD
-#define USE_SIMD_2
+// gatherはAVX2の命令なので、使えない環境では1組ずつ読む
+// gcc,clangでは-marchの指定に関係なくAVX2の関数を作り、起動時にCPUに合わせて選ぶ
+#ifdef _MSC_VER
+#define KPPT_TARGET(isa)
+#else
+#define KPPT_TARGET(isa) __attribute__((target(isa)))
+#endif
 
 namespace Eval {
 enum Turn { kUs, kThem };
 
-int16_t KPPT[kBoardSquare][kFEEnd][kFEEnd][kNumberOfColor];
-int16_t KKPT[kBoardSquare][kBoardSquare][kFEEnd][kNumberOfColor];
+// KPPはiとjを入れ替えても同じ値なので、玉の位置ごとにi>=jの三角形だけを持つ
+// 1要素はus,themの2つのint16を並べた32bit
+constexpr int64_t kKppTriangleSize = int64_t(kFEEnd) * (kFEEnd + 1) / 2;
+constexpr size_t kKpptBytes =
+    sizeof(int32_t) * kKppTriangleSize * int(kBoardSquare);
+constexpr size_t kKkptBytes =
+    sizeof(int16_t[kBoardSquare][kBoardSquare][kFEEnd][kNumberOfColor]);
+
+// 三角形にした評価関数ファイルの先頭。payloadはKPPT,KKPTの順に並べる
+struct KpptFileHeader {
+  char magic[8];
+  uint32_t fe_end;
+  uint32_t board_square;
+  uint64_t payload_size;
+  uint8_t reserved[40];
+};
+static_assert(sizeof(KpptFileHeader) == 64, "");
+
+constexpr char kKpptFileMagic[8] = {'N', 'O', 'Z', 'O', 'K', 'P', 'P', 'T'};
+
+const int32_t *KPPT = nullptr;
+const int16_t (*KKPT)[kBoardSquare][kFEEnd][kNumberOfColor] = nullptr;
+
+namespace {
+// 三角形の形式のファイルをマップしたもの。同じファイルを使うプロセス間で共有される
+MappedFile g_mapped;
+// ファイルをマップできなかった場合に確保した領域。ファイルと同じ形式で持つ
+std::vector<char> g_buffer;
+}  // namespace
 
 constexpr int kKingBrotherDiffSize = 7;
 
-void CalcFull(const Position &pos, EvalParts &parts) {
-  KPPIndex *list_black = pos.black_kpp_list();
-  KPPIndex *list_white = pos.white_kpp_list();
-
-  Square sq_black_king = pos.square_king(kBlack);
-  Square sq_white_king = pos.square_king(kWhite);
-  Square inv_sq_white_king = inverse(pos.square_king(kWhite));
-
-  Color side_to_move = pos.side_to_move();
-  int black_kpp[kNumberOfColor] = {};
-  int white_kpp[kNumberOfColor] = {};
-  int kkpt = KKPT[sq_black_king][sq_white_king][list_black[0]][side_to_move];
-#ifdef USE_SIMD_2
-  __m128i total = _mm_setzero_si128();
-#endif
-  for (int i = 1; i < kListNum; ++i) {
-    int k0 = list_black[i];
-    int k1 = list_white[i];
-    for (int j = 0; j < i; ++j) {
-      int l0 = list_black[j];
-      int l1 = list_white[j];
-#ifdef USE_SIMD_2
-      auto black = KPPT[sq_black_king][k0][l0];
-      auto white = KPPT[inv_sq_white_king][k1][l1];
-      __m128i tmp = _mm_set_epi32(0, 0, *reinterpret_cast<int32_t *>(black),
-                                  *reinterpret_cast<int32_t *>(white));
-      tmp = _mm_cvtepi16_epi32(tmp);
-      total = _mm_add_epi32(total, tmp);
-#else
-      black_kpp[kUs] += KPPT[sq_black_king][k0][l0][kUs];
-      black_kpp[kThem] += KPPT[sq_black_king][k0][l0][kThem];
-      white_kpp[kUs] -= KPPT[inv_sq_white_king][k1][l1][kUs];
-      white_kpp[kThem] -= KPPT[inv_sq_white_king][k1][l1][kThem];
-#endif
-    }
-    kkpt += KKPT[sq_black_king][sq_white_king][k0][side_to_move];
-  }
-#ifdef USE_SIMD_2
-  black_kpp[kUs] = _mm_extract_epi32(total, 2);
-  black_kpp[kThem] = _mm_extract_epi32(total, 3);
-  white_kpp[kUs] = -_mm_extract_epi32(total, 0);
-  white_kpp[kThem] = -_mm_extract_epi32(total, 1);
-#endif
-  parts.kppt[kBlack].us = static_cast<Value>(black_kpp[kUs]);
-  parts.kppt[kBlack].them = static_cast<Value>(black_kpp[kThem]);
-  parts.kppt[kWhite].us = static_cast<Value>(white_kpp[kUs]);
-  parts.kppt[kWhite].them = static_cast<Value>(white_kpp[kThem]);
-  parts.kkpt = static_cast<Value>(kkpt);
+inline const int32_t *KppTable(Square king) {
+  return KPPT + int(king) * kKppTriangleSize;
 }
 
-ValueUnit CalcPart(Square king, const KPPIndex *current, const KPPIndex *before,
-                   const int *index, int num) {
-  int black_value = 0;
-  int white_value = 0;
-#ifdef USE_SIMD_2
-  __m128i total = _mm_setzero_si128();
-  __m128i extra = _mm_setzero_si128();
-#endif
-  for (int i = 0; i < num; ++i) {
-    const auto kpp_current = KPPT[king][current[index[i]]];
-    const auto kpp_before = KPPT[king][before[index[i]]];
-    for (int j = 0; j < kListNum; ++j) {
-#ifdef USE_SIMD_2
-      __m128i tmp = _mm_set_epi32(
-          0, 0, *reinterpret_cast<int32_t *>(kpp_current[current[j]]),
-          *reinterpret_cast<int32_t *>(kpp_before[before[j]]));
-      tmp = _mm_cvtepi16_epi32(tmp);
-      total = _mm_add_epi32(total, tmp);
-#else
-      black_value += kpp_current[current[j]][kUs];
-      white_value += kpp_current[current[j]][kThem];
-      black_value -= kpp_before[before[j]][kUs];
-      white_value -= kpp_before[before[j]][kThem];
-#endif
-    }
-  }
+inline int KppOffset(int i, int j) {
+  return i >= j ? i * (i + 1) / 2 + j : j * (j + 1) / 2 + i;
+}
 
-  for (int i = 1; i < num; ++i) {
-    const auto kpp_current = KPPT[king][current[index[i]]];
-    const auto kpp_before = KPPT[king][before[index[i]]];
-    for (int j = 0; j < i; ++j) {
-#ifdef USE_SIMD_2
-      __m128i tmp = _mm_set_epi32(
-          0, 0, *reinterpret_cast<int32_t *>(kpp_current[current[index[j]]]),
-          *reinterpret_cast<int32_t *>(kpp_before[before[index[j]]]));
-      tmp = _mm_cvtepi16_epi32(tmp);
-      extra = _mm_add_epi32(extra, tmp);
-#else
-      black_value -= kpp_current[current[index[j]]][kUs];
-      white_value -= kpp_current[current[index[j]]][kThem];
-      black_value += kpp_before[before[index[j]]][kUs];
-      white_value += kpp_before[before[index[j]]][kThem];
-#endif
-    }
-  }
-#ifdef USE_SIMD_2
-  black_value = _mm_extract_epi32(total, 2) - _mm_extract_epi32(total, 0) -
-                _mm_extract_epi32(extra, 2) + _mm_extract_epi32(extra, 0);
-  white_value = _mm_extract_epi32(total, 3) - _mm_extract_epi32(total, 1) -
-                _mm_extract_epi32(extra, 3) + _mm_extract_epi32(extra, 1);
-#endif
-  ValueUnit value = {Value(black_value), Value(white_value)};
+inline ValueUnit Unpack(int32_t v) {
+  ValueUnit value = {Value(static_cast<int16_t>(v)), Value(v >> 16)};
   return value;
 }
 
-void CalcDifferenceWithoutCapture(const Position &pos,
-                                  const EvalParts &last_parts,
-                                  EvalParts &parts) {
-  Square black_king = pos.square_king(kBlack);
-  Square white_king = pos.square_king(kWhite);
-  Square inv_white_king = inverse(white_king);
+inline ValueUnit Negate(ValueUnit v) {
+  ValueUnit value = {-v.us, -v.them};
+  return value;
+}
 
-  const KPPIndex *prev_list_black = pos.prev_black_kpp_list();
-  const KPPIndex *prev_list_white = pos.prev_white_kpp_list();
-  const KPPIndex *list_black = pos.black_kpp_list();
-  const KPPIndex *list_white = pos.white_kpp_list();
-
-  assert(pos.list_index_move() < 38);
-
-  Color side_to_move = pos.side_to_move();
-  int black_kpp_diff[kNumberOfColor] = {};
-  int white_kpp_diff[kNumberOfColor] = {};
-  int kkpt = 0;
-  const auto *black_prev_kpp_table =
-      KPPT[black_king][prev_list_black[pos.list_index_move()]];
-  const auto *black_kpp_table =
-      KPPT[black_king][list_black[pos.list_index_move()]];
-  const auto *white_prev_kpp_table =
-      KPPT[inv_white_king][prev_list_white[pos.list_index_move()]];
-  const auto *white_kpp_table =
-      KPPT[inv_white_king][list_white[pos.list_index_move()]];
-#ifdef USE_SIMD_2
-  __m256i total = _mm256_setzero_si256();
-#endif
-  for (int i = 0; i < kListNum; ++i) {
-#ifdef USE_SIMD_2
-    __m128i tmp = _mm_set_epi32(
-        *reinterpret_cast<const int32_t *>(
-            black_prev_kpp_table[prev_list_black[i]]),
-        *reinterpret_cast<const int32_t *>(black_kpp_table[list_black[i]]),
-        *reinterpret_cast<const int32_t *>(
-            white_prev_kpp_table[prev_list_white[i]]),
-        *reinterpret_cast<const int32_t *>(white_kpp_table[list_white[i]]));
-    __m256i tmp2 = _mm256_cvtepi16_epi32(tmp);
-    total = _mm256_add_epi32(total, tmp2);
-#else
-    // 前回のを引く
-    black_kpp_diff[kUs] -= black_prev_kpp_table[prev_list_black[i]][kUs];
-    black_kpp_diff[kThem] -= black_prev_kpp_table[prev_list_black[i]][kThem];
-    // 今回のを足す
-    black_kpp_diff[kUs] += black_kpp_table[list_black[i]][kUs];
-    black_kpp_diff[kThem] += black_kpp_table[list_black[i]][kThem];
-
-    // 前回のを引く
-    white_kpp_diff[kUs] += white_prev_kpp_table[prev_list_white[i]][kUs];
-    white_kpp_diff[kThem] += white_prev_kpp_table[prev_list_white[i]][kThem];
-
-    // 今回のを足す
-    white_kpp_diff[kUs] -= white_kpp_table[list_white[i]][kUs];
-    white_kpp_diff[kThem] -= white_kpp_table[list_white[i]][kThem];
-#endif
-    kkpt += KKPT[black_king][white_king][list_black[i]][side_to_move];
+// KPPの値を1組ずつ足していく
+class KppAccumulator {
+ public:
+  // kppのi行目とlist[0..num)の組を足す
+  void AddRow(const int32_t *kpp, int i, const KPPIndex *list, int num) {
+    for (int j = 0; j < num; ++j) {
+      const int32_t v = kpp[KppOffset(i, list[j])];
+      us_ += static_cast<int16_t>(v);
+      them_ += v >> 16;
+    }
   }
-#ifdef USE_SIMD_2
-  black_kpp_diff[kUs] =
-      -_mm256_extract_epi32(total, 6) + _mm256_extract_epi32(total, 4);
-  black_kpp_diff[kThem] =
-      -_mm256_extract_epi32(total, 7) + _mm256_extract_epi32(total, 5);
-  white_kpp_diff[kUs] =
-      _mm256_extract_epi32(total, 2) - _mm256_extract_epi32(total, 0);
-  white_kpp_diff[kThem] =
-      _mm256_extract_epi32(total, 3) - _mm256_extract_epi32(total, 1);
-#endif
-  parts.kppt[kBlack].us = last_parts.kppt[kBlack].us + black_kpp_diff[kUs];
-  parts.kppt[kBlack].them =
-      last_parts.kppt[kBlack].them + black_kpp_diff[kThem];
-  parts.kppt[kWhite].us = last_parts.kppt[kWhite].us + white_kpp_diff[kUs];
-  parts.kppt[kWhite].them =
-      last_parts.kppt[kWhite].them + white_kpp_diff[kThem];
-
-  parts.kkpt = static_cast<Value>(kkpt);
+
+  ValueUnit Sum() const {
+    ValueUnit value = {Value(us_), Value(them_)};
+    return value;
+  }
+
+ private:
+  int us_ = 0;
+  int them_ = 0;
+};
+
+KPPT_TARGET("avx2")
+inline int HorizontalSum(__m256i v) {
+  __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v),
+                              _mm256_extracti128_si256(v, 1));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(sum);
 }
 
-void CalcDifferenceWithCapture(const Position &pos, const EvalParts &last_parts,
-                               EvalParts &parts) {
-  Square black_king = pos.square_king(kBlack);
-  Square white_king = pos.square_king(kWhite);
-  Square inv_white_king = inverse(white_king);
+// AVX2では駒リストの8要素分の位置をまとめて求めてgatherで読み、最後に横に足す
+class KppAccumulatorAvx2 {
+ public:
+  KPPT_TARGET("avx2")
+  KppAccumulatorAvx2()
+      : us_(_mm256_setzero_si256()), them_(_mm256_setzero_si256()) {}
+
+  // kppのi行目とlist[0..num)の組を足す
+  KPPT_TARGET("avx2")
+  void AddRow(const int32_t *kpp, int i, const KPPIndex *list, int num) {
+    const __m256i vi = _mm256_set1_epi32(i);
+    for (int j = 0; j < num; j += 8) {
+      __m256i vj;
+      __m256i mask;
+      if (num - j >= 8) {
+        vj = _mm256_cvtepi16_epi32(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(list + j)));
+        mask = _mm256_set1_epi32(-1);
+      } else {
+        // リストの外を読まないように端数は詰め直す
+        alignas(32) int32_t rest[8] = {};
+        for (int k = 0; k < num - j; ++k) rest[k] = list[j + k];
+        vj = _mm256_load_si256(reinterpret_cast<const __m256i *>(rest));
+        mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(num - j),
+                                  _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+      }
+      // 大きい方の添字の行に小さい方の添字の列がある
+      const __m256i hi = _mm256_max_epi32(vi, vj);
+      const __m256i lo = _mm256_min_epi32(vi, vj);
+      const __m256i offset = _mm256_add_epi32(
+          _mm256_srli_epi32(
+              _mm256_mullo_epi32(hi,
+                                 _mm256_add_epi32(hi, _mm256_set1_epi32(1))),
+              1),
+          lo);
+      const __m256i v = _mm256_mask_i32gather_epi32(
+          _mm256_setzero_si256(), reinterpret_cast<const int *>(kpp), offset,
+          mask, 4);
+      us_ = _mm256_add_epi32(us_,
+                             _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16));
+      them_ = _mm256_add_epi32(them_, _mm256_srai_epi32(v, 16));
+    }
+  }
 
-  const KPPIndex *prev_list_black = pos.prev_black_kpp_list();
-  const KPPIndex *prev_list_white = pos.prev_white_kpp_list();
-  const KPPIndex *list_black = pos.black_kpp_list();
-  const KPPIndex *list_white = pos.white_kpp_list();
-
-  assert(pos.list_index_capture() < 38);
-  assert(pos.list_index_move() < 38);
-
-  Color side_to_move = pos.side_to_move();
-  int black_kpp_diff[kNumberOfColor] = {};
-  int white_kpp_diff[kNumberOfColor] = {};
-  int kkpt = 0;
-  const auto *black_prev_kpp_table =
-      KPPT[black_king][prev_list_black[pos.list_index_move()]];
-  const auto *black_prev_cap_kpp_table =
-      KPPT[black_king][prev_list_black[pos.list_index_capture()]];
-  const auto *black_kpp_table =
-      KPPT[black_king][list_black[pos.list_index_move()]];
-  const auto *black_cap_kpp_table =
-      KPPT[black_king][list_black[pos.list_index_capture()]];
-  const auto *white_prev_kpp_table =
-      KPPT[inv_white_king][prev_list_white[pos.list_index_move()]];
-  const auto *white_prev_cap_kpp_table =
-      KPPT[inv_white_king][prev_list_white[pos.list_index_capture()]];
-  const auto *white_kpp_table =
-      KPPT[inv_white_king][list_white[pos.list_index_move()]];
-  const auto *white_cap_kpp_table =
-      KPPT[inv_white_king][list_white[pos.list_index_capture()]];
-
-#ifdef USE_SIMD_2
-  __m256i total_black = _mm256_setzero_si256();
-  __m256i total_white = _mm256_setzero_si256();
-  __m256i extra = _mm256_setzero_si256();
-#endif
-  for (int i = 0; i < kListNum; ++i) {
-#ifdef USE_SIMD_2
-    __m128i tmp = _mm_set_epi32(
-        *reinterpret_cast<const int32_t *>(
-            black_prev_kpp_table[prev_list_black[i]]),
-        *reinterpret_cast<const int32_t *>(
-            black_prev_cap_kpp_table[prev_list_black[i]]),
-        *reinterpret_cast<const int32_t *>(black_kpp_table[list_black[i]]),
-        *reinterpret_cast<const int32_t *>(black_cap_kpp_table[list_black[i]]));
-    __m256i tmp2 = _mm256_cvtepi16_epi32(tmp);
-    total_black = _mm256_add_epi32(total_black, tmp2);
-
-    tmp = _mm_set_epi32(
-        *reinterpret_cast<const int32_t *>(
-            white_prev_kpp_table[prev_list_white[i]]),
-        *reinterpret_cast<const int32_t *>(
-            white_prev_cap_kpp_table[prev_list_white[i]]),
-        *reinterpret_cast<const int32_t *>(white_kpp_table[list_white[i]]),
-        *reinterpret_cast<const int32_t *>(white_cap_kpp_table[list_white[i]]));
-    tmp2 = _mm256_cvtepi16_epi32(tmp);
-    total_white = _mm256_add_epi32(total_white, tmp2);
-#else
-    // 前回のを引く
-    black_kpp_diff[kUs] -= black_prev_kpp_table[prev_list_black[i]][kUs];
-    black_kpp_diff[kThem] -= black_prev_kpp_table[prev_list_black[i]][kThem];
-    // とった分も引く
-    black_kpp_diff[kUs] -= black_prev_cap_kpp_table[prev_list_black[i]][kUs];
-    black_kpp_diff[kThem] -=
-        black_prev_cap_kpp_table[prev_list_black[i]][kThem];
-
-    // 今回のを足す
-    black_kpp_diff[kUs] += black_kpp_table[list_black[i]][kUs];
-    black_kpp_diff[kThem] += black_kpp_table[list_black[i]][kThem];
-    black_kpp_diff[kUs] += black_cap_kpp_table[list_black[i]][kUs];
-    black_kpp_diff[kThem] += black_cap_kpp_table[list_black[i]][kThem];
-
-    // 前回のを引く
-    white_kpp_diff[kUs] += white_prev_kpp_table[prev_list_white[i]][kUs];
-    white_kpp_diff[kThem] += white_prev_kpp_table[prev_list_white[i]][kThem];
-
-    // とった分も引く
-    white_kpp_diff[kUs] += white_prev_cap_kpp_table[prev_list_white[i]][kUs];
-    white_kpp_diff[kThem] +=
-        white_prev_cap_kpp_table[prev_list_white[i]][kThem];
-
-    // 今回のを足す
-    white_kpp_diff[kUs] -= white_kpp_table[list_white[i]][kUs];
-    white_kpp_diff[kThem] -= white_kpp_table[list_white[i]][kThem];
-
-    white_kpp_diff[kUs] -= white_cap_kpp_table[list_white[i]][kUs];
-    white_kpp_diff[kThem] -= white_cap_kpp_table[list_white[i]][kThem];
-#endif
-    kkpt += KKPT[black_king][white_king][list_black[i]][side_to_move];
+  KPPT_TARGET("avx2")
+  ValueUnit Sum() const {
+    ValueUnit value = {Value(HorizontalSum(us_)), Value(HorizontalSum(them_))};
+    return value;
   }
-#ifdef USE_SIMD_2
-  __m128i tmp = _mm_set_epi32(
-      *reinterpret_cast<const int32_t *>(
-          black_prev_kpp_table[prev_list_black[pos.list_index_capture()]]),
-      *reinterpret_cast<const int32_t *>(
-          black_kpp_table[list_black[pos.list_index_capture()]]),
-      *reinterpret_cast<const int32_t *>(
-          white_prev_kpp_table[prev_list_white[pos.list_index_capture()]]),
-      *reinterpret_cast<const int32_t *>(
-          white_kpp_table[list_white[pos.list_index_capture()]]));
-  __m256i tmp2 = _mm256_cvtepi16_epi32(tmp);
-  extra = _mm256_add_epi32(extra, tmp2);
-#else
-  // 前回ので引きすぎたのを足す
-  black_kpp_diff[kUs] +=
-      black_prev_kpp_table[prev_list_black[pos.list_index_capture()]][kUs];
-  black_kpp_diff[kThem] +=
-      black_prev_kpp_table[prev_list_black[pos.list_index_capture()]][kThem];
-
-  // 今回ので足しすぎたのを引く
-  black_kpp_diff[kUs] -=
-      black_kpp_table[list_black[pos.list_index_capture()]][kUs];
-  black_kpp_diff[kThem] -=
-      black_kpp_table[list_black[pos.list_index_capture()]][kThem];
-
-  // 前回ので引きすぎたのを足す
-  white_kpp_diff[kUs] -=
-      white_prev_kpp_table[prev_list_white[pos.list_index_capture()]][kUs];
-  white_kpp_diff[kThem] -=
-      white_prev_kpp_table[prev_list_white[pos.list_index_capture()]][kThem];
-
-  // 今回ので足しすぎたのを引く
-  white_kpp_diff[kUs] +=
-      white_kpp_table[list_white[pos.list_index_capture()]][kUs];
-  white_kpp_diff[kThem] +=
-      white_kpp_table[list_white[pos.list_index_capture()]][kThem];
-#endif
 
-#ifdef USE_SIMD_2
-  total_black =
-      _mm256_add_epi32(total_black, _mm256_srli_si256(total_black, 8));
-  __m128i sum_black = _mm_sub_epi32(_mm256_extracti128_si256(total_black, 0),
-                                    _mm256_extracti128_si256(total_black, 1));
-  extra = _mm256_sub_epi32(_mm256_srli_si256(extra, 8), extra);
-  sum_black = _mm_add_epi32(sum_black, _mm256_extracti128_si256(extra, 1));
-  black_kpp_diff[kUs] = _mm_extract_epi32(sum_black, 0);
-  black_kpp_diff[kThem] = _mm_extract_epi32(sum_black, 1);
-
-  total_white =
-      _mm256_add_epi32(total_white, _mm256_srli_si256(total_white, 8));
-  __m128i sum_white = _mm_sub_epi32(_mm256_extracti128_si256(total_white, 0),
-                                    _mm256_extracti128_si256(total_white, 1));
-  sum_white = _mm_add_epi32(sum_white, _mm256_extracti128_si256(extra, 0));
-  white_kpp_diff[kUs] = -_mm_extract_epi32(sum_white, 0);
-  white_kpp_diff[kThem] = -_mm_extract_epi32(sum_white, 1);
-#endif
+ private:
+  __m256i us_;
+  __m256i them_;
+};
+
+// 直前の手で変化する前の駒リストをlistに作る
+// Positionは現在の駒リストしか持たないので、StateInfoに残した変化前の値で戻す
+void MakePrevList(const Position &pos, Move last_move, Color c,
+                  KPPIndex *list) {
+  const StateInfo *st = pos.state_info();
+  std::memcpy(list, c == kBlack ? pos.black_kpp_list() : pos.white_kpp_list(),
+              sizeof(KPPIndex) * kListNum);
+  // 玉はリストに含まれないので、玉が動いた場合は取った駒だけが変化する
+  if (move_piece_type(last_move) != kKing)
+    list[st->list_index_move] = st->changed_value[c][0];
+  if (move_capture(last_move) != kPieceNone)
+    list[st->list_index_capture] = st->changed_value[c][1];
+}
 
-  parts.kppt[kBlack].us = last_parts.kppt[kBlack].us + black_kpp_diff[kUs];
-  parts.kppt[kBlack].them =
-      last_parts.kppt[kBlack].them + black_kpp_diff[kThem];
-  parts.kppt[kWhite].us = last_parts.kppt[kWhite].us + white_kpp_diff[kUs];
-  parts.kppt[kWhite].them =
-      last_parts.kppt[kWhite].them + white_kpp_diff[kThem];
+// 1つの玉から見た、駒リストの全ての組の和
+ValueUnit SumAllScalar(const int32_t *kpp, const KPPIndex *list) {
+  KppAccumulator sum;
+  for (int i = 1; i < kListNum; ++i) sum.AddRow(kpp, list[i], list, i);
+  return sum.Sum();
+}
 
-  parts.kkpt = static_cast<Value>(kkpt);
+KPPT_TARGET("avx2")
+ValueUnit SumAllAvx2(const int32_t *kpp, const KPPIndex *list) {
+  KppAccumulatorAvx2 sum;
+  for (int i = 1; i < kListNum; ++i) sum.AddRow(kpp, list[i], list, i);
+  return sum.Sum();
 }
 
-template <Color C>
-void CalcDifferenceKingMoveWithCapture(const Position &pos,
-                                       const EvalParts &last_parts,
-                                       EvalParts &parts) {
-  const KPPIndex *list_black = pos.black_kpp_list();
-  const KPPIndex *list_white = pos.white_kpp_list();
-  const Square black_king = pos.square_king(kBlack);
-  const Square white_king = pos.square_king(kWhite);
-  Square inv_white_king = inverse(pos.square_king(kWhite));
-
-  Color side_to_move = pos.side_to_move();
-  int black_kpp[kNumberOfColor] = {0};
-  int white_kpp[kNumberOfColor] = {0};
-  int kkpt = KKPT[black_king][white_king][list_black[0]][side_to_move];
-
-  if (C == kBlack) {
-#ifdef USE_SIMD_2
-    __m128i total_black = _mm_setzero_si128();
-    __m128i total_white = _mm_setzero_si128();
-#endif
-    const auto *black_kpp_table = KPPT[black_king];
-    const KPPIndex *prev_list_white = pos.prev_white_kpp_list();
-
-    const auto *white_prev_cap_kpp_table =
-        KPPT[inv_white_king][prev_list_white[pos.list_index_capture()]];
-    const auto *white_cap_kpp_table =
-        KPPT[inv_white_king][list_white[pos.list_index_capture()]];
-    int white_kpp_diff[kNumberOfColor] = {0};
-#ifdef USE_SIMD_2
-    __m128i tmp = _mm_set_epi32(
-        0, 0,
-        *reinterpret_cast<const int32_t *>(
-            white_prev_cap_kpp_table[prev_list_white[0]]),
-        *reinterpret_cast<const int32_t *>(white_cap_kpp_table[list_white[0]]));
-    tmp = _mm_cvtepi16_epi32(tmp);
-    total_white = _mm_add_epi32(total_white, tmp);
-#else
-    // とった分も引く
-    white_kpp_diff[kUs] += white_prev_cap_kpp_table[prev_list_white[0]][kUs];
-    white_kpp_diff[kThem] +=
-        white_prev_cap_kpp_table[prev_list_white[0]][kThem];
-
-    // 今回のを足す
-    white_kpp_diff[kUs] -= white_cap_kpp_table[list_white[0]][kUs];
-    white_kpp_diff[kThem] -= white_cap_kpp_table[list_white[0]][kThem];
-#endif
-    for (int i = 1; i < kListNum; ++i) {
-      const int k0 = list_black[i];
-      const auto *black_pp_table = black_kpp_table[k0];
-      for (int j = 0; j < i; ++j) {
-        const int l0 = list_black[j];
-#ifdef USE_SIMD_2
-        tmp = _mm_set_epi32(
-            0, 0, 0, *reinterpret_cast<const int32_t *>(black_pp_table[l0]));
-        tmp = _mm_cvtepi16_epi32(tmp);
-        total_black = _mm_add_epi32(total_black, tmp);
-#else
-        black_kpp[kUs] += black_pp_table[l0][kUs];
-        black_kpp[kThem] += black_pp_table[l0][kThem];
-#endif
-      }
-#ifdef USE_SIMD_2
-      tmp = _mm_set_epi32(0, 0,
-                          *reinterpret_cast<const int32_t *>(
-                              white_prev_cap_kpp_table[prev_list_white[i]]),
-                          *reinterpret_cast<const int32_t *>(
-                              white_cap_kpp_table[list_white[i]]));
-      tmp = _mm_cvtepi16_epi32(tmp);
-      total_white = _mm_add_epi32(total_white, tmp);
-#else
-      // とった分も引く
-      white_kpp_diff[kUs] += white_prev_cap_kpp_table[prev_list_white[i]][kUs];
-      white_kpp_diff[kThem] +=
-          white_prev_cap_kpp_table[prev_list_white[i]][kThem];
-
-      // 今回のを足す
-      white_kpp_diff[kUs] -= white_cap_kpp_table[list_white[i]][kUs];
-      white_kpp_diff[kThem] -= white_cap_kpp_table[list_white[i]][kThem];
-#endif
-      kkpt += KKPT[black_king][white_king][list_black[i]][side_to_move];
-    }
-#ifdef USE_SIMD_2
-    total_white = _mm_sub_epi32(total_white, _mm_srli_si128(total_white, 8));
-    black_kpp[kUs] = _mm_extract_epi32(total_black, 0);
-    black_kpp[kThem] = _mm_extract_epi32(total_black, 1);
-    white_kpp_diff[kUs] = -_mm_extract_epi32(total_white, 0);
-    white_kpp_diff[kThem] = -_mm_extract_epi32(total_white, 1);
-#endif
-    parts.kppt[kBlack].us = static_cast<Value>(black_kpp[kUs]);
-    parts.kppt[kBlack].them = static_cast<Value>(black_kpp[kThem]);
-    parts.kppt[kWhite].us = last_parts.kppt[kWhite].us + white_kpp_diff[kUs];
-    parts.kppt[kWhite].them =
-        last_parts.kppt[kWhite].them + white_kpp_diff[kThem];
-  } else {
-#ifdef USE_SIMD_2
-    __m128i total_black = _mm_setzero_si128();
-    __m128i total_white = _mm_setzero_si128();
-#endif
-    const KPPIndex *prev_list_black = pos.prev_black_kpp_list();
-
-    const auto *black_prev_cap_kpp_table =
-        KPPT[black_king][prev_list_black[pos.list_index_capture()]];
-    const auto *black_cap_kpp_table =
-        KPPT[black_king][list_black[pos.list_index_capture()]];
-    const auto *white_kpp_table = KPPT[inv_white_king];
-    int black_kpp_diff[kNumberOfColor] = {0};
-#ifdef USE_SIMD_2
-    __m128i tmp = _mm_set_epi32(
-        0, 0,
-        *reinterpret_cast<const int32_t *>(
-            black_prev_cap_kpp_table[prev_list_black[0]]),
-        *reinterpret_cast<const int32_t *>(black_cap_kpp_table[list_black[0]]));
-    tmp = _mm_cvtepi16_epi32(tmp);
-    total_black = _mm_add_epi32(total_black, tmp);
-#else
-    // とった分も引く
-    black_kpp_diff[kUs] -= black_prev_cap_kpp_table[prev_list_black[0]][kUs];
-    black_kpp_diff[kThem] -=
-        black_prev_cap_kpp_table[prev_list_black[0]][kThem];
-
-    // 今回のを足す
-    black_kpp_diff[kUs] += black_cap_kpp_table[list_black[0]][kUs];
-    black_kpp_diff[kThem] += black_cap_kpp_table[list_black[0]][kThem];
-#endif
-    for (int i = 1; i < kListNum; ++i) {
-      const int k1 = list_white[i];
-      const auto *white_pp_table = white_kpp_table[k1];
-      for (int j = 0; j < i; ++j) {
-        const int l1 = list_white[j];
-#ifdef USE_SIMD_2
-        tmp = _mm_set_epi32(
-            0, 0, 0, *reinterpret_cast<const int32_t *>(white_pp_table[l1]));
-        tmp = _mm_cvtepi16_epi32(tmp);
-        total_white = _mm_add_epi32(total_white, tmp);
-#else
-        white_kpp[kUs] -= white_pp_table[l1][kUs];
-        white_kpp[kThem] -= white_pp_table[l1][kThem];
-#endif
-      }
-#ifdef USE_SIMD_2
-      tmp = _mm_set_epi32(0, 0,
-                          *reinterpret_cast<const int32_t *>(
-                              black_prev_cap_kpp_table[prev_list_black[i]]),
-                          *reinterpret_cast<const int32_t *>(
-                              black_cap_kpp_table[list_black[i]]));
-      tmp = _mm_cvtepi16_epi32(tmp);
-      total_black = _mm_add_epi32(total_black, tmp);
-#else
-      // とった分も引く
-      black_kpp_diff[kUs] -= black_prev_cap_kpp_table[prev_list_black[i]][kUs];
-      black_kpp_diff[kThem] -=
-          black_prev_cap_kpp_table[prev_list_black[i]][kThem];
-
-      // 今回のを足す
-      black_kpp_diff[kUs] += black_cap_kpp_table[list_black[i]][kUs];
-      black_kpp_diff[kThem] += black_cap_kpp_table[list_black[i]][kThem];
-#endif
-      kkpt += KKPT[black_king][white_king][list_black[i]][side_to_move];
+// CalcPartでは変化した駒同士の組を2回数えているので、その1回分
+ValueUnit CalcChangedPairs(const int32_t *kpp, const KPPIndex *current,
+                           const KPPIndex *before, const int *index,
+                           int num) {
+  ValueUnit value = {kValueZero, kValueZero};
+  for (int i = 1; i < num; ++i) {
+    for (int j = 0; j < i; ++j) {
+      value += Unpack(kpp[KppOffset(current[index[i]], current[index[j]])]);
+      value -= Unpack(kpp[KppOffset(before[index[i]], before[index[j]])]);
     }
-#ifdef USE_SIMD_2
-    total_black = _mm_sub_epi32(total_black, _mm_srli_si128(total_black, 8));
-    black_kpp_diff[kUs] = _mm_extract_epi32(total_black, 0);
-    black_kpp_diff[kThem] = _mm_extract_epi32(total_black, 1);
-    white_kpp[kUs] = -_mm_extract_epi32(total_white, 0);
-    white_kpp[kThem] = -_mm_extract_epi32(total_white, 1);
-#endif
-    parts.kppt[kBlack].us = last_parts.kppt[kBlack].us + black_kpp_diff[kUs];
-    parts.kppt[kBlack].them =
-        last_parts.kppt[kBlack].them + black_kpp_diff[kThem];
-    parts.kppt[kWhite].us = static_cast<Value>(white_kpp[kUs]);
-    parts.kppt[kWhite].them = static_cast<Value>(white_kpp[kThem]);
   }
-  parts.kkpt = static_cast<Value>(kkpt);
+  return value;
 }
 
-template <Color C>
-void CalcDifferenceKingMoveWithoutCapture(const Position &pos,
-                                          const EvalParts &last_parts,
-                                          EvalParts &parts) {
-  const KPPIndex *list_black = pos.black_kpp_list();
-  const KPPIndex *list_white = pos.white_kpp_list();
-  const Square sq_black_king = pos.square_king(kBlack);
-  const Square sq_white_king = pos.square_king(kWhite);
-  Square inv_sq_white_king = inverse(pos.square_king(kWhite));
-
-  Color side_to_move = pos.side_to_move();
-  int black_kpp[kNumberOfColor] = {0};
-  int white_kpp[kNumberOfColor] = {0};
-  int kkpt = KKPT[sq_black_king][sq_white_king][list_black[0]][side_to_move];
-  if (C == kBlack) {
-    const auto *black_kpp_table = KPPT[sq_black_king];
-    for (int i = 1; i < kListNum; ++i) {
-      const int k0 = list_black[i];
-      const auto *black_pp_table = black_kpp_table[k0];
-      for (int j = 0; j < i; ++j) {
-        const int l0 = list_black[j];
-        black_kpp[kUs] += black_pp_table[l0][kUs];
-        black_kpp[kThem] += black_pp_table[l0][kThem];
-      }
-      kkpt += KKPT[sq_black_king][sq_white_king][list_black[i]][side_to_move];
-    }
-    parts.kppt[kBlack].us = static_cast<Value>(black_kpp[kUs]);
-    parts.kppt[kBlack].them = static_cast<Value>(black_kpp[kThem]);
-    parts.kppt[kWhite] = last_parts.kppt[kWhite];
-  } else {
-    const auto *white_kpp_table = KPPT[inv_sq_white_king];
-    for (int i = 1; i < kListNum; ++i) {
-      const int k1 = list_white[i];
-      const auto *white_pp_table = white_kpp_table[k1];
-      for (int j = 0; j < i; ++j) {
-        const int l1 = list_white[j];
-        white_kpp[kUs] -= white_pp_table[l1][kUs];
-        white_kpp[kThem] -= white_pp_table[l1][kThem];
-      }
-      kkpt += KKPT[sq_black_king][sq_white_king][list_black[i]][side_to_move];
-    }
-    parts.kppt[kBlack] = last_parts.kppt[kBlack];
-    parts.kppt[kWhite].us = static_cast<Value>(white_kpp[kUs]);
-    parts.kppt[kWhite].them = static_cast<Value>(white_kpp[kThem]);
+// 駒リストのindex[0..num)番目がbeforeからcurrentに変わった時の、
+// 1つの玉から見た差分
+ValueUnit CalcPartScalar(const int32_t *kpp, const KPPIndex *current,
+                         const KPPIndex *before, const int *index, int num) {
+  KppAccumulator added;
+  KppAccumulator removed;
+  for (int i = 0; i < num; ++i) {
+    added.AddRow(kpp, current[index[i]], current, kListNum);
+    removed.AddRow(kpp, before[index[i]], before, kListNum);
+  }
+  return added.Sum() - removed.Sum() -
+         CalcChangedPairs(kpp, current, before, index, num);
+}
+
+KPPT_TARGET("avx2")
+ValueUnit CalcPartAvx2(const int32_t *kpp, const KPPIndex *current,
+                       const KPPIndex *before, const int *index, int num) {
+  KppAccumulatorAvx2 added;
+  KppAccumulatorAvx2 removed;
+  for (int i = 0; i < num; ++i) {
+    added.AddRow(kpp, current[index[i]], current, kListNum);
+    removed.AddRow(kpp, before[index[i]], before, kListNum);
   }
-  parts.kkpt = static_cast<Value>(kkpt);
+  return added.Sum() - removed.Sum() -
+         CalcChangedPairs(kpp, current, before, index, num);
 }
 
 #if defined(_MSC_VER)
@@ -617,152 +257,188 @@ uint32_t FirstOne(uint64_t b) {
 uint32_t FirstOne(uint64_t b) { return __builtin_ctzll(b); }
 #endif
 
-void CalcDifference(const Position &pos, Move last_move,
-                    const EvalParts &last_parts, EvalParts &parts) {
-  const Square from = move_from(last_move);
-  const PieceType type = move_piece_type(last_move);
-
-  if (type == kKing) {
-    Color enemy = ~pos.side_to_move();
-    Square king = pos.square_king(enemy);
-    auto list = (pos.side_to_move() == kBlack) ? pos.white_kpp_list()
-                                               : pos.black_kpp_list();
-    auto entry = pos.this_thread()->kpp_list_.GetList(enemy, king);
-    auto cache_value = pos.this_thread()->kpp_list_.GetValue(enemy, king);
-    int count = 0;
-    int index[kKingBrotherDiffSize];
-#ifdef USE_SIMD
-    if (cache_value.us != kValueZero) {
-      // listの一致しない箇所のbitを立てる
-      uint64_t bit = 0;
-      for (int i = 0; i < 2; ++i) {
-        __m256i current =
-            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(list + i * 16));
-        __m256i old = _mm256_loadu_si256(
-            reinterpret_cast<const __m256i *>(entry + i * 16));
-        // 現在と保存してあるlistを比較する
-        // 一致する箇所は全て1となり一致しない箇所は全て0で埋まる
-        __m256i cmp = _mm256_cmpeq_epi16(current, old);
-        // __m256iを__m128iに分ける
-        __m128i ext0 = _mm256_extracti128_si256(cmp, 0);
-        __m128i ext1 = _mm256_extracti128_si256(cmp, 1);
-        // 16bit -> 8bitに変換する
-        __m128i pack = _mm_packs_epi16(ext0, ext1);
-        // 一致しない箇所を1にするためnotをとる
-        pack = _mm_andnot_si128(pack, _mm_set1_epi8(-1));
-        // 1bitだけあればよいので最上位bitを抽出する
-        bit |= (static_cast<uint64_t>(_mm_movemask_epi8(pack)) << i * 16);
-      }
-      {
-        __m128i current = _mm_set_epi16(0, 0, list[37], list[36], list[35],
-                                        list[34], list[33], list[32]);
-        __m128i old = _mm_set_epi16(0, 0, entry[37], entry[36], entry[35],
-                                    entry[34], entry[33], entry[32]);
-        __m128i cmp = _mm_cmpeq_epi16(current, old);
-        __m128i pack = _mm_packs_epi16(cmp, _mm_set1_epi8(-1));
-        pack = _mm_andnot_si128(pack, _mm_set1_epi8(-1));
-        bit |= (static_cast<uint64_t>(_mm_movemask_epi8(pack)) << 32);
-      }
-      if (_mm_popcnt_u64(bit) < kKingBrotherDiffSize) {
-        while (bit != 0) {
-          uint32_t p = FirstOne(bit);
-          index[count++] = p;
-          bit ^= (1LLU << p);
-        }
-      } else {
-        cache_value.us = kValueZero;
-        cache_value.them = kValueZero;
-      }
-    }
-#else
-    if (cache_value != kValueZero) {
-      for (int i = 0; i < kListNum; ++i) {
-        if (entry[i] != list[i]) {
-          if (count == kKingBrotherDiffSize) {
-            cache_value = kValueZero;
-            break;
-          }
-          index[count++] = i;
-        }
-      }
-    }
-#endif
-    if (move_capture(last_move) == kPieceNone) {
-      if (cache_value.us == kValueZero) {
-        if (pos.side_to_move() == kBlack)
-          CalcDifferenceKingMoveWithoutCapture<kWhite>(pos, last_parts, parts);
-        else
-          CalcDifferenceKingMoveWithoutCapture<kBlack>(pos, last_parts, parts);
-      } else {
-        if (enemy == kBlack) {
-          parts.kppt[kBlack] = cache_value;
-          if (count != 0)
-            parts.kppt[kBlack] +=
-                CalcPart(king, pos.black_kpp_list(), entry, index, count);
-          parts.kppt[kWhite] = last_parts.kppt[kWhite];
-          parts.kkpt = CalcKkptValue(pos);
-        } else {
-          parts.kppt[kBlack] = last_parts.kppt[kBlack];
-          parts.kppt[kWhite] = cache_value;
-          if (count != 0)
-            parts.kppt[kWhite] -= CalcPart(inverse(king), pos.white_kpp_list(),
-                                           entry, index, count);
-          parts.kkpt = CalcKkptValue(pos);
-        }
-      }
-    } else {
-      if (cache_value.us == kValueZero) {
-        if (pos.side_to_move() == kBlack)
-          CalcDifferenceKingMoveWithCapture<kWhite>(pos, last_parts, parts);
-        else
-          CalcDifferenceKingMoveWithCapture<kBlack>(pos, last_parts, parts);
-      } else {
-        if (enemy == kBlack) {
-          parts.kppt[kBlack] = cache_value;
-          if (count != 0)
-            parts.kppt[kBlack] +=
-                CalcPart(king, pos.black_kpp_list(), entry, index, count);
-          int cap = pos.list_index_capture();
-          parts.kppt[kWhite] =
-              last_parts.kppt[kWhite] -
-              CalcPart(inverse(pos.square_king(kWhite)), pos.white_kpp_list(),
-                       pos.prev_white_kpp_list(), &cap, 1);
-          parts.kkpt = CalcKkptValue(pos);
-        } else {
-          int cap = pos.list_index_capture();
-          parts.kppt[kBlack] =
-              last_parts.kppt[kBlack] +
-              CalcPart(pos.square_king(kBlack), pos.black_kpp_list(),
-                       pos.prev_black_kpp_list(), &cap, 1);
-          parts.kppt[kWhite] = cache_value;
-          if (count != 0)
-            parts.kppt[kWhite] -= CalcPart(inverse(king), pos.white_kpp_list(),
-                                           entry, index, count);
-          parts.kkpt = CalcKkptValue(pos);
-        }
-      }
+// listとentryの一致しない箇所の番号をindexに入れて、その数を返す
+// kKingBrotherDiffSize箇所以上違う場合は差分で計算せずに-1を返す
+// CPUによって探索が変わらないように、AVX2の実装と同じ数で打ち切る
+int DiffListScalar(const KPPIndex *list, const KPPIndex *entry, int *index) {
+  int count = 0;
+  for (int i = 0; i < kListNum; ++i) {
+    if (entry[i] != list[i]) {
+      if (count == kKingBrotherDiffSize - 1) return -1;
+      index[count++] = i;
     }
+  }
+  return count;
+}
+
+KPPT_TARGET("avx2,popcnt")
+int DiffListAvx2(const KPPIndex *list, const KPPIndex *entry, int *index) {
+  // listの一致しない箇所のbitを立てる
+  uint64_t bit = 0;
+  for (int i = 0; i < 2; ++i) {
+    __m256i current =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(list + i * 16));
+    __m256i old =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(entry + i * 16));
+    // 現在と保存してあるlistを比較する
+    // 一致する箇所は全て1となり一致しない箇所は全て0で埋まる
+    __m256i cmp = _mm256_cmpeq_epi16(current, old);
+    // __m256iを__m128iに分ける
+    __m128i ext0 = _mm256_extracti128_si256(cmp, 0);
+    __m128i ext1 = _mm256_extracti128_si256(cmp, 1);
+    // 16bit -> 8bitに変換する
+    __m128i pack = _mm_packs_epi16(ext0, ext1);
+    // 一致しない箇所を1にするためnotをとる
+    pack = _mm_andnot_si128(pack, _mm_set1_epi8(-1));
+    // 1bitだけあればよいので最上位bitを抽出する
+    bit |= (static_cast<uint64_t>(_mm_movemask_epi8(pack)) << i * 16);
+  }
+  {
+    __m128i current = _mm_set_epi16(0, 0, list[37], list[36], list[35],
+                                    list[34], list[33], list[32]);
+    __m128i old = _mm_set_epi16(0, 0, entry[37], entry[36], entry[35],
+                                entry[34], entry[33], entry[32]);
+    __m128i cmp = _mm_cmpeq_epi16(current, old);
+    __m128i pack = _mm_packs_epi16(cmp, _mm_set1_epi8(-1));
+    pack = _mm_andnot_si128(pack, _mm_set1_epi8(-1));
+    bit |= (static_cast<uint64_t>(_mm_movemask_epi8(pack)) << 32);
+  }
+  if (_mm_popcnt_u64(bit) >= kKingBrotherDiffSize) return -1;
+
+  int count = 0;
+  while (bit != 0) {
+    uint32_t p = FirstOne(bit);
+    index[count++] = p;
+    bit ^= (1LLU << p);
+  }
+  return count;
+}
+
+// 命令セットごとに切り替える処理。SelectKernelで実行しているCPUに合わせて選ぶ
+struct KppKernel {
+  ValueUnit (*sum_all)(const int32_t *kpp, const KPPIndex *list);
+  ValueUnit (*calc_part)(const int32_t *kpp, const KPPIndex *current,
+                         const KPPIndex *before, const int *index, int num);
+  int (*diff_list)(const KPPIndex *list, const KPPIndex *entry, int *index);
+};
+
+constexpr KppKernel kScalarKernel = {SumAllScalar, CalcPartScalar,
+                                     DiffListScalar};
+constexpr KppKernel kAvx2Kernel = {SumAllAvx2, CalcPartAvx2, DiffListAvx2};
+
+// SelectKernelより前に呼ばれても動くように、どのCPUでも動く実装にしておく
+KppKernel g_kernel = kScalarKernel;
+
+void SelectKernel(bool avx2) {
+  g_kernel = avx2 ? kAvx2Kernel : kScalarKernel;
+}
+
+inline ValueUnit SumAll(const int32_t *kpp, const KPPIndex *list) {
+  return g_kernel.sum_all(kpp, list);
+}
 
-    // 差分がない場合はコピーしないようにする
-    // ただほとんどないので意味がないかも
-    if (cache_value.us == kValueZero) {
-      pos.this_thread()->kpp_list_.SetList(enemy, king, list);
-      auto v = (pos.side_to_move() == kBlack) ? parts.kppt[kWhite]
-                                              : parts.kppt[kBlack];
-      pos.this_thread()->kpp_list_.SetValue(enemy, king, v);
+inline ValueUnit CalcPart(const int32_t *kpp, const KPPIndex *current,
+                          const KPPIndex *before, const int *index, int num) {
+  return g_kernel.calc_part(kpp, current, before, index, num);
+}
+
+void CalcFull(const Position &pos, EvalParts &parts) {
+  parts.kppt[kBlack] =
+      SumAll(KppTable(pos.square_king(kBlack)), pos.black_kpp_list());
+  parts.kppt[kWhite] = Negate(SumAll(KppTable(inverse(pos.square_king(kWhite))),
+                                     pos.white_kpp_list()));
+  parts.kkpt = CalcKkptValue(pos);
+}
+
+// 玉以外の駒が動いた場合
+void CalcDifferencePieceMove(const Position &pos, Move last_move,
+                             const EvalParts &last_parts, EvalParts &parts) {
+  const StateInfo *st = pos.state_info();
+  assert(st->list_index_move < kListNum);
+
+  const int index[2] = {st->list_index_move, st->list_index_capture};
+  const int num = move_capture(last_move) != kPieceNone ? 2 : 1;
+
+  KPPIndex prev_list_black[kListNum];
+  KPPIndex prev_list_white[kListNum];
+  MakePrevList(pos, last_move, kBlack, prev_list_black);
+  MakePrevList(pos, last_move, kWhite, prev_list_white);
+
+  parts.kppt[kBlack] =
+      last_parts.kppt[kBlack] + CalcPart(KppTable(pos.square_king(kBlack)),
+                                         pos.black_kpp_list(),
+                                         prev_list_black, index, num);
+  parts.kppt[kWhite] =
+      last_parts.kppt[kWhite] -
+      CalcPart(KppTable(inverse(pos.square_king(kWhite))),
+               pos.white_kpp_list(), prev_list_white, index, num);
+  parts.kkpt = CalcKkptValue(pos);
+}
+
+// 玉が動いた場合
+// 動いた玉から見た値は全て計算し直すが、前回同じ位置にいた時の値と駒リストが
+// 残っていれば、駒リストの違う箇所の差分だけを計算する
+void CalcDifferenceKingMove(const Position &pos, Move last_move,
+                            const EvalParts &last_parts, EvalParts &parts) {
+  const Color enemy = ~pos.side_to_move();
+  const Square king = pos.square_king(enemy);
+  const int32_t *kpp = KppTable(enemy == kBlack ? king : inverse(king));
+  const KPPIndex *list =
+      enemy == kBlack ? pos.black_kpp_list() : pos.white_kpp_list();
+  Thread *this_thread = pos.this_thread();
+  const KPPIndex *entry = this_thread->kpp_list_.GetList(enemy, king);
+  ValueUnit cache_value = this_thread->kpp_list_.GetValue(enemy, king);
+  int count = 0;
+  int index[kKingBrotherDiffSize];
+  if (cache_value.us != kValueZero) {
+    count = g_kernel.diff_list(list, entry, index);
+    if (count < 0) {
+      count = 0;
+      cache_value.us = kValueZero;
+      cache_value.them = kValueZero;
     }
-  } else {
-    if (from >= kBoardSquare) {
-      CalcDifferenceWithoutCapture(pos, last_parts, parts);
-    } else {
-      const PieceType capture = move_capture(last_move);
+  }
 
-      if (capture == kPieceNone)
-        CalcDifferenceWithoutCapture(pos, last_parts, parts);
+  // partsと同じく後手の値は符号を反転して持つ
+  if (cache_value.us == kValueZero) {
+    ValueUnit sum = SumAll(kpp, list);
+    parts.kppt[enemy] = enemy == kBlack ? sum : Negate(sum);
+    this_thread->kpp_list_.SetList(enemy, king, list);
+    this_thread->kpp_list_.SetValue(enemy, king, parts.kppt[enemy]);
+  } else {
+    parts.kppt[enemy] = cache_value;
+    if (count != 0) {
+      ValueUnit part = CalcPart(kpp, list, entry, index, count);
+      if (enemy == kBlack)
+        parts.kppt[enemy] += part;
       else
-        CalcDifferenceWithCapture(pos, last_parts, parts);
+        parts.kppt[enemy] -= part;
     }
   }
+
+  // 相手の玉から見ると、取られた駒だけが変化する
+  const Color us = pos.side_to_move();
+  parts.kppt[us] = last_parts.kppt[us];
+  if (move_capture(last_move) != kPieceNone) {
+    const int cap = pos.state_info()->list_index_capture;
+    KPPIndex prev_list[kListNum];
+    MakePrevList(pos, last_move, us, prev_list);
+    if (us == kBlack)
+      parts.kppt[us] += CalcPart(KppTable(pos.square_king(kBlack)),
+                                 pos.black_kpp_list(), prev_list, &cap, 1);
+    else
+      parts.kppt[us] -= CalcPart(KppTable(inverse(pos.square_king(kWhite))),
+                                 pos.white_kpp_list(), prev_list, &cap, 1);
+  }
+  parts.kkpt = CalcKkptValue(pos);
+}
+
+void CalcDifference(const Position &pos, Move last_move,
+                    const EvalParts &last_parts, EvalParts &parts) {
+  if (move_piece_type(last_move) == kKing)
+    CalcDifferenceKingMove(pos, last_move, last_parts, parts);
+  else
+    CalcDifferencePieceMove(pos, last_move, last_parts, parts);
 }
 
 Value CalcKkptValue(const Position &pos) {
@@ -770,7 +446,7 @@ Value CalcKkptValue(const Position &pos) {
   Square black_king = pos.square_king(kBlack);
   Square white_king = pos.square_king(kWhite);
   Color color = pos.side_to_move();
-  KPPIndex *list_black = pos.black_kpp_list();
+  const KPPIndex *list_black = pos.black_kpp_list();
 
   for (int i = 0; i < kListNum; ++i)
     score += KKPT[black_king][white_king][list_black[i]][color];
@@ -779,8 +455,11 @@ Value CalcKkptValue(const Position &pos) {
 
 Value evaluate(const Position &pos, SearchStack *ss) {
   Value score;
-  Entry *e = pos.this_thread()->eval_hash_[pos.key()];
+  Thread *this_thread = pos.this_thread();
+  Entry *e = this_thread->kppt_hash_[pos.key()];
+  ++this_thread->eval_probes_;
   if (e->key == pos.key()) {
+    ++this_thread->eval_hits_;
     ss->eval_parts = e->parts;
   } else {
     Move last_move = (ss - 1)->current_move;
@@ -818,17 +497,105 @@ Value evaluate(const Position &pos, SearchStack *ss) {
   return score;
 }
 
-bool init() {
-  std::ifstream ifs("kppt_kkpt.bin", std::ios::in | std::ios::binary);
-  if (!ifs) {
-    std::memset(KPPT, 0, sizeof(KPPT));
-    std::memset(KKPT, 0, sizeof(KKPT));
+namespace {
+void MakeHeader(KpptFileHeader &header) {
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kKpptFileMagic, sizeof(header.magic));
+  header.fe_end = kFEEnd;
+  header.board_square = kBoardSquare;
+  header.payload_size = kKpptBytes + kKkptBytes;
+}
+
+void SetTables(const char *payload) {
+  KPPT = reinterpret_cast<const int32_t *>(payload);
+  KKPT = reinterpret_cast<const int16_t(*)[kBoardSquare][kFEEnd][kNumberOfColor]>(
+      payload + kKpptBytes);
+}
+
+bool MapFoldedFile(const std::string &path) {
+  if (!g_mapped.open(path)) return false;
+
+  KpptFileHeader header;
+  KpptFileHeader expected;
+  MakeHeader(expected);
+  if (g_mapped.size() != sizeof(header) + expected.payload_size) {
+    g_mapped.close();
+    return false;
+  }
+  std::memcpy(&header, g_mapped.data(), sizeof(header));
+  if (std::memcmp(&header, &expected, sizeof(header)) != 0) {
+    g_mapped.close();
+    return false;
+  }
+  SetTables(g_mapped.data() + sizeof(header));
+  return true;
+}
+
+// 正方形の形式のファイルを読み、三角形の形式にしてpayloadに書く
+bool FoldSquareFile(const std::string &path, char *payload) {
+  std::ifstream ifs(path, std::ios::in | std::ios::binary);
+  if (!ifs) return false;
+
+  std::vector<int16_t> square(size_t(kFEEnd) * kFEEnd * int(kNumberOfColor));
+  int32_t *kppt = reinterpret_cast<int32_t *>(payload);
+  for (int k = 0; k < kBoardSquare; ++k) {
+    ifs.read(reinterpret_cast<char *>(square.data()),
+             sizeof(int16_t) * square.size());
+    int32_t *triangle = kppt + k * kKppTriangleSize;
+    for (int i = 0; i < kFEEnd; ++i)
+      for (int j = 0; j <= i; ++j)
+        std::memcpy(&triangle[KppOffset(i, j)],
+                    &square[(size_t(i) * kFEEnd + j) * int(kNumberOfColor)],
+                    sizeof(int32_t));
+  }
+  ifs.read(payload + kKpptBytes, kKkptBytes);
+  return static_cast<bool>(ifs);
+}
+
+bool WriteFoldedFile(const std::string &path, const std::vector<char> &buffer) {
+  // 書きかけのファイルを他のプロセスがマップしないように、別名で書いてから置き換える
+  const std::string temp_path = temporary_path(path);
+  std::ofstream ofs(temp_path, std::ios::out | std::ios::binary);
+  ofs.write(buffer.data(), buffer.size());
+  ofs.close();
+  if (!ofs) std::remove(temp_path.c_str());
+  if (!ofs || !replace_file(temp_path, path)) {
+    std::cerr << "Failed to write evaluation file " << path << "."
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+}  // namespace
+
+bool init(const std::string &folded_path, const std::string &square_path) {
+  release();
+  if (MapFoldedFile(folded_path)) return true;
+
+  g_buffer.assign(sizeof(KpptFileHeader) + kKpptBytes + kKkptBytes, 0);
+  MakeHeader(*reinterpret_cast<KpptFileHeader *>(g_buffer.data()));
+  char *payload = g_buffer.data() + sizeof(KpptFileHeader);
+  if (!FoldSquareFile(square_path, payload)) {
+    std::cerr << "Failed to load evaluation file " << square_path << "."
+              << std::endl;
+    std::memset(payload, 0, kKpptBytes + kKkptBytes);
+    SetTables(payload);
     return false;
   }
-  ifs.read(reinterpret_cast<char *>(KPPT), sizeof(KPPT));
-  ifs.read(reinterpret_cast<char *>(KKPT), sizeof(KKPT));
-  ifs.close();
 
+  // 次からはマップして使えるように、三角形の形式で書き出しておく
+  if (WriteFoldedFile(folded_path, g_buffer) && MapFoldedFile(folded_path)) {
+    std::vector<char>().swap(g_buffer);
+    return true;
+  }
+  SetTables(payload);
   return true;
 }
+
+void release() {
+  g_mapped.close();
+  std::vector<char>().swap(g_buffer);
+  KPPT = nullptr;
+  KKPT = nullptr;
+}
 }  // namespace Eval
@@ -21,6 +21,7 @@
 
 #include <array>
 #include <cstring>
+#include <string>
 
 #include "move.h"
 #include "types.h"
@@ -244,7 +245,6 @@ constexpr int ExchangePieceValueTable[kPieceTypeMax] = {
     PieceValueTable[kHorse] + PieceValueTable[kBishop],
     PieceValueTable[kDragon] + PieceValueTable[kRook]};
 
-constexpr int kTableSize = 131072;
 constexpr int kListNum = 38;
 constexpr int kFvScale = 32;
 
@@ -289,18 +289,9 @@ struct Entry {
   Key key;
 };
 
-struct HashTable {
-  Entry *operator[](Key key) {
-    return &table[(uint32_t)key & (kTableSize - 1)];
-  }
-  void Clear() { table.fill({}); }
- private:
-  std::array<Entry, kTableSize> table;
-};
-
 class KppListTable {
  public:
-  void SetList(Color c, Square k, KPPIndex *list) {
+  void SetList(Color c, Square k, const KPPIndex *list) {
     std::memcpy(table_[c][k], list, sizeof(KPPIndex) * kListNum);
   }
 
@@ -320,14 +311,21 @@ inline Square inverse(Square sq) {
   return static_cast<Square>(kBoardSquare - 1 - sq);
 }
 
-bool init();
+// KPPT,KKPTを読み込む。読めない場合は0で埋めてfalseを返す
+// KPPTは対称なので半分だけを持つ形式(folded_path)をマップして使う
+// ない場合はsquare_pathの元の形式を変換し、folded_pathに書き出しておく
+// 表は大きいので、EvalTypeでKPPTを選んだ場合だけ読み込む
+bool init(const std::string &folded_path, const std::string &square_path);
+
+// 読み込んだ表を解放する
+void release();
 
 Value evaluate(const Position &pos, SearchStack *ss);
 
-Value CalcKkptValue(const Position &pos);
+// 命令セットごとの実装を選ぶ。CPUの判定はeval::SelectKernelで行う
+void SelectKernel(bool avx2);
 
-extern int16_t KPPT[kBoardSquare][kFEEnd][kFEEnd][kNumberOfColor];
-extern int16_t KKPT[kBoardSquare][kBoardSquare][kFEEnd][kNumberOfColor];
+Value CalcKkptValue(const Position &pos);
 
 }  // namespace Eval
 
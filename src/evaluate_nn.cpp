@@ -3,23 +3,31 @@
 #endif
 
 #include "evaluate_nn.h"
+#include <cmath>
 #include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <vector>
 #include "evaluate.h"
+#include "evaluate_nn_kernel.h"
 #include "position.h"
 #include "search.h"
 #include "thread.h"
 #include "types.h"
-
-const __m256i kZero = _mm256_setzero_si256();
-const __m256i kOnes = _mm256_set1_epi16(1);
-const __m256i kOffsets = _mm256_set_epi32(7, 3, 6, 2, 5, 1, 4, 0);
+#include "usi.h"
 
 namespace eval {
 NnFeature g_nnfeature;
 Network g_network;
 
 NnFeature::NnFeature() {
-  if (!Allocate()) Free();
+#ifdef LEARN
+  // wK̓p[^̂ōŏ̈mۂĂ
+  if (Allocate()) {
+    bias_ = storage_;
+    kp_ = storage_ + kFeatureDemention;
+  }
+#endif
 }
 
 NnFeature::~NnFeature() { Free(); }
@@ -29,219 +37,315 @@ void NnFeature::MakeFeature(const Position& pos, Feature& feature) const {
                      Eval::inverse(pos.square_king(kWhite))};
   const Eval::KPPIndex* list[2] = {pos.black_kpp_list(), pos.white_kpp_list()};
   for (int c = 0; c < 2; c++) {
-    auto f = reinterpret_cast<__m256i*>(feature.feature[c]);
-    std::memcpy(feature.feature[c], bias_,
-                sizeof(std::int16_t) * kFeatureDemention);
-    for (int i = 0; i < 38; i++) {
-      int offset = (kings[c] * Eval::kFEEnd + list[c][i]) * kFeatureDemention;
-      auto weight = reinterpret_cast<__m256i*>(kp_ + offset);
-      for (int j = 0; j < 16; j++) {
-        f[j] = _mm256_add_epi16(f[j], weight[j]);
-      }
-    }
+    UpdateFeature(feature.feature[c], kings[c], list[c]);
   }
 }
 
 void NnFeature::UpdateFeature(const Position& pos, Feature& feature) const {
   Square kings[2] = {pos.square_king(kBlack),
                      Eval::inverse(pos.square_king(kWhite))};
-  const Eval::KPPIndex* old_list[kNumberOfColor] = {
-      pos.old_index_value(kBlack), pos.old_index_value(kWhite)};
   for (int c = 0; c < 2; c++) {
-    auto f = reinterpret_cast<__m256i*>(feature.feature[c]);
-    for (int i = 0; i < pos.chenged_index_num(); i++) {
-      int offset =
-          (kings[c] * Eval::kFEEnd + old_list[c][i]) * kFeatureDemention;
-      auto weight = reinterpret_cast<__m256i*>(kp_ + offset);
-      for (int j = 0; j < 16; j++) {
-        f[j] = _mm256_sub_epi16(f[j], weight[j]);
-      }
-    }
+    ApplyRows(feature.feature[c], feature.feature[c], kings[c],
+              pos.old_index_value(Color(c)), pos.chenged_index_num(),
+              pos.new_index_value(Color(c)), pos.chenged_index_num());
   }
+}
 
-  const Eval::KPPIndex* new_list[kNumberOfColor] = {
-      pos.new_index_value(kBlack), pos.new_index_value(kWhite)};
+void NnFeature::UpdateFeature(int16_t* feature, Square king,
+                              const Eval::KPPIndex* list) const {
+  ApplyRows(feature, bias_, king, nullptr, 0, list, kKpListLength);
+}
 
-  for (int c = 0; c < 2; c++) {
-    auto f = reinterpret_cast<__m256i*>(feature.feature[c]);
-    for (int i = 0; i < pos.chenged_index_num(); i++) {
-      int offset =
-          (kings[c] * Eval::kFEEnd + new_list[c][i]) * kFeatureDemention;
-      auto weight = reinterpret_cast<__m256i*>(kp_ + offset);
-      for (int j = 0; j < 16; j++) {
-        f[j] = _mm256_add_epi16(f[j], weight[j]);
-      }
+void NnFeature::UpdateFeature(int16_t* output, const int16_t* input,
+                              Square king, const Eval::KPPIndex* old_list,
+                              const Eval::KPPIndex* new_list, int num) const {
+  assert(num <= kMaxAccumulatorDistance * 2);
+  ApplyRows(output, input, king, old_list, num, new_list, num);
+}
+
+// entryɕێĂʂ獷ŋ߂
+// 傫ꍇ͑SvZentryXVBŋ߂ꍇtrueԂ
+bool NnFeature::RefreshFeature(int16_t* feature, Square king,
+                               const Eval::KPPIndex* list,
+                               RefreshEntry* entry) const {
+  Eval::KPPIndex sub[kKpListLength];
+  Eval::KPPIndex add[kKpListLength];
+  int diff_num = kKpListLength;
+  if (entry->valid) {
+    diff_num = 0;
+    for (int i = 0; i < kKpListLength; i++) {
+      if (entry->list[i] == list[i]) continue;
+      sub[diff_num] = entry->list[i];
+      add[diff_num] = list[i];
+      ++diff_num;
     }
   }
+
+  // 1͈̍̂Ƒ̂2s
+  if (diff_num * 2 >= kKpListLength) {
+    UpdateFeature(entry->feature, king, list);
+  } else {
+    ApplyRows(entry->feature, entry->feature, king, sub, diff_num, add,
+              diff_num);
+  }
+  std::memcpy(entry->list, list, sizeof(Eval::KPPIndex) * kKpListLength);
+  entry->valid = true;
+  std::memcpy(feature, entry->feature,
+              sizeof(std::int16_t) * kFeatureDemention);
+  return diff_num * 2 < kKpListLength;
 }
 
-void NnFeature::UpdateFeature(int16_t* feature, Square king,
-                              const Eval::KPPIndex* list) const {
-  auto f = reinterpret_cast<__m256i*>(feature);
-  std::memcpy(feature, bias_, sizeof(std::int16_t) * kFeatureDemention);
-  for (int i = 0; i < 38; i++) {
-    int offset = (king * Eval::kFEEnd + list[i]) * kFeatureDemention;
-    auto weight = reinterpret_cast<__m256i*>(kp_ + offset);
-    for (int j = 0; j < 16; j++) {
-      f[j] = _mm256_add_epi16(f[j], weight[j]);
+void NnFeature::ApplyRows(int16_t* output, const int16_t* input, Square king,
+                          const Eval::KPPIndex* sub, int sub_num,
+                          const Eval::KPPIndex* add, int add_num) const {
+  assert(sub_num <= kKpListLength && add_num <= kKpListLength);
+  const int base = king * Eval::kFEEnd;
+  // SvZł͈sȂ̂ŁA̔znȂ
+  if (compact_kp_ != nullptr) {
+    const std::int8_t* sub_rows[kKpListLength];
+    const std::int8_t* add_rows[kKpListLength];
+    std::int16_t sub_scales[kKpListLength];
+    std::int16_t add_scales[kKpListLength];
+    for (int i = 0; i < sub_num; i++) {
+      sub_rows[i] = compact_kp_ + (base + sub[i]) * kFeatureDemention;
+      sub_scales[i] = kp_scale_[base + sub[i]];
     }
+    for (int i = 0; i < add_num; i++) {
+      add_rows[i] = compact_kp_ + (base + add[i]) * kFeatureDemention;
+      add_scales[i] = kp_scale_[base + add[i]];
+    }
+    g_kernel.update_compact_rows(
+        output, input, sub_num > 0 ? sub_rows : nullptr,
+        sub_num > 0 ? sub_scales : nullptr, sub_num, add_rows, add_scales,
+        add_num);
+    return;
   }
+
+  const std::int16_t* sub_rows[kKpListLength];
+  const std::int16_t* add_rows[kKpListLength];
+  for (int i = 0; i < sub_num; i++)
+    sub_rows[i] = kp_ + (base + sub[i]) * kFeatureDemention;
+  for (int i = 0; i < add_num; i++)
+    add_rows[i] = kp_ + (base + add[i]) * kFeatureDemention;
+  g_kernel.update_rows(output, input, sub_num > 0 ? sub_rows : nullptr,
+                       sub_num, add_rows, add_num);
 }
 
-template <int kListNum>
-void NnFeature::UpdateFeature(int16_t* feature, Square king,
-                              const Eval::KPPIndex* old_list,
-                              const Eval::KPPIndex* new_list) const {
-  {
-    auto f = reinterpret_cast<__m256i*>(feature);
-    for (int i = 0; i < kListNum; i++) {
-      int offset = (king * Eval::kFEEnd + old_list[i]) * kFeatureDemention;
-      auto weight = reinterpret_cast<__m256i*>(kp_ + offset);
-      for (int j = 0; j < 16; j++) {
-        f[j] = _mm256_sub_epi16(f[j], weight[j]);
+void NnFeature::PrefetchRows(Square king, const Eval::KPPIndex* old_list,
+                             const Eval::KPPIndex* new_list, int num) const {
+  const int base = king * Eval::kFEEnd;
+  const Eval::KPPIndex* lists[2] = {old_list, new_list};
+  for (const Eval::KPPIndex* list : lists) {
+    for (int i = 0; i < num; i++) {
+      const int row = base + list[i];
+      if (compact_kp_ != nullptr) {
+        const std::int8_t* w = compact_kp_ + row * kFeatureDemention;
+        for (int j = 0; j < kFeatureDemention; j += 64) prefetch(w + j);
+        prefetch(kp_scale_ + row);
+      } else {
+        const std::int16_t* w = kp_ + row * kFeatureDemention;
+        for (int j = 0; j < kFeatureDemention; j += 32) prefetch(w + j);
       }
     }
   }
+}
 
-  {
-    auto f = reinterpret_cast<__m256i*>(feature);
-    for (int i = 0; i < kListNum; i++) {
-      int offset = (king * Eval::kFEEnd + new_list[i]) * kFeatureDemention;
-      auto weight = reinterpret_cast<__m256i*>(kp_ + offset);
-      for (int j = 0; j < 16; j++) {
-        f[j] = _mm256_add_epi16(f[j], weight[j]);
-      }
-    }
+void NnFeature::DecodeRow(int row, std::int16_t* output) const {
+  if (compact_kp_ == nullptr) {
+    std::memcpy(output, kp_ + row * kFeatureDemention,
+                sizeof(std::int16_t) * kFeatureDemention);
+    return;
+  }
+  for (int i = 0; i < kFeatureDemention; i++) {
+    output[i] = static_cast<std::int16_t>(
+        compact_kp_[row * kFeatureDemention + i] * kp_scale_[row]);
+  }
+}
+
+std::int16_t CompressKpRow(const std::int16_t* row, std::int8_t* compact) {
+  int max = 0;
+  for (int i = 0; i < kFeatureDemention; i++)
+    max = std::max(max, std::abs(static_cast<int>(row[i])));
+  const int scale = std::max(1, (max + 126) / 127);
+  // |lint16Ɏ܂͈͂ɗ}
+  const int limit = std::min(127, INT16_MAX / scale);
+  for (int i = 0; i < kFeatureDemention; i++) {
+    const int value = static_cast<int>(
+        std::lround(static_cast<double>(row[i]) / scale));
+    compact[i] =
+        static_cast<std::int8_t>(std::min(limit, std::max(-limit, value)));
   }
+  return static_cast<std::int16_t>(scale);
 }
 
-void NnFeature::ReadParameters(const std::string& path) {
+bool NnFeature::ReadParameters(const std::string& path) {
   auto fp = std::fopen(path.c_str(), "rb");
   if (fp == nullptr) {
-    return;
-  }
-  
-  if (std::fread(bias_, sizeof(std::int16_t), kFeatureDemention, fp) !=
-      kFeatureDemention) {
-    std::cerr << "read error feature bias." << std::endl;
-    std::fclose(fp);
-    return;
+    std::cerr << "Failed to open " << path << "." << std::endl;
+    return false;
   }
 
-  if (std::fread(kp_, sizeof(std::int16_t), 81 * Eval::kFEEnd * kFeatureDemention,
-                 fp) != 81 * Eval::kFEEnd * kFeatureDemention) {
+  // rœǂ߂Ȃꍇɍ̏d݂ƍȂ悤ɁASǂł珑
+  std::vector<std::int16_t> buffer(kFeatureDemention + kKpSize);
+  bool success = true;
+  if (std::fread(buffer.data(), sizeof(std::int16_t), kFeatureDemention,
+                 fp) != kFeatureDemention) {
+    std::cerr << "read error feature bias." << std::endl;
+    success = false;
+  } else if (std::fread(buffer.data() + kFeatureDemention,
+                        sizeof(std::int16_t), kKpSize, fp) != kKpSize) {
     std::cerr << "read error feature kp." << std::endl;
-    std::fclose(fp);
-    return;
+    success = false;
   }
   std::fclose(fp);
-}
+  if (!success) return false;
 
-bool NnFeature::Allocate() {
-  bias_ = static_cast<std::int16_t*>(
-      _mm_malloc(sizeof(std::int16_t) * kFeatureDemention, 32));
-  if (bias_ == nullptr) {
+  if (storage_ == nullptr && !Allocate()) {
+    std::cerr << "Failed to allocate memory for feature parameters."
+              << std::endl;
     return false;
   }
+  std::memcpy(storage_, buffer.data(), sizeof(std::int16_t) * buffer.size());
+  bias_ = storage_;
+  kp_ = storage_ + kFeatureDemention;
+  compact_kp_ = nullptr;
+  kp_scale_ = nullptr;
+  return true;
+}
 
-  kp_ = static_cast<std::int16_t*>(_mm_malloc(
-      sizeof(std::int16_t) * 81 * Eval::kFEEnd * kFeatureDemention, 32));
-  if (kp_ == nullptr) {
-    _mm_free(bias_);
+bool NnFeature::ClearParameters() {
+  if (storage_ == nullptr && !Allocate()) {
+    std::cerr << "Failed to allocate memory for feature parameters."
+              << std::endl;
     return false;
   }
-
+  std::memset(storage_, 0,
+              sizeof(std::int16_t) * (kFeatureDemention + kKpSize));
+  bias_ = storage_;
+  kp_ = storage_ + kFeatureDemention;
+  compact_kp_ = nullptr;
+  kp_scale_ = nullptr;
   return true;
 }
 
-void NnFeature::Free() {
-  if (bias_ != nullptr) _mm_free(bias_);
-  if (kp_ != nullptr) _mm_free(kp_);
+void NnFeature::SetParameters(const std::int16_t* bias,
+                              const std::int16_t* kp) {
+#ifdef LEARN
+  std::memcpy(storage_, bias, sizeof(std::int16_t) * kFeatureDemention);
+  std::memcpy(storage_ + kFeatureDemention, kp,
+              sizeof(std::int16_t) * kKpSize);
+#else
+  bias_ = bias;
+  kp_ = kp;
+  compact_kp_ = nullptr;
+  kp_scale_ = nullptr;
+  Free();
+#endif
 }
 
-void ActivateInputFeature(const Position& pos, const Feature& feature,
-                          std::int8_t* output) {
-  Color color[2] = {pos.side_to_move(), ~pos.side_to_move()};
-  for (int i = 0; i < 2; i++) {
-    auto out = reinterpret_cast<__m256i*>(&output[kFeatureDemention * i]);
-    for (int j = 0; j < 8; j++) {
-      auto feature0 =
-          reinterpret_cast<const __m256i*>(feature.feature[color[i]])[j * 2];
-      auto feature1 = reinterpret_cast<const __m256i*>(
-          feature.feature[color[i]])[j * 2 + 1];
-      _mm256_store_si256(
-          &out[j],
-          _mm256_permute4x64_epi64(
-              _mm256_max_epi8(_mm256_packs_epi16(feature0, feature1), kZero),
-              0b11011000));
+void NnFeature::SetCompactParameters(const std::int16_t* bias,
+                                     const std::int8_t* kp,
+                                     const std::int16_t* scale) {
+#ifdef LEARN
+  // wKłint16̏d݂XV̂œWJĂ
+  std::memcpy(storage_, bias, sizeof(std::int16_t) * kFeatureDemention);
+  for (int row = 0; row < kKpRowNum; row++) {
+    for (int i = 0; i < kFeatureDemention; i++) {
+      storage_[kFeatureDemention + row * kFeatureDemention + i] =
+          static_cast<std::int16_t>(kp[row * kFeatureDemention + i] *
+                                    scale[row]);
     }
   }
+#else
+  bias_ = bias;
+  kp_ = nullptr;
+  compact_kp_ = kp;
+  kp_scale_ = scale;
+  Free();
+#endif
 }
 
-Network::Network() {
-  if (!Allocate()) Free();
+bool NnFeature::Replicate(const NnFeature& source, int node) {
+  const bool compact = source.kp_format() == KpFormat::kInt8;
+  const std::size_t bias_size = sizeof(std::int16_t) * kFeatureDemention;
+  const std::size_t kp_size =
+      compact ? sizeof(std::int8_t) * kKpSize : sizeof(std::int16_t) * kKpSize;
+  const std::size_t scale_size = compact ? sizeof(std::int16_t) * kKpRowNum : 0;
+  const std::size_t size = bias_size + kp_size + scale_size;
+  auto mem = static_cast<char*>(replica_.allocate(size));
+  if (mem == nullptr) return false;
+
+  // ޑOɃm[hw肵Ă΁Ãm[h̃ɒu
+  Numa::bind_memory(mem, size, node);
+  std::memcpy(mem, source.bias(), bias_size);
+  bias_ = reinterpret_cast<const std::int16_t*>(mem);
+  if (compact) {
+    std::memcpy(mem + bias_size, source.compact_kp(), kp_size);
+    std::memcpy(mem + bias_size + kp_size, source.kp_scale(), scale_size);
+    kp_ = nullptr;
+    compact_kp_ = reinterpret_cast<const std::int8_t*>(mem + bias_size);
+    kp_scale_ =
+        reinterpret_cast<const std::int16_t*>(mem + bias_size + kp_size);
+  } else {
+    std::memcpy(mem + bias_size, source.kp(), kp_size);
+    kp_ = reinterpret_cast<const std::int16_t*>(mem + bias_size);
+    compact_kp_ = nullptr;
+    kp_scale_ = nullptr;
+  }
+  return true;
 }
 
-Network::~Network() { Free(); }
+bool NnFeature::Allocate() {
+  // AVX-5121sǂގɃLbVC܂Ȃ悤ɂ
+  storage_ = static_cast<std::int16_t*>(_mm_malloc(
+      sizeof(std::int16_t) * (kFeatureDemention + kKpSize), 64));
+  return storage_ != nullptr;
+}
 
-template <int kInputDemention, int kOutputDemention>
-void AffineTransform(const std::int8_t* input, std::int32_t* output,
-                     const std::int32_t* bias, const std::int8_t* weight) {
-  auto input_vector = reinterpret_cast<const __m256i*>(input);
-  constexpr int loop_num = kInputDemention / 32;
-  for (int i = 0; i < kOutputDemention; i++) {
-    __m256i sum = _mm256_set_epi32(0, 0, 0, 0, 0, 0, 0, bias[i]);
-    auto weights =
-        reinterpret_cast<const __m256i*>(&weight[kInputDemention * i]);
-    for (int j = 0; j < loop_num; j++) {
-      __m256i product = _mm256_maddubs_epi16(
-          _mm256_load_si256(&input_vector[j]), _mm256_load_si256(&weights[j]));
-      product = _mm256_madd_epi16(product, kOnes);
-      sum = _mm256_add_epi32(sum, product);
-    }
-    sum = _mm256_hadd_epi32(sum, sum);
-    sum = _mm256_hadd_epi32(sum, sum);
-    const __m128i lo = _mm256_extracti128_si256(sum, 0);
-    const __m128i hi = _mm256_extracti128_si256(sum, 1);
-    output[i] = _mm_cvtsi128_si32(lo) + _mm_cvtsi128_si32(hi);
+void NnFeature::Free() {
+  if (storage_ != nullptr) {
+    _mm_free(storage_);
+    storage_ = nullptr;
   }
 }
 
-void Activate(const std::int32_t* input, std::int8_t* output) {
-  const auto in = reinterpret_cast<const __m256i*>(input);
-  auto out = reinterpret_cast<__m256i*>(output);
-  const __m256i words0 = _mm256_srai_epi16(
-      _mm256_packs_epi32(_mm256_load_si256(&in[0]), _mm256_load_si256(&in[1])),
-      kWeightScaleBits);
-  const __m256i words1 = _mm256_srai_epi16(
-      _mm256_packs_epi32(_mm256_load_si256(&in[2]), _mm256_load_si256(&in[3])),
-      kWeightScaleBits);
-  _mm256_store_si256(
-      out, _mm256_permutevar8x32_epi32(
-               _mm256_max_epi8(_mm256_packs_epi16(words0, words1), kZero),
-               kOffsets));
+void ActivateInputFeature(const Position& pos, const Feature& feature,
+                          std::int8_t* output) {
+  Color us = pos.side_to_move();
+  g_kernel.activate_input(feature.feature[us], feature.feature[~us], output);
 }
 
-Value Network::Compute(const std::int8_t* input) {
-  alignas(32) std::int32_t features0[Network::kLayer1Input];
-  AffineTransform<Network::kLayer0Input, Network::kLayer1Input>(
-      input, features0, bias0_, weights0_);
-
-  alignas(32) std::int8_t out0[Network::kLayer1Input];
-  Activate(features0, out0);
-
-  alignas(32) std::int32_t features1[Network::kLayer2Input];
-  AffineTransform<Network::kLayer1Input, Network::kLayer2Input>(
-      out0, features1, bias1_, weights1_);
+Network::Network() {
+  if (!Allocate()) {
+    Free();
+    return;
+  }
+  // d݂ǂݍ߂Ȃꍇɕslŕ]Ȃ悤0Ŗ߂Ă
+  std::memset(bias0_, 0, sizeof(std::int32_t) * kLayer1Input);
+  std::memset(weights0_, 0, sizeof(std::int8_t) * kLayer0Input * kLayer1Input);
+  std::memset(bias1_, 0, sizeof(std::int32_t) * kLayer2Input);
+  std::memset(weights1_, 0, sizeof(std::int8_t) * kLayer1Input * kLayer2Input);
+  std::memset(bias2_, 0, sizeof(std::int32_t) * 1);
+  std::memset(weights2_, 0, sizeof(std::int8_t) * kLayer2Input * 1);
+  PrepareWeights();
+}
 
-  alignas(32) std::int8_t out1[Network::kLayer2Input];
-  Activate(features1, out1);
+Network::~Network() { Free(); }
 
-  alignas(32) std::int32_t features2;
-  AffineTransform<Network::kLayer2Input, 1>(out1, &features2, bias2_,
-                                            weights2_);
+Value Network::Compute(const std::int8_t* input) {
+  std::int32_t output = g_kernel.propagate(input, bias0_, weights0_columns_,
+                                           bias1_, weights1_columns_, bias2_,
+                                           weights2_);
+  return static_cast<Value>(output / kOutputScale);
+}
 
-  return static_cast<Value>(features2 / kOutputScale);
+void Network::ComputeBatch(const std::int8_t* input, int num, Value* values) {
+  std::vector<std::int32_t> output(num);
+  g_kernel.propagate_batch(input, num, output.data(), bias0_,
+                           weights0_columns_, bias1_, weights1_columns_,
+                           bias2_, weights2_);
+  for (int i = 0; i < num; i++)
+    values[i] = static_cast<Value>(output[i] / kOutputScale);
 }
 
 bool Network::Allocate() {
@@ -249,7 +353,7 @@ bool Network::Allocate() {
       _mm_malloc(sizeof(std::int32_t) * Network::kLayer1Input, 32));
   if (bias0_ == nullptr) return false;
   weights0_ = static_cast<std::int8_t*>(_mm_malloc(
-      sizeof(std::int8_t) * Network::kLayer0Input * Network::kLayer1Input, 32));
+      sizeof(std::int8_t) * Network::kLayer0Input * Network::kLayer1Input, 64));
   if (weights0_ == nullptr) return false;
   bias1_ = static_cast<std::int32_t*>(
       _mm_malloc(sizeof(std::int32_t) * Network::kLayer2Input, 32));
@@ -262,6 +366,12 @@ bool Network::Allocate() {
   weights2_ = static_cast<std::int8_t*>(
       _mm_malloc(sizeof(std::int8_t) * Network::kLayer2Input * 1, 32));
   if (weights2_ == nullptr) return false;
+  weights0_columns_ = static_cast<std::int8_t*>(_mm_malloc(
+      sizeof(std::int8_t) * Network::kLayer0Input * Network::kLayer1Input, 64));
+  if (weights0_columns_ == nullptr) return false;
+  weights1_columns_ = static_cast<std::int8_t*>(_mm_malloc(
+      sizeof(std::int8_t) * Network::kLayer1Input * Network::kLayer2Input, 64));
+  if (weights1_columns_ == nullptr) return false;
 
   return true;
 }
@@ -296,55 +406,452 @@ void Network::Free() {
     _mm_free(weights2_);
     weights2_ = nullptr;
   }
+
+  if (weights0_columns_ != nullptr) {
+    _mm_free(weights0_columns_);
+    weights0_columns_ = nullptr;
+  }
+
+  if (weights1_columns_ != nullptr) {
+    _mm_free(weights1_columns_);
+    weights1_columns_ = nullptr;
+  }
 }
 
-void Network::ReadParameters(const std::string& path) {
+bool Network::ReadParameters(const std::string& path) {
   auto fp = std::fopen(path.c_str(), "rb");
   if (fp == nullptr) {
-    return;
+    std::cerr << "Failed to open " << path << "." << std::endl;
+    return false;
   }
 
-  if (std::fread(bias0_, sizeof(std::int32_t), 32, fp) != 32) {
-    std::cerr << "read error bias0." << std::endl;
-    std::fclose(fp);
-    return;
+  // rœǂ߂Ȃꍇɍ̏d݂ƍȂ悤ɁASǂł獷ւ
+  std::vector<std::int32_t> bias0(kLayer1Input);
+  std::vector<std::int8_t> weights0(kLayer0Input * kLayer1Input);
+  std::vector<std::int32_t> bias1(kLayer2Input);
+  std::vector<std::int8_t> weights1(kLayer1Input * kLayer2Input);
+  std::vector<std::int32_t> bias2(1);
+  std::vector<std::int8_t> weights2(kLayer2Input * 1);
+  auto read = [&](void* data, std::size_t size, std::size_t count,
+                  const char* name) {
+    if (std::fread(data, size, count, fp) == count) return true;
+    std::cerr << "read error " << name << "." << std::endl;
+    return false;
+  };
+  const bool success =
+      read(bias0.data(), sizeof(std::int32_t), bias0.size(), "bias0") &&
+      read(weights0.data(), sizeof(std::int8_t), weights0.size(),
+           "weights0") &&
+      read(bias1.data(), sizeof(std::int32_t), bias1.size(), "bias1") &&
+      read(weights1.data(), sizeof(std::int8_t), weights1.size(),
+           "weights1") &&
+      read(bias2.data(), sizeof(std::int32_t), bias2.size(), "bias2") &&
+      read(weights2.data(), sizeof(std::int8_t), weights2.size(), "weights2");
+  std::fclose(fp);
+  if (!success) return false;
+
+  SetParameters(bias0.data(), weights0.data(), bias1.data(), weights1.data(),
+                bias2.data(), weights2.data());
+  return true;
+}
+
+void Network::SetParameters(const std::int32_t* bias0,
+                            const std::int8_t* weights0,
+                            const std::int32_t* bias1,
+                            const std::int8_t* weights1,
+                            const std::int32_t* bias2,
+                            const std::int8_t* weights2) {
+  std::memcpy(bias0_, bias0, sizeof(std::int32_t) * kLayer1Input);
+  std::memcpy(weights0_, weights0,
+              sizeof(std::int8_t) * kLayer0Input * kLayer1Input);
+  std::memcpy(bias1_, bias1, sizeof(std::int32_t) * kLayer2Input);
+  std::memcpy(weights1_, weights1,
+              sizeof(std::int8_t) * kLayer1Input * kLayer2Input);
+  std::memcpy(bias2_, bias2, sizeof(std::int32_t) * 1);
+  std::memcpy(weights2_, weights2, sizeof(std::int8_t) * kLayer2Input * 1);
+  PrepareWeights();
+}
+
+namespace {
+// [o][]̏d݂[/4][o][%4]ɂ
+void ToColumns(const std::int8_t* rows, std::int8_t* columns, int input_num,
+               int output_num) {
+  constexpr int kChunkSize = 4;
+  for (int o = 0; o < output_num; o++) {
+    for (int i = 0; i < input_num; i++) {
+      columns[(i / kChunkSize * output_num + o) * kChunkSize +
+              i % kChunkSize] = rows[o * input_num + i];
+    }
+  }
+}
+}  // namespace
+
+void Network::PrepareWeights() {
+  // o͂1̑w͂̂܂܂̕тŌvZ
+  ToColumns(weights0_, weights0_columns_, kLayer0Input, kLayer1Input);
+  ToColumns(weights1_, weights1_columns_, kLayer1Input, kLayer2Input);
+}
+
+namespace {
+// ]֐t@Č`
+// wb_̌ɁAep[^64byteEɑSection̏ɕׂ
+// t@C}bvɁAkp̂܂AVX-512œǂ߂悤ɂ邽
+struct WeightFileHeader {
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t fe_end;
+  std::uint32_t feature_demention;
+  std::uint32_t layer0_input;
+  std::uint32_t layer1_input;
+  std::uint32_t layer2_input;
+  std::uint64_t payload_size;
+  std::uint64_t checksum;
+  // KpFormatB̗Ȃ̃t@C0Ȃ̂int16`ɂȂ
+  std::uint32_t kp_format;
+  std::uint8_t reserved[12];
+};
+static_assert(sizeof(WeightFileHeader) == 64, "");
+
+constexpr char kWeightFileMagic[8] = {'N', 'O', 'Z', 'O', 'M', 'I', 'N', 'N'};
+constexpr std::uint32_t kWeightFileVersion = 1;
+constexpr std::size_t kSectionAlignment = 64;
+
+enum Section {
+  kFeatureBias,
+  kFeatureKp,
+  kFeatureKpScale,
+  kBias0,
+  kWeights0,
+  kBias1,
+  kWeights1,
+  kBias2,
+  kWeights2,
+  kSectionNum
+};
+
+constexpr std::size_t kSectionSize[kSectionNum] = {
+    sizeof(std::int16_t) * kFeatureDemention,
+    sizeof(std::int16_t) * kKpSize,
+    0,
+    sizeof(std::int32_t) * Network::kLayer1Input,
+    sizeof(std::int8_t) * Network::kLayer0Input * Network::kLayer1Input,
+    sizeof(std::int32_t) * Network::kLayer2Input,
+    sizeof(std::int8_t) * Network::kLayer1Input * Network::kLayer2Input,
+    sizeof(std::int32_t) * 1,
+    sizeof(std::int8_t) * Network::kLayer2Input * 1};
+
+constexpr std::size_t AlignSection(std::size_t size) {
+  return (size + kSectionAlignment - 1) / kSectionAlignment *
+         kSectionAlignment;
+}
+
+// int8`̏ꍇkp̌ɍsƂ̔{u
+std::size_t SectionSize(int section, KpFormat format) {
+  if (format == KpFormat::kInt8) {
+    if (section == kFeatureKp) return sizeof(std::int8_t) * kKpSize;
+    if (section == kFeatureKpScale) return sizeof(std::int16_t) * kKpRowNum;
   }
+  return kSectionSize[section];
+}
 
-  if (std::fread(weights0_, sizeof(std::int8_t), 512 * 32, fp) != 512 * 32) {
-    std::cerr << "read error weights0." << std::endl;
-    std::fclose(fp);
-    return;
+std::size_t SectionOffset(int section, KpFormat format) {
+  std::size_t offset = 0;
+  for (int i = 0; i < section; i++)
+    offset += AlignSection(SectionSize(i, format));
+  return offset;
+}
+
+std::uint64_t Checksum(const char* data, std::size_t size) {
+  // 8byteFNV-1aBpayload64byte̔{ɂȂĂ
+  std::uint64_t hash = UINT64_C(14695981039346656037);
+  for (std::size_t i = 0; i + sizeof(std::uint64_t) <= size;
+       i += sizeof(std::uint64_t)) {
+    std::uint64_t word;
+    std::memcpy(&word, data + i, sizeof(word));
+    hash = (hash ^ word) * UINT64_C(1099511628211);
   }
+  return hash;
+}
 
-  if (std::fread(bias1_, sizeof(std::int32_t), 32, fp) != 32) {
-    std::cerr << "read error bias1." << std::endl;
-    std::fclose(fp);
-    return;
+void MakeHeader(WeightFileHeader& header, KpFormat format) {
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kWeightFileMagic, sizeof(header.magic));
+  header.version = kWeightFileVersion;
+  header.fe_end = Eval::kFEEnd;
+  header.feature_demention = kFeatureDemention;
+  header.layer0_input = Network::kLayer0Input;
+  header.layer1_input = Network::kLayer1Input;
+  header.layer2_input = Network::kLayer2Input;
+  header.payload_size = SectionOffset(kSectionNum, format);
+  header.kp_format = static_cast<std::uint32_t>(format);
+}
+
+// ]̓}bv܂܂ɂĂ
+MappedFile g_weight_file;
+
+bool LoadWeightFile(const std::string& path, MappedFile& file) {
+  auto error = [&](const char* message) {
+    std::cerr << path << ": " << message << std::endl;
+    return false;
+  };
+
+  if (file.size() < sizeof(WeightFileHeader)) return error("file too small.");
+
+  WeightFileHeader header;
+  std::memcpy(&header, file.data(), sizeof(header));
+  if (std::memcmp(header.magic, kWeightFileMagic, sizeof(header.magic)) != 0)
+    return error("not an evaluation file.");
+  if (header.kp_format > static_cast<std::uint32_t>(KpFormat::kInt8))
+    return error("unsupported kp format.");
+
+  const KpFormat format = static_cast<KpFormat>(header.kp_format);
+  WeightFileHeader expected;
+  MakeHeader(expected, format);
+  if (header.version != expected.version)
+    return error("unsupported version.");
+  if (header.fe_end != expected.fe_end ||
+      header.feature_demention != expected.feature_demention ||
+      header.layer0_input != expected.layer0_input ||
+      header.layer1_input != expected.layer1_input ||
+      header.layer2_input != expected.layer2_input)
+    return error("network dimensions do not match.");
+  if (header.payload_size != expected.payload_size ||
+      file.size() != sizeof(header) + header.payload_size)
+    return error("unexpected file size.");
+
+  const char* payload = file.data() + sizeof(header);
+  if (Checksum(payload, header.payload_size) != header.checksum)
+    return error("checksum mismatch.");
+
+  auto section = [&](int s) { return payload + SectionOffset(s, format); };
+  if (format == KpFormat::kInt8) {
+    g_nnfeature.SetCompactParameters(
+        reinterpret_cast<const std::int16_t*>(section(kFeatureBias)),
+        reinterpret_cast<const std::int8_t*>(section(kFeatureKp)),
+        reinterpret_cast<const std::int16_t*>(section(kFeatureKpScale)));
+  } else {
+    g_nnfeature.SetParameters(
+        reinterpret_cast<const std::int16_t*>(section(kFeatureBias)),
+        reinterpret_cast<const std::int16_t*>(section(kFeatureKp)));
   }
+  g_network.SetParameters(
+      reinterpret_cast<const std::int32_t*>(section(kBias0)),
+      reinterpret_cast<const std::int8_t*>(section(kWeights0)),
+      reinterpret_cast<const std::int32_t*>(section(kBias1)),
+      reinterpret_cast<const std::int8_t*>(section(kWeights1)),
+      reinterpret_cast<const std::int32_t*>(section(kBias2)),
+      reinterpret_cast<const std::int8_t*>(section(kWeights2)));
+  // Õt@C͂unmap
+  g_weight_file.swap(file);
+  return true;
+}
 
-  if (std::fread(weights1_, sizeof(std::int8_t), 32 * 32, fp) != 32 * 32) {
-    std::cerr << "read error weights1." << std::endl;
-    std::fclose(fp);
-    return;
+
+bool LoadParameters() {
+  const std::string path = EvalPath(Options["EvalFile"]);
+  MappedFile file;
+  if (file.open(path) && LoadWeightFile(path, file)) return true;
+
+  // t@CȂꍇĂꍇ͋`̃t@Cǂ
+  // Е̃t@CւȂ悤ɁAlbg[N͕ʂɓǂł
+  Network network;
+  const bool success =
+      network.ReadParameters(EvalPath("nn_network.bin")) &&
+      g_nnfeature.ReadParameters(EvalPath("nn_feature.bin"));
+  if (success) {
+    g_network.SetParameters(network.bias0(), network.weights0(),
+                            network.bias1(), network.weights1(),
+                            network.bias2(), network.weights2());
+    return true;
   }
 
-  if (std::fread(bias2_, sizeof(std::int32_t), 1, fp) != 1) {
-    std::cerr << "read error bias2." << std::endl;
-    std::fclose(fp);
-    return;
+  std::cerr << "Failed to load evaluation file " << path << "." << std::endl;
+  // ǂǂ߂Ȃ΁Aŏ̓ǂݍ݂ł0̏d݂̂܂ܕ]
+  if (g_nnfeature.bias() == nullptr) g_nnfeature.ClearParameters();
+  return false;
+}
+
+Backend g_backend = Backend::kNn;
+
+// NUMAm[hƂ̓͑w̏d݁B̏ꍇ͑SXbhg_nnfeatureg
+std::vector<std::unique_ptr<NnFeature>> g_replicas;
+
+const NnFeature& LocalFeature(const Thread* thread) {
+  if (g_replicas.empty()) return g_nnfeature;
+  return *g_replicas[thread->numa_node_ % g_replicas.size()];
+}
+}  // namespace
+
+std::string EvalPath(const std::string& file) {
+  std::string dir = Options["EvalDir"];
+  return dir.empty() ? file : dir + "/" + file;
+}
+
+bool Init() {
+  SelectKernel();
+  if (std::string(Options["EvalType"]) == "kppt") {
+    g_backend = Backend::kKppt;
+    return Eval::init(EvalPath("kppt_kkpt_folded.bin"),
+                      EvalPath("kppt_kkpt.bin"));
   }
 
-  if (std::fread(weights2_, sizeof(std::int8_t), 32, fp) != 32) {
-    std::cerr << "read error weights2." << std::endl;
-    std::fclose(fp);
+  g_backend = Backend::kNn;
+  Eval::release();
+  bool success = LoadParameters();
+  ReplicateParameters();
+  return success;
+}
+
+Backend CurrentBackend() { return g_backend; }
+
+void ReplicateParameters() {
+  g_replicas.clear();
+#ifndef LEARN
+  // ͑w̏d݂͑傫AsPʂŃ_ɓǂނ̂ő̃m[hǂނƒx
+  // o͑̑w͏LbVɍڂ̂ŕȂ
+  const int nodes = Numa::node_count();
+  if (!Options["NumaBinding"] || nodes <= 1 || g_nnfeature.bias() == nullptr)
     return;
+
+  for (int node = 0; node < nodes; node++) {
+    std::unique_ptr<NnFeature> replica(new NnFeature);
+    if (!replica->Replicate(g_nnfeature, node)) {
+      std::cerr << "Failed to replicate evaluation parameters." << std::endl;
+      g_replicas.clear();
+      return;
+    }
+    g_replicas.push_back(std::move(replica));
   }
-  std::fclose(fp);
+#endif
 }
 
-bool Init() {
-  g_nnfeature.ReadParameters("nn_feature.bin");
-  g_network.ReadParameters("nn_network.bin");
+bool SaveWeightFile(const std::string& path, KpFormat format) {
+  // kp͍sƂɕϊ̂ŕʂɏ
+  const void* sections[kSectionNum] = {
+      g_nnfeature.bias(),   nullptr,              nullptr,
+      g_network.bias0(),    g_network.weights0(), g_network.bias1(),
+      g_network.weights1(), g_network.bias2(),    g_network.weights2()};
+  if (sections[kFeatureBias] == nullptr) {
+    std::cerr << "No evaluation parameters are loaded." << std::endl;
+    return false;
+  }
+
+  WeightFileHeader header;
+  MakeHeader(header, format);
+  std::vector<char> payload(header.payload_size, 0);
+  for (int s = 0; s < kSectionNum; s++) {
+    if (sections[s] == nullptr) continue;
+    std::memcpy(&payload[SectionOffset(s, format)], sections[s],
+                SectionSize(s, format));
+  }
+  char* kp = &payload[SectionOffset(kFeatureKp, format)];
+  char* scale = &payload[SectionOffset(kFeatureKpScale, format)];
+  std::int16_t row[kFeatureDemention];
+  for (int r = 0; r < kKpRowNum; r++) {
+    g_nnfeature.DecodeRow(r, row);
+    if (format == KpFormat::kInt8) {
+      const std::int16_t s = CompressKpRow(
+          row, reinterpret_cast<std::int8_t*>(kp) + r * kFeatureDemention);
+      std::memcpy(scale + sizeof(s) * r, &s, sizeof(s));
+    } else {
+      std::memcpy(kp + sizeof(row) * r, row, sizeof(row));
+    }
+  }
+  header.checksum = Checksum(payload.data(), payload.size());
+
+  // path͑̃vZX}bvĂ邱Ƃ̂ŁAڏ
+  // ǂłrŐ؂l߂BʖŏĂu
+  const std::string temp_path = temporary_path(path);
+  auto fp = std::fopen(temp_path.c_str(), "wb");
+  if (fp == nullptr) {
+    std::cerr << "Failed to open " << temp_path << "." << std::endl;
+    return false;
+  }
+  bool success =
+      std::fwrite(&header, sizeof(header), 1, fp) == 1 &&
+      std::fwrite(payload.data(), 1, payload.size(), fp) == payload.size();
+  success &= std::fclose(fp) == 0;
+  if (!success) std::remove(temp_path.c_str());
+  if (!success || !replace_file(temp_path, path)) {
+    std::cerr << "write error " << path << "." << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// ʂvZς݂̒߂̑cǖʂAe̍ɓKp
+// k͈͂ɌȂꍇfalseԂ
+bool UpdateFromAncestor(const Position& pos, SearchStack* ss) {
+  const StateInfo* states[kMaxAccumulatorDistance];
+  bool king_moved[kNumberOfColor] = {false, false};
+  const StateInfo* st = pos.state_info();
+  Color mover = ~pos.side_to_move();
+  int distance = 0;
+
+  while (true) {
+    if (distance >= kMaxAccumulatorDistance) return false;
+
+    SearchStack* parent = ss - distance - 1;
+    Move move = parent->current_move;
+    states[distance++] = st;
+    if (move != kMoveNull && move_piece_type(move) == kKing)
+      king_moved[mover] = true;
+
+    if (king_moved[kBlack] && king_moved[kWhite]) return false;
+
+    if (parent->evaluated && parent->accumulated) break;
+
+    if (parent->ply <= 1) return false;
+
+    st = st->previous;
+    mover = ~mover;
+  }
+
+  Thread* this_thread = pos.this_thread();
+  const NnFeature& nnfeature = LocalFeature(this_thread);
+  Square kings[kNumberOfColor] = {pos.square_king(kBlack),
+                                  Eval::inverse(pos.square_king(kWhite))};
+  const Eval::KPPIndex* lists[kNumberOfColor] = {pos.black_kpp_list(),
+                                                 pos.white_kpp_list()};
+  const Feature& base = *(ss - distance)->feature;
+  for (Color c = kBlack; c < kNumberOfColor; ++c) {
+    std::int16_t* feature = ss->feature->feature[c];
+    if (king_moved[c]) {
+      if (nnfeature.RefreshFeature(
+              feature, kings[c], lists[c],
+              this_thread->refresh_table_.Get(c, kings[c])))
+        ++this_thread->feature_updates_;
+      else
+        ++this_thread->feature_refreshes_;
+      continue;
+    }
+
+    // SĂ̎̍W߂āAc̓ʂ1xǂŏ
+    Eval::KPPIndex old_list[kMaxAccumulatorDistance * 2];
+    Eval::KPPIndex new_list[kMaxAccumulatorDistance * 2];
+    int num = 0;
+    for (int i = 0; i < distance; i++) {
+      Move move = (ss - i - 1)->current_move;
+      const StateInfo* s = states[i];
+      if (move == kMoveNull) continue;
+
+      if (move_piece_type(move) == kKing) {
+        // ̋ʂꍇ͎̕ω
+        if (move_capture(move) != kPieceNone) {
+          old_list[num] = s->changed_value[c][1];
+          new_list[num++] = s->new_value[c][1];
+        }
+      } else {
+        for (int j = 0; j < (s->changed_num == 2 ? 2 : 1); j++) {
+          old_list[num] = s->changed_value[c][j];
+          new_list[num++] = s->new_value[c][j];
+        }
+      }
+    }
+    nnfeature.UpdateFeature(feature, base.feature[c], kings[c], old_list,
+                            new_list, num);
+    ++this_thread->feature_updates_;
+  }
   return true;
 }
 
@@ -352,62 +859,99 @@ Value Evaluate(const Position& pos, SearchStack* ss) {
   // Position2xTɁA]ς݂ƂȂP[X
   if (ss->evaluated) {
     return std::min(kValueMaxEvaluate,
-                    std::max(-kValueMaxEvaluate, ss->feature.value));
+                    std::max(-kValueMaxEvaluate, ss->feature->value));
   }
 
   Key key = pos.key();
-  Entry* e = pos.this_thread()->eval_hash_[key];
-  if (e->key == key) {
-    std::memcpy(ss->feature.feature, e->feature.feature,
-                sizeof(e->feature.feature));
-    ss->feature.value = e->feature.value;
-  } else {
-    if ((ss - 1)->current_move == kMoveNull) {
-      // Null movȅꍇ͕]ς݂̂͂
-      ss->feature = (ss - 1)->feature;
-    } else if ((ss - 1)->evaluated) {
-      ss->feature = (ss - 1)->feature;
-      if (move_piece_type((ss - 1)->current_move) != kKing) {
-        g_nnfeature.UpdateFeature(pos, ss->feature);
-      } else {
-        if (pos.side_to_move() == kBlack) {
-          Square king = Eval::inverse(pos.square_king(kWhite));
-          const Eval::KPPIndex* list = pos.white_kpp_list();
-          g_nnfeature.UpdateFeature(ss->feature.feature[kWhite], king, list);
-        } else {
-          Square king = pos.square_king(kBlack);
-          const Eval::KPPIndex* list = pos.black_kpp_list();
-          g_nnfeature.UpdateFeature(ss->feature.feature[kBlack], king, list);
-        }
-        if (move_capture((ss - 1)->current_move) != kPieceNone) {
-          if (pos.side_to_move() == kBlack) {
-            Square king = pos.square_king(kBlack);
-            const Eval::KPPIndex* old_list = pos.old_index_value(kBlack);
-            const Eval::KPPIndex* new_list = pos.new_index_value(kBlack);
-            g_nnfeature.UpdateFeature<1>(ss->feature.feature[kBlack], king,
-                                         &old_list[1], &new_list[1]);
-          } else {
-            Square king = Eval::inverse(pos.square_king(kWhite));
-            const Eval::KPPIndex* old_list = pos.old_index_value(kWhite);
-            const Eval::KPPIndex* new_list = pos.new_index_value(kWhite);
-            g_nnfeature.UpdateFeature<1>(ss->feature.feature[kWhite], king,
-                                         &old_list[1], &new_list[1]);
-          }
-        }
-      }
+  Thread* this_thread = pos.this_thread();
+  ValueEntry* ve = (*this_thread->value_hash_)[key];
+  ++this_thread->eval_probes_;
+  if (ve->Probe(key, &ss->feature->value)) {
+    ++this_thread->eval_hits_;
+    // ]lĂԁBqǖʂ͑c悩獷vZ
+    ss->evaluated = true;
+    ss->accumulated = false;
+    return ss->feature->value;
+  }
+
+  if (!UpdateFromAncestor(pos, ss)) {
+    // SvZKvȏꍇʂLbV
+    Entry* e = this_thread->feature_hash_[key];
+    if (e->key == key) {
+      std::memcpy(ss->feature->feature, e->feature.feature,
+                  sizeof(e->feature.feature));
     } else {
-      g_nnfeature.MakeFeature(pos, ss->feature);
+      const NnFeature& nnfeature = LocalFeature(this_thread);
+      Square kings[kNumberOfColor] = {pos.square_king(kBlack),
+                                      Eval::inverse(pos.square_king(kWhite))};
+      const Eval::KPPIndex* lists[kNumberOfColor] = {pos.black_kpp_list(),
+                                                     pos.white_kpp_list()};
+      for (Color c = kBlack; c < kNumberOfColor; ++c) {
+        if (nnfeature.RefreshFeature(
+                ss->feature->feature[c], kings[c], lists[c],
+                this_thread->refresh_table_.Get(c, kings[c])))
+          ++this_thread->feature_updates_;
+        else
+          ++this_thread->feature_refreshes_;
+      }
+      std::memcpy(e->feature.feature, ss->feature->feature,
+                  sizeof(e->feature.feature));
+      e->key = key;
     }
-
-    alignas(32) int8_t activated_feature[512];
-    ActivateInputFeature(pos, ss->feature, activated_feature);
-    ss->feature.value = g_network.Compute(activated_feature);
-    e->feature = ss->feature;
-    e->key = key;
   }
 
+  alignas(32) int8_t activated_feature[512];
+  ActivateInputFeature(pos, *ss->feature, activated_feature);
+  ss->feature->value =
+      std::min(kValueMaxEvaluate,
+               std::max(-kValueMaxEvaluate, g_network.Compute(activated_feature)));
+  ve->Save(key, ss->feature->value);
+
   ss->evaluated = true;
-  return std::min(kValueMaxEvaluate,
-                  std::max(-kValueMaxEvaluate, ss->feature.value));
+  ss->accumulated = true;
+  return ss->feature->value;
+}
+
+void EvaluateBatch(const Position* const* positions, int num, Value* values) {
+  constexpr int kBlockSize = 64;
+  struct alignas(64) ActivatedFeature {
+    std::int8_t input[Network::kLayer0Input];
+  };
+  std::vector<Feature> features(std::min(num, kBlockSize));
+  std::vector<ActivatedFeature> activated(features.size());
+  for (int begin = 0; begin < num; begin += kBlockSize) {
+    const int size = std::min(num - begin, kBlockSize);
+    for (int i = 0; i < size; i++) {
+      const Position& pos = *positions[begin + i];
+      g_nnfeature.MakeFeature(pos, features[i]);
+      ActivateInputFeature(pos, features[i], activated[i].input);
+    }
+    g_network.ComputeBatch(activated[0].input, size, values + begin);
+    for (int i = 0; i < size; i++) {
+      values[begin + i] = std::min(
+          kValueMaxEvaluate, std::max(-kValueMaxEvaluate, values[begin + i]));
+    }
+  }
+}
+
+void Prefetch(const Position& pos, Move move) {
+  Thread* this_thread = pos.this_thread();
+  prefetch((*this_thread->value_hash_)[pos.key()]);
+
+  const NnFeature& nnfeature = LocalFeature(this_thread);
+  const StateInfo* st = pos.state_info();
+  const Color mover = ~pos.side_to_move();
+  Square kings[kNumberOfColor] = {pos.square_king(kBlack),
+                                  Eval::inverse(pos.square_king(kWhite))};
+  for (Color c = kBlack; c < kNumberOfColor; ++c) {
+    if (move_piece_type(move) != kKing) {
+      nnfeature.PrefetchRows(kings[c], st->changed_value[c], st->new_value[c],
+                             st->changed_num);
+    } else if (c != mover && move_capture(move) != kPieceNone) {
+      // ʂ͋XgvẐŁA葤̎̕ǂ
+      nnfeature.PrefetchRows(kings[c], &st->changed_value[c][1],
+                             &st->new_value[c][1], 1);
+    }
+  }
 }
 }  // namespace eval
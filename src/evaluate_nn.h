@@ -1,8 +1,12 @@
 #ifndef NOZOMI_EVALUATE_NN_H_
 #define NOZOMI_EVALUATE_NN_H_
 
-#include <array>
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
+#include <cstring>
+#include <iostream>
+#include "misc.h"
 #include "move.h"
 #include "types.h"
 #include "evaluate.h"
@@ -13,11 +17,22 @@ struct SearchStack;
 namespace eval {
 constexpr int kKpListLength = 38;
 constexpr int kFeatureDemention = 256;
+constexpr int kKpRowNum = 81 * Eval::kFEEnd;
+constexpr int kKpSize = kKpRowNum * kFeatureDemention;
 constexpr int kWeightScaleBits = 6;
 constexpr int kOutputScale = 16;
-constexpr int kTableSize = 131072;
+// 差分計算のために遡る最大の手数
+constexpr int kMaxAccumulatorDistance = 8;
 
-struct alignas(32) Feature {
+// 入力層の重みkpの形式
+// kInt8は行ごとの倍率とint8の重みで持ち、差分計算で読む量を半分にする
+enum class KpFormat : std::uint32_t { kInt16, kInt8 };
+
+// kpの1行をint8に変換して倍率を返す。int8の値に倍率を掛けると元の値に近くなる
+std::int16_t CompressKpRow(const std::int16_t* row, std::int8_t* compact);
+
+// 1度に読み書きする単位がキャッシュラインをまたがないようにする
+struct alignas(64) Feature {
   std::int16_t feature[kNumberOfColor][kFeatureDemention];
   Value value;
 };
@@ -27,14 +42,85 @@ struct Entry {
   Key key;
 };
 
-struct HashTable {
-  Entry* operator[](Key key) {
-    return &table[(uint32_t)key & (kTableSize - 1)];
+// 評価値だけを保持するentry
+// 上位48bitをkeyの照合に、下位16bitを評価値に使う
+struct ValueEntry {
+  // 他のスレッドと共有するので、keyと評価値は1回で読み書きする
+  bool Probe(Key key, Value* value) const {
+    const std::uint64_t d = data.load(std::memory_order_relaxed);
+    if ((d ^ key) & kKeyMask) return false;
+    *value = static_cast<Value>(static_cast<std::int16_t>(d));
+    return true;
+  }
+
+  void Save(Key key, Value value) {
+    data.store((key & kKeyMask) | static_cast<std::uint16_t>(value),
+               std::memory_order_relaxed);
+  }
+
+  static constexpr std::uint64_t kKeyMask = ~UINT64_C(0xFFFF);
+  std::atomic<std::uint64_t> data;
+};
+
+// 指定したMB以下に収まる2のべき乗のentry数で確保する
+template <typename T>
+class HashTable {
+ public:
+  HashTable() = default;
+  HashTable(const HashTable&) = delete;
+  HashTable& operator=(const HashTable&) = delete;
+  ~HashTable() { _mm_free(table_); }
+
+  T* operator[](Key key) { return &table_[key & mask_]; }
+
+  void Resize(std::size_t mb_size) {
+    std::size_t count = std::size_t(1)
+                        << msb(std::max<std::uint64_t>(
+                               1, (mb_size * 1024 * 1024) / sizeof(T)));
+    if (table_ != nullptr && count == mask_ + 1) return;
+
+    _mm_free(table_);
+    table_ = static_cast<T*>(_mm_malloc(sizeof(T) * count, 64));
+    if (table_ == nullptr) {
+      std::cerr << "Failed to allocate " << mb_size
+                << "MB for evaluation hash." << std::endl;
+      std::exit(EXIT_FAILURE);
+    }
+    mask_ = count - 1;
+    Clear();
+  }
+
+  void Clear() {
+    std::memset(static_cast<void*>(table_), 0, sizeof(T) * (mask_ + 1));
+  }
+
+ private:
+  T* table_ = nullptr;
+  std::size_t mask_ = 0;
+};
+
+// 玉の位置ごとに、最後に計算した特徴量とその時の駒リストを保持する
+// 玉が動いた時は駒リストの差分だけを足し引きすればよい
+struct alignas(32) RefreshEntry {
+  std::int16_t feature[kFeatureDemention];
+  Eval::KPPIndex list[kKpListLength];
+  bool valid;
+};
+
+class RefreshTable {
+ public:
+  // perspectiveの玉の位置は、後手の場合反転した位置を指定する
+  RefreshEntry* Get(Color perspective, Square king) {
+    return &table_[perspective][king];
+  }
+
+  void Clear() {
+    for (auto& entries : table_)
+      for (auto& e : entries) e.valid = false;
   }
-  void Clear() { table.fill({}); }
 
  private:
-  std::array<Entry, kTableSize> table;
+  RefreshEntry table_[kNumberOfColor][kBoardSquare];
 };
 
 class NnFeature {
@@ -45,22 +131,59 @@ class NnFeature {
   void UpdateFeature(const Position& pos, Feature& feature) const;
   void UpdateFeature(int16_t* feature, Square king,
                      const Eval::KPPIndex* list) const;
-  template <int kListNum>
-  void UpdateFeature(int16_t* feature, Square king,
+  // inputからold_listの行を引き、new_listの行を足してoutputに書く
+  void UpdateFeature(int16_t* output, const int16_t* input, Square king,
                      const Eval::KPPIndex* old_list,
-                     const Eval::KPPIndex* new_list) const;
-  void ReadParameters(const std::string& path);
+                     const Eval::KPPIndex* new_list, int num) const;
+  bool RefreshFeature(int16_t* feature, Square king,
+                      const Eval::KPPIndex* list, RefreshEntry* entry) const;
+  // 差分計算で読むold_list,new_listの行をキャッシュに先読みする
+  void PrefetchRows(Square king, const Eval::KPPIndex* old_list,
+                    const Eval::KPPIndex* new_list, int num) const;
+  // 読めなかった場合は今のパラメータをそのまま使う
+  bool ReadParameters(const std::string& path);
+  // 0のパラメータを使う。何も読み込めなかった場合に使う
+  bool ClearParameters();
+  // 評価関数ファイルをマップした領域をそのまま使う
+  void SetParameters(const std::int16_t* bias, const std::int16_t* kp);
+  // int8形式のkpを使う。scaleは行ごとの倍率
+  void SetCompactParameters(const std::int16_t* bias, const std::int8_t* kp,
+                            const std::int16_t* scale);
+  // sourceのパラメータをnodeのメモリに複製して、それを使う
+  bool Replicate(const NnFeature& source, int node);
+  const std::int16_t* bias() const { return bias_; }
+  // int8形式の場合はnullptrを返す
+  const std::int16_t* kp() const { return kp_; }
+  const std::int8_t* compact_kp() const { return compact_kp_; }
+  const std::int16_t* kp_scale() const { return kp_scale_; }
+  KpFormat kp_format() const {
+    return compact_kp_ != nullptr ? KpFormat::kInt8 : KpFormat::kInt16;
+  }
+  // kpのrow行目をint16でoutputに書く
+  void DecodeRow(int row, std::int16_t* output) const;
 #ifdef LEARN
-  std::int16_t* bias() { return bias_; }
-  std::int16_t* kp() { return kp_; }
+  std::int16_t* bias() { return storage_; }
+  std::int16_t* kp() { return storage_ + kFeatureDemention; }
 #endif
 
  private:
   bool Allocate();
   void Free();
+  // inputからsubの行を引き、addの行を足してoutputに書く
+  void ApplyRows(int16_t* output, const int16_t* input, Square king,
+                 const Eval::KPPIndex* sub, int sub_num,
+                 const Eval::KPPIndex* add, int add_num) const;
 
-  std::int16_t* bias_ = nullptr;
-  std::int16_t* kp_ = nullptr;
+  // 評価に使うパラメータ。マップした領域かstorage_を指す
+  // kp_とcompact_kp_はどちらか一方だけを使う
+  const std::int16_t* bias_ = nullptr;
+  const std::int16_t* kp_ = nullptr;
+  const std::int8_t* compact_kp_ = nullptr;
+  const std::int16_t* kp_scale_ = nullptr;
+  // 旧形式のファイルを読む場合と学習時に使う領域。biasの後にkpを置く
+  std::int16_t* storage_ = nullptr;
+  // NUMAノードごとの複製の領域
+  LargePageMemory replica_;
 };
 
 class Network {
@@ -68,7 +191,20 @@ class Network {
   Network();
   ~Network();
   Value Compute(const std::int8_t* input);
-  void ReadParameters(const std::string& path);
+  // inputに並べたnum局面分をまとめて計算し、valuesに書く
+  void ComputeBatch(const std::int8_t* input, int num, Value* values);
+  bool ReadParameters(const std::string& path);
+  void SetParameters(const std::int32_t* bias0, const std::int8_t* weights0,
+                     const std::int32_t* bias1, const std::int8_t* weights1,
+                     const std::int32_t* bias2, const std::int8_t* weights2);
+  // 重みを計算用の並びに変換する。重みを書き換えた後に呼ぶ
+  void PrepareWeights();
+  const std::int32_t* bias0() const { return bias0_; }
+  const std::int8_t* weights0() const { return weights0_; }
+  const std::int32_t* bias1() const { return bias1_; }
+  const std::int8_t* weights1() const { return weights1_; }
+  const std::int32_t* bias2() const { return bias2_; }
+  const std::int8_t* weights2() const { return weights2_; }
 #ifdef LEARN
   std::int32_t* bias0() { return bias0_; }
   std::int8_t* weights0() { return weights0_; }
@@ -92,10 +228,45 @@ class Network {
   std::int8_t* weights1_ = nullptr;
   std::int32_t* bias2_ = nullptr;
   std::int8_t* weights2_ = nullptr;
+  // weights0,weights1を入力4つごとに全出力分並べたもの
+  // 0の入力を飛ばし、出力をまとめてレジスタ上で計算するのに使う
+  std::int8_t* weights0_columns_ = nullptr;
+  std::int8_t* weights1_columns_ = nullptr;
 };
 
+// EvalDir,EvalFileで指定した評価関数ファイルを読み込む
+// 見つからない場合は旧形式のnn_feature.bin,nn_network.binを読む
+// EvalTypeがkpptの場合はEvalDirのkppt_kkpt_folded.bin,kppt_kkpt.binを読む
 bool Init();
+// EvalDirにあるfileのパス
+std::string EvalPath(const std::string& file);
+// 読み込んでいるパラメータを評価関数ファイルの形式で書き出す
+// kpは読み込んでいる形式に関係なくformatの形式に変換する
+bool SaveWeightFile(const std::string& path, KpFormat format);
+
+// NumaBindingが有効な場合に、NUMAノードごとに入力層の重みを複製し直す
+void ReplicateParameters();
 Value Evaluate(const Position& pos, SearchStack* ss);
+// moveで進めた直後に呼び、子局面の評価で読む重みの行と評価値のentryを先読みする
+// 置換表を引いている間に読み込みが進むようにする
+void Prefetch(const Position& pos, Move move);
+// num局面の評価値をまとめて計算してvaluesに書く。探索用のキャッシュは使わない
+void EvaluateBatch(const Position* const* positions, int num, Value* values);
+
+// 探索で使う評価関数の種類。EvalTypeで選び、Initで読み込む
+enum class Backend { kNn, kKppt };
+Backend CurrentBackend();
+
+// 探索は種類ごとに実体化し、ノードごとに評価関数を選ぶ分岐をなくす
+template <Backend B>
+inline Value Evaluate(const Position& pos, SearchStack* ss) {
+  return B == Backend::kKppt ? Eval::evaluate(pos, ss) : Evaluate(pos, ss);
+}
+
+template <Backend B>
+inline void Prefetch(const Position& pos, Move move) {
+  if (B == Backend::kNn) Prefetch(pos, move);
+}
 #ifdef LEARN
 extern NnFeature g_nnfeature;
 extern Network g_network;
@@ -0,0 +1,858 @@
+#include "evaluate_nn_kernel.h"
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <immintrin.h>
+#endif
+#include "evaluate.h"
+#include "evaluate_nn.h"
+
+// gcc,clangでは-marchの指定に関係なく各命令セットの関数を作れるようにする
+#ifdef _MSC_VER
+#define NN_TARGET(isa)
+#else
+#define NN_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+namespace eval {
+namespace {
+// 入力層と中間層の重みはNetwork::PrepareWeightsで入力4つの塊ごとに全出力分並べてある
+// 塊の4byteを全レーンに配って足していけば、出力ごとの水平加算は要らない
+// 入力層は入力が0の塊が多いので、0でない塊の番号を8個ずつ表から引いて並べ、それだけを計算する
+constexpr int kChunkSize = 4;
+
+struct NonzeroIndexTable {
+  constexpr NonzeroIndexTable() : index(), count() {
+    for (int mask = 0; mask < 256; mask++) {
+      for (int bit = 0; bit < 8; bit++) {
+        if (mask >> bit & 1) index[mask][count[mask]++] = bit;
+      }
+    }
+  }
+
+  alignas(16) std::uint16_t index[256][8];
+  std::uint8_t count[256];
+};
+
+constexpr NonzeroIndexTable kNonzeroIndex;
+
+// 塊8個分のmaskから番号を書き足す。indicesには8個分の余裕が必要
+NN_TARGET("sse4.1")
+inline void AppendNonzeroIndices(int mask, __m128i* base,
+                                 std::uint16_t* indices, int* count) {
+  _mm_storeu_si128(
+      reinterpret_cast<__m128i*>(indices + *count),
+      _mm_add_epi16(*base, _mm_load_si128(reinterpret_cast<const __m128i*>(
+                               kNonzeroIndex.index[mask]))));
+  *count += kNonzeroIndex.count[mask];
+  *base = _mm_add_epi16(*base, _mm_set1_epi16(8));
+}
+
+// SSE4.1
+// レジスタが16本なので、特徴量を半分ずつレジスタに載せて計算する
+NN_TARGET("sse4.1")
+void UpdateRowsSse41(std::int16_t* output, const std::int16_t* input,
+                     const std::int16_t* const* sub_rows, int sub_num,
+                     const std::int16_t* const* add_rows, int add_num) {
+  constexpr int kTileSize = kFeatureDemention / 2;
+  constexpr int kRegisterNum = kTileSize / 8;
+  for (int t = 0; t < kFeatureDemention; t += kTileSize) {
+    auto in = reinterpret_cast<const __m128i*>(input + t);
+    auto out = reinterpret_cast<__m128i*>(output + t);
+    __m128i acc[kRegisterNum];
+    for (int j = 0; j < kRegisterNum; j++) acc[j] = _mm_load_si128(&in[j]);
+    for (int i = 0; i < sub_num; i++) {
+      auto w = reinterpret_cast<const __m128i*>(sub_rows[i] + t);
+      for (int j = 0; j < kRegisterNum; j++)
+        acc[j] = _mm_sub_epi16(acc[j], _mm_load_si128(&w[j]));
+    }
+    for (int i = 0; i < add_num; i++) {
+      auto w = reinterpret_cast<const __m128i*>(add_rows[i] + t);
+      for (int j = 0; j < kRegisterNum; j++)
+        acc[j] = _mm_add_epi16(acc[j], _mm_load_si128(&w[j]));
+    }
+    for (int j = 0; j < kRegisterNum; j++) _mm_store_si128(&out[j], acc[j]);
+  }
+}
+
+// int8の重み8個をint16に広げて行の倍率を掛ける
+NN_TARGET("sse4.1")
+inline __m128i WidenRowSse41(const std::int8_t* row, __m128i scale) {
+  return _mm_mullo_epi16(
+      _mm_cvtepi8_epi16(
+          _mm_loadl_epi64(reinterpret_cast<const __m128i*>(row))),
+      scale);
+}
+
+NN_TARGET("sse4.1")
+void UpdateCompactRowsSse41(std::int16_t* output, const std::int16_t* input,
+                            const std::int8_t* const* sub_rows,
+                            const std::int16_t* sub_scales, int sub_num,
+                            const std::int8_t* const* add_rows,
+                            const std::int16_t* add_scales, int add_num) {
+  constexpr int kTileSize = kFeatureDemention / 2;
+  constexpr int kRegisterNum = kTileSize / 8;
+  for (int t = 0; t < kFeatureDemention; t += kTileSize) {
+    auto in = reinterpret_cast<const __m128i*>(input + t);
+    auto out = reinterpret_cast<__m128i*>(output + t);
+    __m128i acc[kRegisterNum];
+    for (int j = 0; j < kRegisterNum; j++) acc[j] = _mm_load_si128(&in[j]);
+    for (int i = 0; i < sub_num; i++) {
+      const __m128i scale = _mm_set1_epi16(sub_scales[i]);
+      const std::int8_t* w = sub_rows[i] + t;
+      for (int j = 0; j < kRegisterNum; j++)
+        acc[j] = _mm_sub_epi16(acc[j], WidenRowSse41(w + j * 8, scale));
+    }
+    for (int i = 0; i < add_num; i++) {
+      const __m128i scale = _mm_set1_epi16(add_scales[i]);
+      const std::int8_t* w = add_rows[i] + t;
+      for (int j = 0; j < kRegisterNum; j++)
+        acc[j] = _mm_add_epi16(acc[j], WidenRowSse41(w + j * 8, scale));
+    }
+    for (int j = 0; j < kRegisterNum; j++) _mm_store_si128(&out[j], acc[j]);
+  }
+}
+
+NN_TARGET("sse4.1")
+void ActivateInputSse41(const std::int16_t* us, const std::int16_t* them,
+                        std::int8_t* output) {
+  const __m128i zero = _mm_setzero_si128();
+  const std::int16_t* features[2] = {us, them};
+  for (int i = 0; i < 2; i++) {
+    auto in = reinterpret_cast<const __m128i*>(features[i]);
+    auto out = reinterpret_cast<__m128i*>(&output[kFeatureDemention * i]);
+    for (int j = 0; j < kFeatureDemention / 16; j++) {
+      _mm_store_si128(
+          &out[j], _mm_max_epi8(_mm_packs_epi16(_mm_load_si128(&in[j * 2]),
+                                                _mm_load_si128(&in[j * 2 + 1])),
+                                zero));
+    }
+  }
+}
+
+template <int kInputDemention, int kOutputDemention>
+NN_TARGET("sse4.1")
+void AffineTransformSse41(const std::int8_t* input, std::int32_t* output,
+                          const std::int32_t* bias,
+                          const std::int8_t* weight) {
+  const __m128i ones = _mm_set1_epi16(1);
+  auto input_vector = reinterpret_cast<const __m128i*>(input);
+  constexpr int loop_num = kInputDemention / 16;
+  for (int i = 0; i < kOutputDemention; i++) {
+    __m128i sum = _mm_cvtsi32_si128(bias[i]);
+    auto weights =
+        reinterpret_cast<const __m128i*>(&weight[kInputDemention * i]);
+    for (int j = 0; j < loop_num; j++) {
+      __m128i product = _mm_maddubs_epi16(_mm_load_si128(&input_vector[j]),
+                                          _mm_load_si128(&weights[j]));
+      product = _mm_madd_epi16(product, ones);
+      sum = _mm_add_epi32(sum, product);
+    }
+    // phadddは遅いのでシャッフルで足し合わせる
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+    output[i] = _mm_cvtsi128_si32(sum);
+  }
+}
+
+template <int kInputDemention, int kOutputDemention>
+NN_TARGET("sse4.1")
+void SparseAffineTransformSse41(const std::int8_t* input, std::int32_t* output,
+                                const std::int32_t* bias,
+                                const std::int8_t* weight) {
+  constexpr int kChunkNum = kInputDemention / kChunkSize;
+  constexpr int kChunkWeightSize = kOutputDemention * kChunkSize;
+  constexpr int kRegisterNum = kOutputDemention / 4;
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+  auto in = reinterpret_cast<const __m128i*>(input);
+  std::uint16_t indices[kChunkNum + 8];
+  int count = 0;
+  __m128i base = _mm_setzero_si128();
+  for (int i = 0; i < kChunkNum / 8; i++) {
+    const int mask0 = _mm_movemask_ps(
+        _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_load_si128(&in[i * 2]), zero)));
+    const int mask1 = _mm_movemask_ps(_mm_castsi128_ps(
+        _mm_cmpgt_epi32(_mm_load_si128(&in[i * 2 + 1]), zero)));
+    AppendNonzeroIndices(mask0 | mask1 << 4, &base, indices, &count);
+  }
+
+  __m128i acc[kRegisterNum];
+  for (int j = 0; j < kRegisterNum; j++)
+    acc[j] = _mm_load_si128(reinterpret_cast<const __m128i*>(bias) + j);
+  auto input32 = reinterpret_cast<const std::int32_t*>(input);
+  for (int i = 0; i < count; i++) {
+    const __m128i x = _mm_set1_epi32(input32[indices[i]]);
+    auto w = reinterpret_cast<const __m128i*>(weight +
+                                              indices[i] * kChunkWeightSize);
+    for (int j = 0; j < kRegisterNum; j++) {
+      const __m128i product =
+          _mm_madd_epi16(_mm_maddubs_epi16(x, _mm_load_si128(&w[j])), ones);
+      acc[j] = _mm_add_epi32(acc[j], product);
+    }
+  }
+  for (int j = 0; j < kRegisterNum; j++)
+    _mm_store_si128(reinterpret_cast<__m128i*>(output) + j, acc[j]);
+}
+
+template <int kInputDemention, int kOutputDemention>
+NN_TARGET("sse4.1")
+void ColumnAffineTransformSse41(const std::int8_t* input, std::int32_t* output,
+                                const std::int32_t* bias,
+                                const std::int8_t* weight) {
+  constexpr int kChunkNum = kInputDemention / kChunkSize;
+  constexpr int kRegisterNum = kOutputDemention / 4;
+  const __m128i ones = _mm_set1_epi16(1);
+  __m128i acc[kRegisterNum];
+  for (int j = 0; j < kRegisterNum; j++)
+    acc[j] = _mm_load_si128(reinterpret_cast<const __m128i*>(bias) + j);
+  auto input32 = reinterpret_cast<const std::int32_t*>(input);
+  auto w = reinterpret_cast<const __m128i*>(weight);
+  for (int i = 0; i < kChunkNum; i++) {
+    const __m128i x = _mm_set1_epi32(input32[i]);
+    for (int j = 0; j < kRegisterNum; j++) {
+      const __m128i product = _mm_madd_epi16(
+          _mm_maddubs_epi16(x, _mm_load_si128(&w[i * kRegisterNum + j])),
+          ones);
+      acc[j] = _mm_add_epi32(acc[j], product);
+    }
+  }
+  for (int j = 0; j < kRegisterNum; j++)
+    _mm_store_si128(reinterpret_cast<__m128i*>(output) + j, acc[j]);
+}
+
+NN_TARGET("sse4.1")
+void ActivateSse41(const std::int32_t* input, std::int8_t* output) {
+  const __m128i zero = _mm_setzero_si128();
+  const auto in = reinterpret_cast<const __m128i*>(input);
+  auto out = reinterpret_cast<__m128i*>(output);
+  for (int i = 0; i < 2; i++) {
+    const __m128i words0 = _mm_srai_epi16(
+        _mm_packs_epi32(_mm_load_si128(&in[i * 4]),
+                        _mm_load_si128(&in[i * 4 + 1])),
+        kWeightScaleBits);
+    const __m128i words1 = _mm_srai_epi16(
+        _mm_packs_epi32(_mm_load_si128(&in[i * 4 + 2]),
+                        _mm_load_si128(&in[i * 4 + 3])),
+        kWeightScaleBits);
+    _mm_store_si128(&out[i],
+                    _mm_max_epi8(_mm_packs_epi16(words0, words1), zero));
+  }
+}
+
+NN_TARGET("sse4.1")
+std::int32_t PropagateSse41(const std::int8_t* input,
+                            const std::int32_t* bias0,
+                            const std::int8_t* weights0,
+                            const std::int32_t* bias1,
+                            const std::int8_t* weights1,
+                            const std::int32_t* bias2,
+                            const std::int8_t* weights2) {
+  alignas(32) std::int32_t features0[Network::kLayer1Input];
+  SparseAffineTransformSse41<Network::kLayer0Input, Network::kLayer1Input>(
+      input, features0, bias0, weights0);
+
+  alignas(32) std::int8_t out0[Network::kLayer1Input];
+  ActivateSse41(features0, out0);
+
+  alignas(32) std::int32_t features1[Network::kLayer2Input];
+  ColumnAffineTransformSse41<Network::kLayer1Input, Network::kLayer2Input>(
+      out0, features1, bias1, weights1);
+
+  alignas(32) std::int8_t out1[Network::kLayer2Input];
+  ActivateSse41(features1, out1);
+
+  std::int32_t features2;
+  AffineTransformSse41<Network::kLayer2Input, 1>(out1, &features2, bias2,
+                                                 weights2);
+  return features2;
+}
+
+// 1局面分の累積だけでレジスタを使い切るので、重みを使い回す余裕がない
+NN_TARGET("sse4.1")
+void PropagateBatchSse41(const std::int8_t* input, int num,
+                         std::int32_t* output, const std::int32_t* bias0,
+                         const std::int8_t* weights0, const std::int32_t* bias1,
+                         const std::int8_t* weights1, const std::int32_t* bias2,
+                         const std::int8_t* weights2) {
+  for (int i = 0; i < num; i++) {
+    output[i] = PropagateSse41(input + i * Network::kLayer0Input, bias0,
+                               weights0, bias1, weights1, bias2, weights2);
+  }
+}
+
+// AVX2
+NN_TARGET("avx2")
+void UpdateRowsAvx2(std::int16_t* output, const std::int16_t* input,
+                    const std::int16_t* const* sub_rows, int sub_num,
+                    const std::int16_t* const* add_rows, int add_num) {
+  constexpr int kRegisterNum = kFeatureDemention / 16;
+  auto in = reinterpret_cast<const __m256i*>(input);
+  auto out = reinterpret_cast<__m256i*>(output);
+  __m256i acc[kRegisterNum];
+  for (int j = 0; j < kRegisterNum; j++) acc[j] = _mm256_load_si256(&in[j]);
+  for (int i = 0; i < sub_num; i++) {
+    auto w = reinterpret_cast<const __m256i*>(sub_rows[i]);
+    for (int j = 0; j < kRegisterNum; j++)
+      acc[j] = _mm256_sub_epi16(acc[j], _mm256_load_si256(&w[j]));
+  }
+  for (int i = 0; i < add_num; i++) {
+    auto w = reinterpret_cast<const __m256i*>(add_rows[i]);
+    for (int j = 0; j < kRegisterNum; j++)
+      acc[j] = _mm256_add_epi16(acc[j], _mm256_load_si256(&w[j]));
+  }
+  for (int j = 0; j < kRegisterNum; j++) _mm256_store_si256(&out[j], acc[j]);
+}
+
+NN_TARGET("avx2")
+inline __m256i WidenRowAvx2(const std::int8_t* row, __m256i scale) {
+  return _mm256_mullo_epi16(
+      _mm256_cvtepi8_epi16(
+          _mm_load_si128(reinterpret_cast<const __m128i*>(row))),
+      scale);
+}
+
+// 倍率と広げた値にもレジスタを使うので、SSE4.1と同じく半分ずつ計算する
+NN_TARGET("avx2")
+void UpdateCompactRowsAvx2(std::int16_t* output, const std::int16_t* input,
+                           const std::int8_t* const* sub_rows,
+                           const std::int16_t* sub_scales, int sub_num,
+                           const std::int8_t* const* add_rows,
+                           const std::int16_t* add_scales, int add_num) {
+  constexpr int kTileSize = kFeatureDemention / 2;
+  constexpr int kRegisterNum = kTileSize / 16;
+  for (int t = 0; t < kFeatureDemention; t += kTileSize) {
+    auto in = reinterpret_cast<const __m256i*>(input + t);
+    auto out = reinterpret_cast<__m256i*>(output + t);
+    __m256i acc[kRegisterNum];
+    for (int j = 0; j < kRegisterNum; j++) acc[j] = _mm256_load_si256(&in[j]);
+    for (int i = 0; i < sub_num; i++) {
+      const __m256i scale = _mm256_set1_epi16(sub_scales[i]);
+      const std::int8_t* w = sub_rows[i] + t;
+      for (int j = 0; j < kRegisterNum; j++)
+        acc[j] = _mm256_sub_epi16(acc[j], WidenRowAvx2(w + j * 16, scale));
+    }
+    for (int i = 0; i < add_num; i++) {
+      const __m256i scale = _mm256_set1_epi16(add_scales[i]);
+      const std::int8_t* w = add_rows[i] + t;
+      for (int j = 0; j < kRegisterNum; j++)
+        acc[j] = _mm256_add_epi16(acc[j], WidenRowAvx2(w + j * 16, scale));
+    }
+    for (int j = 0; j < kRegisterNum; j++) _mm256_store_si256(&out[j], acc[j]);
+  }
+}
+
+NN_TARGET("avx2")
+void ActivateInputAvx2(const std::int16_t* us, const std::int16_t* them,
+                       std::int8_t* output) {
+  const __m256i zero = _mm256_setzero_si256();
+  const std::int16_t* features[2] = {us, them};
+  for (int i = 0; i < 2; i++) {
+    auto in = reinterpret_cast<const __m256i*>(features[i]);
+    auto out = reinterpret_cast<__m256i*>(&output[kFeatureDemention * i]);
+    for (int j = 0; j < kFeatureDemention / 32; j++) {
+      _mm256_store_si256(
+          &out[j],
+          _mm256_permute4x64_epi64(
+              _mm256_max_epi8(
+                  _mm256_packs_epi16(_mm256_load_si256(&in[j * 2]),
+                                     _mm256_load_si256(&in[j * 2 + 1])),
+                  zero),
+              0b11011000));
+    }
+  }
+}
+
+template <int kInputDemention, int kOutputDemention>
+NN_TARGET("avx2")
+void AffineTransformAvx2(const std::int8_t* input, std::int32_t* output,
+                         const std::int32_t* bias, const std::int8_t* weight) {
+  const __m256i ones = _mm256_set1_epi16(1);
+  auto input_vector = reinterpret_cast<const __m256i*>(input);
+  constexpr int loop_num = kInputDemention / 32;
+  for (int i = 0; i < kOutputDemention; i++) {
+    __m256i sum = _mm256_set_epi32(0, 0, 0, 0, 0, 0, 0, bias[i]);
+    auto weights =
+        reinterpret_cast<const __m256i*>(&weight[kInputDemention * i]);
+    for (int j = 0; j < loop_num; j++) {
+      __m256i product = _mm256_maddubs_epi16(
+          _mm256_load_si256(&input_vector[j]), _mm256_load_si256(&weights[j]));
+      product = _mm256_madd_epi16(product, ones);
+      sum = _mm256_add_epi32(sum, product);
+    }
+    __m128i sum128 = _mm_add_epi32(_mm256_castsi256_si128(sum),
+                                   _mm256_extracti128_si256(sum, 1));
+    sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, 0x4E));
+    sum128 = _mm_add_epi32(sum128, _mm_shuffle_epi32(sum128, 0xB1));
+    output[i] = _mm_cvtsi128_si32(sum128);
+  }
+}
+
+template <int kInputDemention, int kOutputDemention>
+NN_TARGET("avx2")
+void SparseAffineTransformAvx2(const std::int8_t* input, std::int32_t* output,
+                               const std::int32_t* bias,
+                               const std::int8_t* weight) {
+  constexpr int kChunkNum = kInputDemention / kChunkSize;
+  constexpr int kChunkWeightSize = kOutputDemention * kChunkSize;
+  constexpr int kRegisterNum = kOutputDemention / 8;
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i ones = _mm256_set1_epi16(1);
+  auto in = reinterpret_cast<const __m256i*>(input);
+  std::uint16_t indices[kChunkNum + 8];
+  int count = 0;
+  __m128i base = _mm_setzero_si128();
+  for (int i = 0; i < kChunkNum / 8; i++) {
+    const int mask = _mm256_movemask_ps(_mm256_castsi256_ps(
+        _mm256_cmpgt_epi32(_mm256_load_si256(&in[i]), zero)));
+    AppendNonzeroIndices(mask, &base, indices, &count);
+  }
+
+  __m256i acc[kRegisterNum];
+  for (int j = 0; j < kRegisterNum; j++)
+    acc[j] = _mm256_load_si256(reinterpret_cast<const __m256i*>(bias) + j);
+  auto input32 = reinterpret_cast<const std::int32_t*>(input);
+  for (int i = 0; i < count; i++) {
+    const __m256i x = _mm256_set1_epi32(input32[indices[i]]);
+    auto w = reinterpret_cast<const __m256i*>(weight +
+                                              indices[i] * kChunkWeightSize);
+    for (int j = 0; j < kRegisterNum; j++) {
+      const __m256i product = _mm256_madd_epi16(
+          _mm256_maddubs_epi16(x, _mm256_load_si256(&w[j])), ones);
+      acc[j] = _mm256_add_epi32(acc[j], product);
+    }
+  }
+  for (int j = 0; j < kRegisterNum; j++)
+    _mm256_store_si256(reinterpret_cast<__m256i*>(output) + j, acc[j]);
+}
+
+template <int kInputDemention, int kOutputDemention>
+NN_TARGET("avx2")
+void ColumnAffineTransformAvx2(const std::int8_t* input, std::int32_t* output,
+                               const std::int32_t* bias,
+                               const std::int8_t* weight) {
+  constexpr int kChunkNum = kInputDemention / kChunkSize;
+  constexpr int kRegisterNum = kOutputDemention / 8;
+  const __m256i ones = _mm256_set1_epi16(1);
+  __m256i acc[kRegisterNum];
+  for (int j = 0; j < kRegisterNum; j++)
+    acc[j] = _mm256_load_si256(reinterpret_cast<const __m256i*>(bias) + j);
+  auto input32 = reinterpret_cast<const std::int32_t*>(input);
+  auto w = reinterpret_cast<const __m256i*>(weight);
+  for (int i = 0; i < kChunkNum; i++) {
+    const __m256i x = _mm256_set1_epi32(input32[i]);
+    for (int j = 0; j < kRegisterNum; j++) {
+      const __m256i product = _mm256_madd_epi16(
+          _mm256_maddubs_epi16(x, _mm256_load_si256(&w[i * kRegisterNum + j])),
+          ones);
+      acc[j] = _mm256_add_epi32(acc[j], product);
+    }
+  }
+  for (int j = 0; j < kRegisterNum; j++)
+    _mm256_store_si256(reinterpret_cast<__m256i*>(output) + j, acc[j]);
+}
+
+// kBatch局面分の入力をまとめて計算する。inputとoutputは局面ごとに並べる
+// 読み込んだ重みを全局面で使い回し、全局面で0の塊だけを飛ばす
+template <int kInputDemention, int kOutputDemention, int kBatch>
+NN_TARGET("avx2")
+void ColumnGemmAvx2(const std::int8_t* input, std::int32_t* output,
+                    const std::int32_t* bias, const std::int8_t* weight) {
+  constexpr int kChunkNum = kInputDemention / kChunkSize;
+  constexpr int kRegisterNum = kOutputDemention / 8;
+  const __m256i ones = _mm256_set1_epi16(1);
+  __m256i acc[kBatch][kRegisterNum];
+  for (int b = 0; b < kBatch; b++) {
+    for (int j = 0; j < kRegisterNum; j++)
+      acc[b][j] = _mm256_load_si256(reinterpret_cast<const __m256i*>(bias) + j);
+  }
+  auto input32 = reinterpret_cast<const std::int32_t*>(input);
+  auto w = reinterpret_cast<const __m256i*>(weight);
+  for (int i = 0; i < kChunkNum; i++) {
+    std::int32_t x[kBatch];
+    std::int32_t any = 0;
+    for (int b = 0; b < kBatch; b++) {
+      x[b] = input32[b * kChunkNum + i];
+      any |= x[b];
+    }
+    if (any == 0) continue;
+
+    __m256i weights[kRegisterNum];
+    for (int j = 0; j < kRegisterNum; j++)
+      weights[j] = _mm256_load_si256(&w[i * kRegisterNum + j]);
+    for (int b = 0; b < kBatch; b++) {
+      const __m256i xb = _mm256_set1_epi32(x[b]);
+      for (int j = 0; j < kRegisterNum; j++) {
+        const __m256i product =
+            _mm256_madd_epi16(_mm256_maddubs_epi16(xb, weights[j]), ones);
+        acc[b][j] = _mm256_add_epi32(acc[b][j], product);
+      }
+    }
+  }
+  for (int b = 0; b < kBatch; b++) {
+    for (int j = 0; j < kRegisterNum; j++) {
+      _mm256_store_si256(
+          reinterpret_cast<__m256i*>(output + b * kOutputDemention) + j,
+          acc[b][j]);
+    }
+  }
+}
+
+NN_TARGET("avx2")
+void ActivateAvx2(const std::int32_t* input, std::int8_t* output) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i offsets = _mm256_set_epi32(7, 3, 6, 2, 5, 1, 4, 0);
+  const auto in = reinterpret_cast<const __m256i*>(input);
+  auto out = reinterpret_cast<__m256i*>(output);
+  const __m256i words0 = _mm256_srai_epi16(
+      _mm256_packs_epi32(_mm256_load_si256(&in[0]), _mm256_load_si256(&in[1])),
+      kWeightScaleBits);
+  const __m256i words1 = _mm256_srai_epi16(
+      _mm256_packs_epi32(_mm256_load_si256(&in[2]), _mm256_load_si256(&in[3])),
+      kWeightScaleBits);
+  _mm256_store_si256(
+      out, _mm256_permutevar8x32_epi32(
+               _mm256_max_epi8(_mm256_packs_epi16(words0, words1), zero),
+               offsets));
+}
+
+NN_TARGET("avx2")
+std::int32_t PropagateAvx2(const std::int8_t* input,
+                           const std::int32_t* bias0,
+                           const std::int8_t* weights0,
+                           const std::int32_t* bias1,
+                           const std::int8_t* weights1,
+                           const std::int32_t* bias2,
+                           const std::int8_t* weights2) {
+  alignas(32) std::int32_t features0[Network::kLayer1Input];
+  SparseAffineTransformAvx2<Network::kLayer0Input, Network::kLayer1Input>(
+      input, features0, bias0, weights0);
+
+  alignas(32) std::int8_t out0[Network::kLayer1Input];
+  ActivateAvx2(features0, out0);
+
+  alignas(32) std::int32_t features1[Network::kLayer2Input];
+  ColumnAffineTransformAvx2<Network::kLayer1Input, Network::kLayer2Input>(
+      out0, features1, bias1, weights1);
+
+  alignas(32) std::int8_t out1[Network::kLayer2Input];
+  ActivateAvx2(features1, out1);
+
+  std::int32_t features2;
+  AffineTransformAvx2<Network::kLayer2Input, 1>(out1, &features2, bias2,
+                                                weights2);
+  return features2;
+}
+
+// 2局面分の累積で8本、重みで4本のレジスタを使う
+NN_TARGET("avx2")
+void PropagateBatchAvx2(const std::int8_t* input, int num,
+                        std::int32_t* output, const std::int32_t* bias0,
+                        const std::int8_t* weights0, const std::int32_t* bias1,
+                        const std::int8_t* weights1, const std::int32_t* bias2,
+                        const std::int8_t* weights2) {
+  constexpr int kBatch = 2;
+  int i = 0;
+  for (; i + kBatch <= num; i += kBatch) {
+    alignas(32) std::int32_t features0[kBatch][Network::kLayer1Input];
+    ColumnGemmAvx2<Network::kLayer0Input, Network::kLayer1Input, kBatch>(
+        input + i * Network::kLayer0Input, features0[0], bias0, weights0);
+
+    alignas(32) std::int8_t out0[kBatch][Network::kLayer1Input];
+    for (int b = 0; b < kBatch; b++) ActivateAvx2(features0[b], out0[b]);
+
+    alignas(32) std::int32_t features1[kBatch][Network::kLayer2Input];
+    ColumnGemmAvx2<Network::kLayer1Input, Network::kLayer2Input, kBatch>(
+        out0[0], features1[0], bias1, weights1);
+
+    for (int b = 0; b < kBatch; b++) {
+      alignas(32) std::int8_t out1[Network::kLayer2Input];
+      ActivateAvx2(features1[b], out1);
+      AffineTransformAvx2<Network::kLayer2Input, 1>(out1, &output[i + b],
+                                                    bias2, weights2);
+    }
+  }
+  for (; i < num; i++) {
+    output[i] = PropagateAvx2(input + i * Network::kLayer0Input, bias0,
+                              weights0, bias1, weights1, bias2, weights2);
+  }
+}
+
+// AVX-512 VNNI
+// gcc12のavx512fintrin.hは_mm512_undefined_epi32で誤った警告を出すので抑止する
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#endif
+// 入力層は512bitのレジスタとvpdpbusdで計算する
+// 入力は0から127に丸めてあるので、vpmaddubswと違い飽和しないことによる差は出ない
+NN_TARGET("avx512f,avx512bw,avx512vnni")
+void UpdateRowsVnni(std::int16_t* output, const std::int16_t* input,
+                    const std::int16_t* const* sub_rows, int sub_num,
+                    const std::int16_t* const* add_rows, int add_num) {
+  constexpr int kRegisterNum = kFeatureDemention / 32;
+  __m512i acc[kRegisterNum];
+  for (int j = 0; j < kRegisterNum; j++)
+    acc[j] = _mm512_loadu_si512(input + j * 32);
+  for (int i = 0; i < sub_num; i++) {
+    for (int j = 0; j < kRegisterNum; j++)
+      acc[j] = _mm512_sub_epi16(acc[j],
+                                _mm512_loadu_si512(sub_rows[i] + j * 32));
+  }
+  for (int i = 0; i < add_num; i++) {
+    for (int j = 0; j < kRegisterNum; j++)
+      acc[j] = _mm512_add_epi16(acc[j],
+                                _mm512_loadu_si512(add_rows[i] + j * 32));
+  }
+  for (int j = 0; j < kRegisterNum; j++)
+    _mm512_storeu_si512(output + j * 32, acc[j]);
+}
+
+NN_TARGET("avx512f,avx512bw,avx512vnni")
+inline __m512i WidenRowVnni(const std::int8_t* row, __m512i scale) {
+  return _mm512_mullo_epi16(
+      _mm512_cvtepi8_epi16(
+          _mm256_load_si256(reinterpret_cast<const __m256i*>(row))),
+      scale);
+}
+
+NN_TARGET("avx512f,avx512bw,avx512vnni")
+void UpdateCompactRowsVnni(std::int16_t* output, const std::int16_t* input,
+                           const std::int8_t* const* sub_rows,
+                           const std::int16_t* sub_scales, int sub_num,
+                           const std::int8_t* const* add_rows,
+                           const std::int16_t* add_scales, int add_num) {
+  constexpr int kRegisterNum = kFeatureDemention / 32;
+  __m512i acc[kRegisterNum];
+  for (int j = 0; j < kRegisterNum; j++)
+    acc[j] = _mm512_loadu_si512(input + j * 32);
+  for (int i = 0; i < sub_num; i++) {
+    const __m512i scale = _mm512_set1_epi16(sub_scales[i]);
+    for (int j = 0; j < kRegisterNum; j++)
+      acc[j] = _mm512_sub_epi16(acc[j],
+                                WidenRowVnni(sub_rows[i] + j * 32, scale));
+  }
+  for (int i = 0; i < add_num; i++) {
+    const __m512i scale = _mm512_set1_epi16(add_scales[i]);
+    for (int j = 0; j < kRegisterNum; j++)
+      acc[j] = _mm512_add_epi16(acc[j],
+                                WidenRowVnni(add_rows[i] + j * 32, scale));
+  }
+  for (int j = 0; j < kRegisterNum; j++)
+    _mm512_storeu_si512(output + j * 32, acc[j]);
+}
+
+template <int kInputDemention, int kOutputDemention>
+NN_TARGET("avx512f,avx512bw,avx512vnni")
+void SparseAffineTransformVnni(const std::int8_t* input, std::int32_t* output,
+                               const std::int32_t* bias,
+                               const std::int8_t* weight) {
+  constexpr int kChunkNum = kInputDemention / kChunkSize;
+  constexpr int kChunkWeightSize = kOutputDemention * kChunkSize;
+  constexpr int kRegisterNum = kOutputDemention / 16;
+  const __m512i zero = _mm512_setzero_si512();
+  std::uint16_t indices[kChunkNum + 8];
+  int count = 0;
+  __m128i base = _mm_setzero_si128();
+  for (int i = 0; i < kChunkNum / 16; i++) {
+    const int mask =
+        _mm512_cmpgt_epi32_mask(_mm512_loadu_si512(input + i * 64), zero);
+    AppendNonzeroIndices(mask & 0xFF, &base, indices, &count);
+    AppendNonzeroIndices(mask >> 8, &base, indices, &count);
+  }
+
+  // vpdpbusdは遅延が大きいので、4つの塊を別々のレジスタに足して依存を切る
+  constexpr int kUnroll = 4;
+  __m512i acc[kUnroll][kRegisterNum];
+  for (int u = 0; u < kUnroll; u++) {
+    for (int j = 0; j < kRegisterNum; j++)
+      acc[u][j] = u == 0 ? _mm512_loadu_si512(bias + j * 16) : zero;
+  }
+  auto input32 = reinterpret_cast<const std::int32_t*>(input);
+  int i = 0;
+  for (; i + kUnroll <= count; i += kUnroll) {
+    for (int u = 0; u < kUnroll; u++) {
+      const __m512i x = _mm512_set1_epi32(input32[indices[i + u]]);
+      const std::int8_t* w = weight + indices[i + u] * kChunkWeightSize;
+      for (int j = 0; j < kRegisterNum; j++)
+        acc[u][j] =
+            _mm512_dpbusd_epi32(acc[u][j], x, _mm512_loadu_si512(w + j * 64));
+    }
+  }
+  for (; i < count; i++) {
+    const __m512i x = _mm512_set1_epi32(input32[indices[i]]);
+    const std::int8_t* w = weight + indices[i] * kChunkWeightSize;
+    for (int j = 0; j < kRegisterNum; j++)
+      acc[0][j] =
+          _mm512_dpbusd_epi32(acc[0][j], x, _mm512_loadu_si512(w + j * 64));
+  }
+  for (int j = 0; j < kRegisterNum; j++) {
+    _mm512_storeu_si512(
+        output + j * 16,
+        _mm512_add_epi32(_mm512_add_epi32(acc[0][j], acc[1][j]),
+                         _mm512_add_epi32(acc[2][j], acc[3][j])));
+  }
+}
+
+// ColumnGemmAvx2と同じ計算をvpdpbusdで行う
+// 局面ごとに別のレジスタへ足すので、vpdpbusdの遅延は局面の数で隠れる
+template <int kInputDemention, int kOutputDemention, int kBatch>
+NN_TARGET("avx512f,avx512bw,avx512vnni")
+void ColumnGemmVnni(const std::int8_t* input, std::int32_t* output,
+                    const std::int32_t* bias, const std::int8_t* weight) {
+  constexpr int kChunkNum = kInputDemention / kChunkSize;
+  constexpr int kChunkWeightSize = kOutputDemention * kChunkSize;
+  constexpr int kRegisterNum = kOutputDemention / 16;
+  __m512i acc[kBatch][kRegisterNum];
+  for (int b = 0; b < kBatch; b++) {
+    for (int j = 0; j < kRegisterNum; j++)
+      acc[b][j] = _mm512_loadu_si512(bias + j * 16);
+  }
+  auto input32 = reinterpret_cast<const std::int32_t*>(input);
+  for (int i = 0; i < kChunkNum; i++) {
+    std::int32_t x[kBatch];
+    std::int32_t any = 0;
+    for (int b = 0; b < kBatch; b++) {
+      x[b] = input32[b * kChunkNum + i];
+      any |= x[b];
+    }
+    if (any == 0) continue;
+
+    const std::int8_t* w = weight + i * kChunkWeightSize;
+    __m512i weights[kRegisterNum];
+    for (int j = 0; j < kRegisterNum; j++)
+      weights[j] = _mm512_loadu_si512(w + j * 64);
+    for (int b = 0; b < kBatch; b++) {
+      const __m512i xb = _mm512_set1_epi32(x[b]);
+      for (int j = 0; j < kRegisterNum; j++)
+        acc[b][j] = _mm512_dpbusd_epi32(acc[b][j], xb, weights[j]);
+    }
+  }
+  for (int b = 0; b < kBatch; b++) {
+    for (int j = 0; j < kRegisterNum; j++)
+      _mm512_storeu_si512(output + b * kOutputDemention + j * 16, acc[b][j]);
+  }
+}
+
+NN_TARGET("avx512f,avx512bw,avx512vnni")
+std::int32_t PropagateVnni(const std::int8_t* input,
+                           const std::int32_t* bias0,
+                           const std::int8_t* weights0,
+                           const std::int32_t* bias1,
+                           const std::int8_t* weights1,
+                           const std::int32_t* bias2,
+                           const std::int8_t* weights2) {
+  alignas(32) std::int32_t features0[Network::kLayer1Input];
+  SparseAffineTransformVnni<Network::kLayer0Input, Network::kLayer1Input>(
+      input, features0, bias0, weights0);
+
+  alignas(32) std::int8_t out0[Network::kLayer1Input];
+  ActivateAvx2(features0, out0);
+
+  // 入力が32しかない層は256bitで十分
+  alignas(32) std::int32_t features1[Network::kLayer2Input];
+  ColumnAffineTransformAvx2<Network::kLayer1Input, Network::kLayer2Input>(
+      out0, features1, bias1, weights1);
+
+  alignas(32) std::int8_t out1[Network::kLayer2Input];
+  ActivateAvx2(features1, out1);
+
+  std::int32_t features2;
+  AffineTransformAvx2<Network::kLayer2Input, 1>(out1, &features2, bias2,
+                                                weights2);
+  return features2;
+}
+
+// 8局面分の累積で16本、重みで2本のレジスタを使う
+NN_TARGET("avx512f,avx512bw,avx512vnni")
+void PropagateBatchVnni(const std::int8_t* input, int num,
+                        std::int32_t* output, const std::int32_t* bias0,
+                        const std::int8_t* weights0, const std::int32_t* bias1,
+                        const std::int8_t* weights1, const std::int32_t* bias2,
+                        const std::int8_t* weights2) {
+  constexpr int kBatch = 8;
+  int i = 0;
+  for (; i + kBatch <= num; i += kBatch) {
+    alignas(64) std::int32_t features0[kBatch][Network::kLayer1Input];
+    ColumnGemmVnni<Network::kLayer0Input, Network::kLayer1Input, kBatch>(
+        input + i * Network::kLayer0Input, features0[0], bias0, weights0);
+
+    alignas(32) std::int8_t out0[kBatch][Network::kLayer1Input];
+    for (int b = 0; b < kBatch; b++) ActivateAvx2(features0[b], out0[b]);
+
+    alignas(32) std::int32_t features1[kBatch][Network::kLayer2Input];
+    for (int b = 0; b < kBatch; b += 2) {
+      ColumnGemmAvx2<Network::kLayer1Input, Network::kLayer2Input, 2>(
+          out0[b], features1[b], bias1, weights1);
+    }
+
+    for (int b = 0; b < kBatch; b++) {
+      alignas(32) std::int8_t out1[Network::kLayer2Input];
+      ActivateAvx2(features1[b], out1);
+      AffineTransformAvx2<Network::kLayer2Input, 1>(out1, &output[i + b],
+                                                    bias2, weights2);
+    }
+  }
+  for (; i < num; i++) {
+    output[i] = PropagateVnni(input + i * Network::kLayer0Input, bias0,
+                              weights0, bias1, weights1, bias2, weights2);
+  }
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+constexpr Kernel kSse41Kernel = {"sse4.1", UpdateRowsSse41,
+                                 UpdateCompactRowsSse41, ActivateInputSse41,
+                                 PropagateSse41, PropagateBatchSse41};
+constexpr Kernel kAvx2Kernel = {"avx2", UpdateRowsAvx2, UpdateCompactRowsAvx2,
+                                ActivateInputAvx2, PropagateAvx2,
+                                PropagateBatchAvx2};
+constexpr Kernel kVnniKernel = {"avx512vnni", UpdateRowsVnni,
+                                UpdateCompactRowsVnni, ActivateInputAvx2,
+                                PropagateVnni, PropagateBatchVnni};
+
+#ifdef _MSC_VER
+void CpuSupports(bool* avx2, bool* vnni) {
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7) return;
+
+  __cpuid(info, 1);
+  // OSがYMM,ZMMレジスタを保存するかも確認する
+  if (!(info[2] & (1 << 27))) return;
+  const unsigned long long xcr0 = _xgetbv(0);
+  __cpuidex(info, 7, 0);
+  *avx2 = (xcr0 & 0x06) == 0x06 && (info[1] & (1 << 5));
+  *vnni = (xcr0 & 0xE6) == 0xE6 && (info[1] & (1 << 16)) &&
+          (info[1] & (1 << 30)) && (info[2] & (1 << 11));
+}
+#endif
+}  // namespace
+
+// Initより前に呼ばれても動くように、どのCPUでも動く実装にしておく
+Kernel g_kernel = kSse41Kernel;
+
+void SelectKernel() {
+  bool avx2 = false;
+  bool vnni = false;
+#ifdef _MSC_VER
+  CpuSupports(&avx2, &vnni);
+#else
+  __builtin_cpu_init();
+  avx2 = __builtin_cpu_supports("avx2");
+  vnni = __builtin_cpu_supports("avx512f") &&
+         __builtin_cpu_supports("avx512bw") &&
+         __builtin_cpu_supports("avx512vnni");
+#endif
+  // KPPTのgatherもAVX2で選ぶ
+  Eval::SelectKernel(avx2);
+  if (vnni)
+    g_kernel = kVnniKernel;
+  else if (avx2)
+    g_kernel = kAvx2Kernel;
+  else
+    g_kernel = kSse41Kernel;
+}
+}  // namespace eval
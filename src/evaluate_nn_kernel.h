@@ -0,0 +1,52 @@
+#ifndef NOZOMI_EVALUATE_NN_KERNEL_H_
+#define NOZOMI_EVALUATE_NN_KERNEL_H_
+
+#include <cstdint>
+
+namespace eval {
+// 命令セットごとに実装を切り替える処理
+// 起動時にSelectKernelで実行しているCPUに合わせて選ぶ
+struct Kernel {
+  const char* name;
+  // inputからsub_rowsの各行を引き、add_rowsの各行を足してoutputに書く
+  // inputは1度だけ読み、レジスタ上で全ての行を足し引きしてから書き込む
+  // outputとinputは同じでもよい
+  void (*update_rows)(std::int16_t* output, const std::int16_t* input,
+                      const std::int16_t* const* sub_rows, int sub_num,
+                      const std::int16_t* const* add_rows, int add_num);
+  // update_rowsの重みがint8の場合
+  // 各行をint16に広げ、行ごとの倍率scalesを掛けてから足し引きする
+  void (*update_compact_rows)(std::int16_t* output, const std::int16_t* input,
+                              const std::int8_t* const* sub_rows,
+                              const std::int16_t* sub_scales, int sub_num,
+                              const std::int8_t* const* add_rows,
+                              const std::int16_t* add_scales, int add_num);
+  // 手番側、相手側の順に並べて0から127の範囲に丸める
+  void (*activate_input)(const std::int16_t* us, const std::int16_t* them,
+                         std::int8_t* output);
+  // 入力層以降を計算して出力層の値を返す
+  // weights0,weights1はNetwork::PrepareWeightsで入力4つごとに並べ替えたもの
+  std::int32_t (*propagate)(const std::int8_t* input,
+                            const std::int32_t* bias0,
+                            const std::int8_t* weights0,
+                            const std::int32_t* bias1,
+                            const std::int8_t* weights1,
+                            const std::int32_t* bias2,
+                            const std::int8_t* weights2);
+  // num局面分の入力をまとめてpropagateと同じ計算をし、outputに局面順に書く
+  // inputは局面ごとに並べる。読み込んだ重みを複数の局面で使い回す
+  void (*propagate_batch)(const std::int8_t* input, int num,
+                          std::int32_t* output, const std::int32_t* bias0,
+                          const std::int8_t* weights0,
+                          const std::int32_t* bias1,
+                          const std::int8_t* weights1,
+                          const std::int32_t* bias2,
+                          const std::int8_t* weights2);
+};
+
+extern Kernel g_kernel;
+
+void SelectKernel();
+}  // namespace eval
+
+#endif  // NOZOMI_EVALUATE_NN_KERNEL_H_
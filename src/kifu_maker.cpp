@@ -124,6 +124,7 @@ search(Position &pos, size_t multi_pv, Depth search_depth)
   for (int i = 7; i > 0; --i)
     (ss - i)->continuation_history =
         &thread->continuation_history_[0][0][kPieceNone][0];  // Use as sentinel
+  thread->attach_accumulators(stack, kMaxPly + 10);
 
   thread->root_moves_.clear();
   for (auto &m : MoveList<kLegalForSearch>(pos))
@@ -96,6 +96,7 @@ void NnLearner::MakeBatch(std::vector<PositionData>& batch) {
       (ss - i)->continuation_history =
           &Threads[thread_id + 1]
                ->continuation_history_[0][0][kPieceNone][0];  // Use as sentinel
+    Threads[thread_id + 1]->attach_accumulators(stack, 50);
 
     Move pv[kMaxPly + 1];
     ss->pv = pv;
@@ -151,6 +152,10 @@ void NnLearner::Learn(std::istringstream& is) {
 #if 0
   is >> valid_file_name_;
 #endif
+  // int8w肷ƁA͑w̏d݂int8`ŏolɊۂ߂ȂwK
+  std::string format;
+  compact_kp_ = (is >> format) && format == "int8";
+  feature_.set_compact_kp(compact_kp_);
   TT.Clear();
   Search::Limits.infinite = 1;
   Search::Signals.stop_on_ponder_hit = false;
@@ -216,6 +221,7 @@ void NnLearner::LearnMain() {
 #endif
   feature_.OutputParamesters("nn_feature2.bin");
   network_.OutputParamesters("nn_network2.bin");
+  if (compact_kp_) eval::SaveWeightFile("nn2_int8.bin", eval::KpFormat::kInt8);
 }
 
 std::vector<PositionData> NnLearner::ReadSfenFile(std::ifstream& ifs,
@@ -39,4 +39,5 @@ class NnLearner {
   std::string train_file_name_;
   std::string valid_file_name_;
   int count_;
+  bool compact_kp_ = false;
 };
\ No newline at end of file
@@ -0,0 +1,328 @@
+#include "mate_solver.h"
+
+#include <algorithm>
+#include "move_generator.h"
+#include "position.h"
+#include "search.h"
+
+MateSolver Mate;
+
+void MateSolver::Resize(std::size_t mb_size) {
+  std::size_t count = std::size_t(1)
+                      << msb(std::max<std::uint64_t>(
+                             1, (mb_size * 1024 * 1024) / sizeof(Cluster)));
+  if (table_.size() == count) return;
+
+  table_.clear();
+  table_.shrink_to_fit();
+  table_.resize(count);
+  mask_ = count - 1;
+}
+
+void MateSolver::Clear() { std::fill(table_.begin(), table_.end(), Cluster()); }
+
+const MateSolver::Entry* MateSolver::Probe(Key key) const {
+  const Cluster& cluster = table_[key & mask_];
+  const std::uint32_t key32 = static_cast<std::uint32_t>(key >> 32);
+  for (const Entry& e : cluster.entry)
+    if (e.key == key32 && (e.pn != 0 || e.dn != 0)) return &e;
+  return nullptr;
+}
+
+void MateSolver::Store(Key key, std::uint32_t pn, std::uint32_t dn,
+                       std::uint16_t distance) {
+  Cluster& cluster = table_[key & mask_];
+  const std::uint32_t key32 = static_cast<std::uint32_t>(key >> 32);
+  // 同じ局面がなければ、前の問題の局面、未解決で調べた量が少ない局面の順に置き換える
+  auto priority = [&](const Entry& e) {
+    std::uint64_t p = e.generation == generation_ ? 1ULL << 62 : 0;
+    if (e.pn == 0 || e.dn == 0) p |= 1ULL << 61;
+    return p + std::min<std::uint64_t>(e.pn, kInfinite) +
+           std::min<std::uint64_t>(e.dn, kInfinite);
+  };
+  Entry* replace = &cluster.entry[0];
+  for (Entry& e : cluster.entry) {
+    if (e.key == key32) {
+      replace = &e;
+      break;
+    }
+    if (priority(e) < priority(*replace)) replace = &e;
+  }
+  replace->key = key32;
+  replace->pn = pn;
+  replace->dn = dn;
+  replace->distance = distance;
+  replace->generation = generation_;
+}
+
+MateSolver::ChildValue MateSolver::LookUpChild(Key key, int ply) const {
+  // 千日手と深さの上限は手順によるので表には書かず、ここで詰まない扱いにする
+  // 王手の連続による千日手は攻め方の負けなので、どちらの手番でも詰まない
+  if (ply >= kMaxDepth ||
+      std::find(path_.begin(), path_.end(), key) != path_.end())
+    return {kInfinite, 0, 0};
+
+  if (const Entry* e = Probe(key)) return {e->pn, e->dn, e->distance};
+  return {1, 1, 0};
+}
+
+namespace {
+// or_nodeは攻め方の手番の局面。攻め方は王手、玉方は王手を外す合法手を返す
+ExtMove* GenerateMoves(const Position& pos, bool or_node, ExtMove* moves) {
+  // 王手の生成は手番側が王手されていないことを前提にしている
+  ExtMove* end = pos.in_check() ? generate<kEvasions>(pos, moves)
+                                : generate<kChecks>(pos, moves);
+
+  // 同じ手が別の経路で生成されることがあるので重複を除く
+  std::sort(moves, end, [](const ExtMove& a, const ExtMove& b) {
+    return a.move < b.move;
+  });
+  end = std::unique(moves, end, [](const ExtMove& a, const ExtMove& b) {
+    return a.move == b.move;
+  });
+
+  const BitBoard pinned = pos.pinned_pieces();
+  ExtMove* last = moves;
+  for (ExtMove* m = moves; m != end; ++m) {
+    BitBoard p = pinned;
+    if (!pos.legal(m->move, p)) continue;
+    // 攻め方が王手されている場合は、王手を外しながら王手をかける手だけを調べる
+    if (or_node && pos.in_check() && !pos.gives_check(m->move)) continue;
+    *last++ = *m;
+  }
+  return last;
+}
+
+int SearchAnd(Position& pos, int depth, MateCache& cache);
+
+// 攻め方の手番の局面。depth手以内に詰む場合は最短の手数を返す
+int SearchOr(Position& pos, int depth, MateCache& cache, Move* move) {
+  *move = kMoveNone;
+  // 攻め方が王手されている局面は調べない
+  if (pos.in_check()) return 0;
+  if (depth < 3) return (*move = search_mate1ply(pos)) != kMoveNone;
+
+  // 表の詰みの手数は最短なので、それより短い手数で調べる場合は詰まない
+  MateCacheEntry* entry = cache[pos.key()];
+  if (entry->key == pos.key()) {
+    if (entry->ply != 0) {
+      if (entry->ply > depth) return 0;
+      *move = entry->move;
+      return entry->ply;
+    }
+    if (entry->depth >= depth) return 0;
+  }
+
+  int result = 0;
+  if ((*move = search_mate1ply(pos)) != kMoveNone) result = 1;
+
+  ExtMove moves[kMaxMoves];
+  ExtMove* end = result == 0 ? GenerateMoves(pos, true, moves) : moves;
+  // 詰みが見つかったら、それより短い詰みだけを探す
+  int limit = depth;
+  for (ExtMove* m = moves; m != end && limit >= 3; ++m) {
+    StateInfo st;
+    pos.do_move(m->move, st);
+    const int ply = SearchAnd(pos, limit - 1, cache);
+    pos.undo_move(m->move);
+    if (ply >= 0) {
+      result = ply + 1;
+      *move = m->move;
+      limit = result - 2;
+    }
+  }
+
+  entry->key = pos.key();
+  entry->move = *move;
+  entry->ply = result;
+  entry->depth = depth;
+  return result;
+}
+
+// 玉方の手番の局面。全ての回避に詰みがあれば最長の手数、なければ-1を返す
+// 既に詰んでいる場合は0
+int SearchAnd(Position& pos, int depth, MateCache& cache) {
+  ExtMove moves[kMaxMoves];
+  ExtMove* end = GenerateMoves(pos, false, moves);
+  int longest = -1;
+  for (ExtMove* m = moves; m != end; ++m) {
+    StateInfo st;
+    Move move;
+    pos.do_move(m->move, st);
+    const int ply = SearchOr(pos, depth - 1, cache, &move);
+    pos.undo_move(m->move);
+    if (ply == 0) return -1;
+    longest = std::max(longest, ply);
+  }
+  return longest + 1;
+}
+}  // namespace
+
+void MateSolver::CheckLimits() {
+  if (Search::Signals.stop ||
+      (time_limit_ > 0 && now() - start_time_ >= time_limit_))
+    aborted_ = true;
+}
+
+void MateSolver::SearchNode(Position& pos, bool or_node, std::uint32_t thpn,
+                            std::uint32_t thdn, int ply) {
+  const Key key = pos.key();
+  if ((++nodes_ & 1023) == 0) CheckLimits();
+  if (aborted_) return;
+
+  // 1手詰めは専用の関数で調べる
+  if (or_node && !pos.in_check() && search_mate1ply(pos) != kMoveNone) {
+    Store(key, 0, kInfinite, 1);
+    return;
+  }
+
+  ExtMove* moves = moves_[ply].data();
+  ExtMove* end = GenerateMoves(pos, or_node, moves);
+  if (moves == end) {
+    // 打ち歩詰めは生成されないので、手がなければ玉方の詰み、攻め方の不詰み
+    if (or_node)
+      Store(key, kInfinite, 0, 0);
+    else
+      Store(key, 0, kInfinite, 0);
+    return;
+  }
+
+  path_.push_back(key);
+  while (!aborted_) {
+    std::uint64_t sum = 0;
+    std::uint32_t min = kInfinite;
+    std::uint32_t second = kInfinite;
+    std::uint16_t distance = or_node ? 0xFFFF : 0;
+    ExtMove* best = moves;
+    ChildValue best_value = {};
+    for (ExtMove* m = moves; m != end; ++m) {
+      const ChildValue v = LookUpChild(pos.key_after(m->move), ply + 1);
+      // OR節点は証明数の最小と反証数の和、AND節点はその逆をとる
+      const std::uint32_t select = or_node ? v.pn : v.dn;
+      sum += or_node ? v.dn : v.pn;
+      if (v.pn == 0)
+        distance = or_node ? std::min(distance, v.distance)
+                           : std::max(distance, v.distance);
+      if (select < min) {
+        second = min;
+        min = select;
+        best = m;
+        best_value = v;
+      } else if (select < second) {
+        second = select;
+      }
+    }
+    // 和が無限大に届いても、証明または反証したことにはしない
+    const std::uint32_t total =
+        min == 0 ? kInfinite
+                 : static_cast<std::uint32_t>(
+                       std::min<std::uint64_t>(sum, kInfinite - 1));
+    const std::uint32_t pn = or_node ? min : total;
+    const std::uint32_t dn = or_node ? total : min;
+    if (pn >= thpn || dn >= thdn) {
+      Store(key, pn, dn, pn == 0 ? distance + 1 : 0);
+      break;
+    }
+
+    // 最善の子は、2番目に良い子を上回るか、この局面の閾値に届くまで調べる
+    std::uint32_t child_thpn;
+    std::uint32_t child_thdn;
+    if (or_node) {
+      child_thpn = std::min(thpn, second + 1);
+      child_thdn = std::min<std::uint64_t>(
+          kInfinite, std::uint64_t(thdn) - dn + best_value.dn);
+    } else {
+      child_thdn = std::min(thdn, second + 1);
+      child_thpn = std::min<std::uint64_t>(
+          kInfinite, std::uint64_t(thpn) - pn + best_value.pn);
+    }
+
+    pos.do_move(best->move, states_[ply]);
+    SearchNode(pos, !or_node, child_thpn, child_thdn, ply + 1);
+    pos.undo_move(best->move);
+  }
+  path_.pop_back();
+}
+
+Move MateSolver::SelectPvMove(Position& pos, bool or_node) const {
+  // 攻め方は最短、玉方は最長の手順になる手を選ぶ
+  ExtMove moves[kMaxMoves];
+  ExtMove* end = GenerateMoves(pos, or_node, moves);
+  Move best = kMoveNone;
+  std::uint16_t best_distance = 0;
+  for (ExtMove* m = moves; m != end; ++m) {
+    const Entry* e = Probe(pos.key_after(m->move));
+    if (e == nullptr || e->pn != 0) continue;
+    if (best == kMoveNone || (or_node ? e->distance < best_distance
+                                      : e->distance > best_distance)) {
+      best = m->move;
+      best_distance = e->distance;
+    }
+  }
+  // 1手詰めは子局面を表に書かないので、ここで探す
+  if (best == kMoveNone && or_node && !pos.in_check())
+    best = search_mate1ply(pos);
+  return best;
+}
+
+bool MateSolver::ExtractPv(Position& pos, std::vector<Move>& pv) {
+  bool or_node = true;
+  bool mate = false;
+  path_.clear();
+  for (int ply = 0; ply < kMaxDepth && !aborted_; ++ply) {
+    ExtMove* moves = moves_[ply].data();
+    if (!or_node && GenerateMoves(pos, or_node, moves) == moves) {
+      mate = true;
+      break;
+    }
+
+    Move best = SelectPvMove(pos, or_node);
+    if (best == kMoveNone) {
+      // 途中の局面が表から置き換えられていた場合は、その局面から探索し直す
+      SearchNode(pos, or_node, kInfinite, kInfinite, ply);
+      best = SelectPvMove(pos, or_node);
+      if (best == kMoveNone) break;
+    }
+
+    pv.push_back(best);
+    path_.push_back(pos.key());
+    pos.do_move(best, states_[ply]);
+    or_node = !or_node;
+  }
+
+  for (auto it = pv.rbegin(); it != pv.rend(); ++it) pos.undo_move(*it);
+  return mate;
+}
+
+MateSolver::Result MateSolver::Solve(Position& pos, int time_limit,
+                                     std::vector<Move>& pv) {
+  if (table_.empty()) Resize(16);
+  if (moves_.empty()) {
+    moves_.resize(kMaxDepth);
+    states_.resize(kMaxDepth);
+  }
+
+  ++generation_;
+  path_.clear();
+  nodes_ = 0;
+  start_time_ = now();
+  time_limit_ = time_limit;
+  aborted_ = false;
+  pv.clear();
+
+  SearchNode(pos, true, kInfinite, kInfinite, 0);
+  if (aborted_) return Result::kTimeout;
+
+  const Entry* root = Probe(pos.key());
+  if (root == nullptr || root->pn != 0) return Result::kNoMate;
+
+  // 千日手の扱いが手順によって変わるため、まれに最後まで取り出せないことがある
+  // その場合も詰むことは分かっているので、取り出せたところまでを返す
+  ExtractPv(pos, pv);
+  if (aborted_) return Result::kTimeout;
+  return Result::kMate;
+}
+
+int SearchMate(Position& pos, int max_ply, MateCache& cache, Move* move) {
+  return SearchOr(pos, max_ply, cache, move);
+}
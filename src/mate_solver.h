@@ -0,0 +1,121 @@
+#ifndef NOZOMI_MATE_SOLVER_H_
+#define NOZOMI_MATE_SOLVER_H_
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "misc.h"
+#include "move.h"
+#include "position.h"
+#include "types.h"
+
+// df-pnによる詰将棋の探索
+// 局面ごとの証明数と反証数を専用の表に持ち、閾値を超えるまで
+// 最も有望な子局面だけを深く調べる
+class MateSolver {
+ public:
+  enum class Result { kMate, kNoMate, kTimeout };
+
+  MateSolver() = default;
+  MateSolver(const MateSolver&) = delete;
+  MateSolver& operator=(const MateSolver&) = delete;
+
+  // 表の大きさをMBで指定する。大きさが変わらない場合は中身を残す
+  void Resize(std::size_t mb_size);
+  void Clear();
+
+  // posの手番側が玉方を詰ませられるかを調べる。詰む場合はpvに手順を入れる
+  // time_limitはミリ秒で、0以下の場合は時間では打ち切らない
+  // Signals.stopが立った場合も打ち切る
+  Result Solve(Position& pos, int time_limit, std::vector<Move>& pv);
+
+  std::uint64_t nodes() const { return nodes_; }
+
+ private:
+  static constexpr std::uint32_t kInfinite = 1 << 30;
+  // 同一手順で深くなりすぎた局面は詰まないものとして扱う
+  static constexpr int kMaxDepth = 400;
+  static constexpr int kClusterSize = 4;
+
+  struct Entry {
+    // keyの上位32bit
+    std::uint32_t key;
+    std::uint32_t pn;
+    std::uint32_t dn;
+    // 証明済みの場合の詰みまでの手数
+    std::uint16_t distance;
+    std::uint16_t generation;
+  };
+
+  struct alignas(64) Cluster {
+    Entry entry[kClusterSize];
+  };
+
+  // 子局面の証明数と反証数
+  struct ChildValue {
+    std::uint32_t pn;
+    std::uint32_t dn;
+    std::uint16_t distance;
+  };
+
+  const Entry* Probe(Key key) const;
+  void Store(Key key, std::uint32_t pn, std::uint32_t dn,
+             std::uint16_t distance);
+  ChildValue LookUpChild(Key key, int ply) const;
+
+  void SearchNode(Position& pos, bool or_node, std::uint32_t thpn,
+                  std::uint32_t thdn, int ply);
+  Move SelectPvMove(Position& pos, bool or_node) const;
+  bool ExtractPv(Position& pos, std::vector<Move>& pv);
+  void CheckLimits();
+
+  std::vector<Cluster> table_;
+  std::size_t mask_ = 0;
+  std::uint16_t generation_ = 0;
+  // 現在の手順の局面のkey。千日手になる手は詰まない手として扱う
+  std::vector<Key> path_;
+  // 手順の深さごとの指し手と局面。深さがkMaxDepthまであるので、
+  // 再帰の度にスタックに置くとスレッドのスタックが足りなくなる
+  std::vector<std::array<ExtMove, kMaxMoves>> moves_;
+  std::vector<StateInfo> states_;
+  std::uint64_t nodes_ = 0;
+  TimePoint start_time_ = 0;
+  int time_limit_ = 0;
+  bool aborted_ = false;
+};
+
+extern MateSolver Mate;
+
+// 探索中の短手数の詰み探索の結果
+struct MateCacheEntry {
+  Key key;
+  Move move;
+  // 詰む場合は最短の詰みまでの手数、詰まない場合は0
+  std::uint16_t ply;
+  // 詰まないことを確かめた手数
+  std::uint16_t depth;
+};
+
+// 短手数の詰み探索の結果を局面ごとに残す表。スレッドごとに持つ
+class MateCache {
+ public:
+  static constexpr std::size_t kSize = 1 << 16;
+
+  MateCache() : table_(kSize) {}
+
+  MateCacheEntry* operator[](Key key) { return &table_[key & (kSize - 1)]; }
+
+  void Clear() { std::fill(table_.begin(), table_.end(), MateCacheEntry()); }
+
+ private:
+  std::vector<MateCacheEntry> table_;
+};
+
+// 攻め方は王手、玉方は王手の回避だけを指して、max_ply手以内の詰みを調べる
+// 詰む場合は最短の手数を返してmoveに初手を入れる。詰まないか分からない場合は0を返す
+// max_plyが1の場合はsearch_mate1plyと同じ
+int SearchMate(Position& pos, int max_ply, MateCache& cache, Move* move);
+
+#endif  // NOZOMI_MATE_SOLVER_H_
@@ -21,9 +21,30 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
+#include <utility>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
 
 #include "misc.h"
 #include "thread.h"
@@ -71,13 +92,295 @@ operator<<(std::ostream& os, SyncCout sc)
   return os;
 }
 
+bool
+MappedFile::open(const string &path, bool copy_on_write)
+{
+  close();
+#if defined(_WIN32)
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE)
+    return false;
+
+  LARGE_INTEGER file_size;
+  if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0)
+  {
+    CloseHandle(file);
+    return false;
+  }
+
+  HANDLE mapping = CreateFileMappingA(file, nullptr,
+                                      copy_on_write ? PAGE_WRITECOPY : PAGE_READONLY,
+                                      0, 0, nullptr);
+  CloseHandle(file);
+  if (mapping == nullptr)
+    return false;
+
+  void *data = MapViewOfFile(mapping, copy_on_write ? FILE_MAP_COPY : FILE_MAP_READ,
+                             0, 0, 0);
+  if (data == nullptr)
+  {
+    CloseHandle(mapping);
+    return false;
+  }
+  mapping_ = mapping;
+  size_ = static_cast<size_t>(file_size.QuadPart);
+#else
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0)
+  {
+    ::close(fd);
+    return false;
+  }
+
+  void *data = copy_on_write
+               ? mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)
+               : mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED)
+    return false;
+
+  size_ = static_cast<size_t>(st.st_size);
+#endif
+  data_ = static_cast<char *>(data);
+  return true;
+}
+
+void
+MappedFile::close()
+{
+  if (data_ == nullptr)
+    return;
+
+#if defined(_WIN32)
+  UnmapViewOfFile(data_);
+  CloseHandle(mapping_);
+  mapping_ = nullptr;
+#else
+  munmap(data_, size_);
+#endif
+  data_ = nullptr;
+  size_ = 0;
+}
+
 void
-prefetch(void *addr)
+MappedFile::swap(MappedFile &other)
+{
+  std::swap(data_, other.data_);
+  std::swap(size_, other.size_);
+#if defined(_WIN32)
+  std::swap(mapping_, other.mapping_);
+#endif
+}
+
+string
+temporary_path(const string &path)
+{
+#if defined(_WIN32)
+  const unsigned long pid = GetCurrentProcessId();
+#else
+  const unsigned long pid = static_cast<unsigned long>(getpid());
+#endif
+  return path + "." + std::to_string(pid) + ".tmp";
+}
+
+bool
+replace_file(const string &temp_path, const string &path)
 {
-#if defined(_MSC_VER)
-  _mm_prefetch((char *)addr, _MM_HINT_T0);
+#if defined(_WIN32)
+  // std::renameは置き換え先があると失敗する
+  const bool success = MoveFileExA(temp_path.c_str(), path.c_str(),
+                                   MOVEFILE_REPLACE_EXISTING) != 0;
 #else
-  __builtin_prefetch(addr);
+  const bool success = std::rename(temp_path.c_str(), path.c_str()) == 0;
+#endif
+  if (!success)
+    std::remove(temp_path.c_str());
+  return success;
+}
+
+void *
+LargePageMemory::allocate(size_t size)
+{
+  free();
+#if defined(_WIN32)
+  // large pageはSeLockMemoryPrivilegeがある場合だけ確保できる
+  const size_t large_page_size = GetLargePageMinimum();
+  if (large_page_size > 0)
+  {
+    const size_t rounded = (size + large_page_size - 1) & ~(large_page_size - 1);
+    mem_ = VirtualAlloc(nullptr, rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES,
+                        PAGE_READWRITE);
+    large_pages_ = mem_ != nullptr;
+  }
+  if (mem_ == nullptr)
+    mem_ = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+  mapped_ = mem_ != nullptr;
+#else
+  const size_t kHugePageSize = size_t(1) << 21;
+#if defined(__linux__) && defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+  // 予約されているhugetlbfsのページがあれば、大きいページから順に試す
+  const int kPageShifts[] = {30, 21};
+  for (int shift : kPageShifts)
+  {
+    const size_t page_size = size_t(1) << shift;
+    if (size < page_size)
+      continue;
+
+    const size_t rounded = (size + page_size - 1) & ~(page_size - 1);
+    void *mem = mmap(nullptr, rounded, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT),
+                     -1, 0);
+    if (mem != MAP_FAILED)
+    {
+      mem_ = mem;
+      size_ = rounded;
+      mapped_ = true;
+      large_pages_ = true;
+      return mem_;
+    }
+  }
+#endif
+  // Transparent Huge Pagesが使えるように2MB境界に揃える
+  const size_t alignment = size >= kHugePageSize ? kHugePageSize : 64;
+  const size_t rounded = (size + alignment - 1) & ~(alignment - 1);
+  mem_ = aligned_alloc(alignment, rounded);
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+  if (mem_ != nullptr && alignment == kHugePageSize)
+    large_pages_ = madvise(mem_, rounded, MADV_HUGEPAGE) == 0;
+#endif
+  size_ = rounded;
 #endif
+  return mem_;
 }
 
+void
+LargePageMemory::free()
+{
+  if (mem_ == nullptr)
+    return;
+
+#if defined(_WIN32)
+  VirtualFree(mem_, 0, MEM_RELEASE);
+#else
+  if (mapped_)
+    munmap(mem_, size_);
+  else
+    std::free(mem_);
+#endif
+  mem_ = nullptr;
+  size_ = 0;
+  mapped_ = false;
+  large_pages_ = false;
+}
+
+namespace Numa
+{
+#if defined(__linux__)
+namespace
+{
+struct Node
+{
+  int id;
+  std::vector<int> cpus;
+};
+
+// "0-3,8-11"のような形式を読む
+std::vector<int>
+parse_cpu_list(const string &list)
+{
+  std::vector<int> cpus;
+  stringstream ss(list);
+  string range;
+  while (getline(ss, range, ','))
+  {
+    size_t dash = range.find('-');
+    int first = atoi(range.substr(0, dash).c_str());
+    int last = dash == string::npos ? first : atoi(range.substr(dash + 1).c_str());
+    for (int cpu = first; cpu <= last; ++cpu)
+      cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+const std::vector<Node> &
+nodes()
+{
+  static const std::vector<Node> result = []
+  {
+    std::vector<Node> nodes;
+    for (int id = 0; id < 1024; ++id)
+    {
+      ifstream ifs("/sys/devices/system/node/node" + to_string(id) + "/cpulist");
+      if (!ifs)
+        continue;
+
+      string list;
+      getline(ifs, list);
+      std::vector<int> cpus = parse_cpu_list(list);
+      if (!cpus.empty())
+        nodes.push_back({id, cpus});
+    }
+    return nodes;
+  }();
+  return result;
+}
+}
+
+int
+node_count()
+{
+  return std::max<int>(1, static_cast<int>(nodes().size()));
+}
+
+void
+bind_this_thread(int node)
+{
+  if (nodes().size() <= 1)
+    return;
+
+  cpu_set_t mask;
+  CPU_ZERO(&mask);
+  for (size_t i = 0; i < nodes().size(); ++i)
+  {
+    if (node >= 0 && i != node % nodes().size())
+      continue;
+    for (int cpu : nodes()[i].cpus)
+      CPU_SET(cpu, &mask);
+  }
+  pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+}
+
+void
+bind_memory(void *mem, size_t size, int node)
+{
+  if (nodes().size() <= 1 || nodes()[node % nodes().size()].id >= 64)
+    return;
+
+  // libnumaに依存しないようにmbindを直接呼ぶ。失敗しても性能が落ちるだけ
+  const unsigned long kMpolBind = 2;
+  unsigned long mask = 1UL << nodes()[node % nodes().size()].id;
+  syscall(SYS_mbind, mem, size, kMpolBind, &mask, sizeof(mask) * 8 + 1, 0);
+}
+#else
+int
+node_count()
+{
+  return 1;
+}
+
+void
+bind_this_thread(int)
+{
+}
+
+void
+bind_memory(void *, size_t, int)
+{
+}
+#endif
+}
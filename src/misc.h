@@ -35,8 +35,16 @@
 extern const
 std::string engine_info(bool to_usi = false);
 
-extern void
-prefetch(void *addr);
+// 評価関数の重みの先読みでは1手で何度も呼ぶのでインライン展開する
+inline void
+prefetch(const void *addr)
+{
+#if defined(_MSC_VER)
+  _mm_prefetch((const char *)addr, _MM_HINT_T0);
+#else
+  __builtin_prefetch(addr);
+#endif
+}
 
 typedef std::chrono::milliseconds::rep TimePoint;
 inline TimePoint
@@ -60,6 +68,97 @@ private:
   std::vector<Entry> table;
 };
 
+// 置換表のような大きな領域をhuge pageで確保する
+// huge pageが使えない場合は通常のページにフォールバックする
+class LargePageMemory
+{
+public:
+  LargePageMemory() = default;
+  LargePageMemory(const LargePageMemory &) = delete;
+  LargePageMemory &operator=(const LargePageMemory &) = delete;
+  ~LargePageMemory() { free(); }
+
+  // 64byte境界に揃った領域を返す。中身は初期化しない
+  void *
+  allocate(size_t size);
+
+  void
+  free();
+
+  bool
+  large_pages() const { return large_pages_; }
+
+private:
+  void *mem_ = nullptr;
+  size_t size_ = 0;
+  bool mapped_ = false;
+  bool large_pages_ = false;
+};
+
+// NUMAノードの扱い。ノードはCPUを持つものだけを0から順に数える
+// Linux以外では全体を1つのノードとして扱う
+namespace Numa
+{
+int
+node_count();
+
+// 呼び出したスレッドをノードのCPUだけで動かす。負の場合は全てのCPUに戻す
+void
+bind_this_thread(int node);
+
+// まだ触っていない領域を、ノードのメモリに割り当てるようにする
+// memはページ境界に揃っている必要がある
+void
+bind_memory(void *mem, size_t size, int node);
+}
+
+// ファイルをメモリにマップする
+// 同じファイルをマップしたプロセス間では物理メモリが共有される
+// copy_on_writeを指定すると書き込めるが、書き込んだ内容はファイルに反映されない
+class MappedFile
+{
+public:
+  MappedFile() = default;
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  ~MappedFile() { close(); }
+
+  bool
+  open(const std::string &path, bool copy_on_write = false);
+
+  void
+  close();
+
+  void
+  swap(MappedFile &other);
+
+  const char *
+  data() const { return data_; }
+
+  char *
+  data() { return data_; }
+
+  size_t
+  size() const { return size_; }
+
+private:
+  char *data_ = nullptr;
+  size_t size_ = 0;
+#if defined(_WIN32)
+  void *mapping_ = nullptr;
+#endif
+};
+
+// pathを書き直すときに使う一時ファイルの名前
+// 同時に書き出す他のプロセスと重ならないように、pidを付ける
+std::string
+temporary_path(const std::string &path);
+
+// temporary_pathに書き終えたファイルでpathを置き換える。失敗したら一時ファイルを消す
+// pathをマップしている他のプロセスは置き換える前のファイルを読み続けられる
+bool
+replace_file(const std::string &temp_path, const std::string &path);
+
 
 enum SyncCout
 {
@@ -73,6 +172,17 @@ operator<<(std::ostream&, SyncCout);
 #define sync_cout std::cout << kIoLock
 #define sync_endl std::endl << kIoUnlock
 
+// a * bの上位64bit
+inline uint64_t
+mul_hi64(uint64_t a, uint64_t b)
+{
+#if defined(_MSC_VER)
+  return __umulh(a, b);
+#else
+  return static_cast<uint64_t>((static_cast<unsigned __int128>(a) * b) >> 64);
+#endif
+}
+
 #if defined(_MSC_VER)
 inline int
 msb(uint64_t b)
@@ -1100,7 +1100,7 @@ template <>
 ExtMove *generate<kChecks>(const Position &pos, ExtMove *move) {
   Color color = pos.side_to_move();
   BitBoard target;
-  CheckInfo ci(pos);
+  const CheckInfo &ci = pos.check_info();
 
   target = ~pos.pieces(kOccupied, color);
 
@@ -1161,7 +1161,7 @@ template <>
 ExtMove *generate<kQuietChecks>(const Position &pos, ExtMove *move) {
   Color color = pos.side_to_move();
   BitBoard target = ~pos.occupied();
-  CheckInfo ci(pos);
+  const CheckInfo &ci = pos.check_info();
 
   if ((ci.discover_check_candidates & pos.pieces(kPawn, color)).test())
     move = GeneratePawnCheck<true>(pos, target, ci, move);
@@ -1348,6 +1348,36 @@ bool can_piece_capture(const Position &pos, Square sq, Color color,
   return false;
 }
 
+/// 駒を打って王手した時に玉が動くことで王手を回避できるか
+///
+/// 駒を打つと他の駒の利きは遮られるだけなので、
+/// 打つ前の攻め方の利きがないマスには逃げられる
+///
+/// @param pos          Positionクラス
+/// @param sq           駒を打った位置
+/// @param check_attack 打った駒の利き
+/// @param color        王手をかけられている側
+/// @param occupied     駒を打った後のoccupied bitboard
+/// @param attacked     駒を打つ前の攻め方の利き
+bool can_king_escape(const Position &pos, Square sq,
+                     const BitBoard &check_attack, Color color,
+                     const BitBoard &occupied, const BitBoard &attacked) {
+  BitBoard king_movable =
+      ~pos.pieces(kOccupied, color) & KingAttacksTable[pos.square_king(color)];
+  king_movable.not_and(check_attack);
+  king_movable = king_movable ^ MaskTable[sq];
+  BitBoard escape = king_movable;
+  escape.not_and(attacked);
+  if (escape.test()) return true;
+
+  while (king_movable.test()) {
+    const Square to = king_movable.pop_bit();
+    if (!pos.is_attacked(to, color, occupied)) return true;
+  }
+
+  return false;
+}
+
 // この辺はAperyを参考にしている
 Move search_drop_mate(Position &pos, const BitBoard &bb) {
   Color color = pos.side_to_move();
@@ -1358,6 +1388,8 @@ Move search_drop_mate(Position &pos, const BitBoard &bb) {
   BitBoard occupied = pos.occupied();
   const Hand hand = pos.hand(color);
   const BitBoard pinned = pos.pinned_pieces(~color);
+  // 打つ場所に自駒の利きがあるかと玉の逃げ場所は打つ前の利きで調べる
+  const BitBoard attacked = pos.attacked_squares(color);
 
   if (has_hand(hand, kRook)) {
     // 隣接王手だけ考える
@@ -1365,10 +1397,10 @@ Move search_drop_mate(Position &pos, const BitBoard &bb) {
     while (dest.test()) {
       sq = dest.pop_bit();
       // sqの場所に自駒の利きがなければ敵の王にとられる
-      if (pos.is_attacked(sq, ~color, occupied)) {
+      if (attacked & MaskTable[sq]) {
         BitBoard new_occupied = occupied ^ MaskTable[sq];
         result = (can_king_escape(pos, sq, RookAttacksTable[sq][0], ~color,
-                                  new_occupied) ||
+                                  new_occupied, attacked) ||
                   can_piece_capture(pos, sq, pinned, ~color, new_occupied));
         if (!result) return move_init(sq, kRook);
       }
@@ -1378,10 +1410,10 @@ Move search_drop_mate(Position &pos, const BitBoard &bb) {
     dest = bb & PawnAttacksTable[~color][enemy] & LanceDropableMaskTable[color];
     if (dest.test()) {
       sq = (color == kBlack) ? Square(enemy + 9) : Square(enemy - 9);
-      if (pos.is_attacked(sq, ~color, occupied)) {
+      if (attacked & MaskTable[sq]) {
         BitBoard new_occupied = occupied ^ MaskTable[sq];
         result = (can_king_escape(pos, sq, LanceAttacksTable[color][sq][0],
-                                  ~color, new_occupied) ||
+                                  ~color, new_occupied, attacked) ||
                   can_piece_capture(pos, sq, pinned, ~color, new_occupied));
         if (!result) return move_init(sq, kLance);
       }
@@ -1392,10 +1424,10 @@ Move search_drop_mate(Position &pos, const BitBoard &bb) {
     dest = bb & BishopStepAttacksTable[enemy];
     while (dest.test()) {
       sq = dest.pop_bit();
-      if (pos.is_attacked(sq, ~color, occupied)) {
+      if (attacked & MaskTable[sq]) {
         BitBoard new_occupied = occupied ^ MaskTable[sq];
         result = (can_king_escape(pos, sq, BishopAttacksTable[sq][0], ~color,
-                                  new_occupied) ||
+                                  new_occupied, attacked) ||
                   can_piece_capture(pos, sq, pinned, ~color, new_occupied));
         if (!result) return move_init(sq, kBishop);
       }
@@ -1412,10 +1444,10 @@ Move search_drop_mate(Position &pos, const BitBoard &bb) {
       dest = bb & GoldAttacksTable[~color][enemy];
     while (dest.test()) {
       sq = dest.pop_bit();
-      if (pos.is_attacked(sq, ~color, occupied)) {
+      if (attacked & MaskTable[sq]) {
         BitBoard new_occupied = occupied ^ MaskTable[sq];
         result = (can_king_escape(pos, sq, GoldAttacksTable[color][sq], ~color,
-                                  new_occupied) ||
+                                  new_occupied, attacked) ||
                   can_piece_capture(pos, sq, pinned, ~color, new_occupied));
         if (!result) return move_init(sq, kGold);
       }
@@ -1442,10 +1474,10 @@ Move search_drop_mate(Position &pos, const BitBoard &bb) {
     }
     while (dest.test()) {
       sq = dest.pop_bit();
-      if (pos.is_attacked(sq, ~color, occupied)) {
+      if (attacked & MaskTable[sq]) {
         BitBoard new_occupied = occupied ^ MaskTable[sq];
         result = (can_king_escape(pos, sq, SilverAttacksTable[color][sq],
-                                  ~color, new_occupied) ||
+                                  ~color, new_occupied, attacked) ||
                   can_piece_capture(pos, sq, pinned, ~color, new_occupied));
         if (!result) return move_init(sq, kSilver);
       }
@@ -2005,7 +2037,7 @@ Move search_mate1ply(Position &pos) {
     if (move != kMoveNone) return move;
   }
 
-  CheckInfo ci(pos);
+  const CheckInfo &ci = pos.check_info();
   target = ~pos.pieces(kOccupied, color);
   BitBoard movable = target & KingAttacksTable[pos.square_king(~color)];
 
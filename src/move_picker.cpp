@@ -93,13 +93,12 @@ void PartialInsertionSort(ExtMove *begin, ExtMove *end, int limit) {
 /// ordering is at the current node.
 
 /// MovePicker constructor for the main search
-MovePicker::MovePicker(const Position &p, const CheckInfo *ci, Move ttm,
-                       Depth d, const ButterflyHistory *mh,
+MovePicker::MovePicker(const Position &p, Move ttm, Depth d,
+                       const ButterflyHistory *mh,
                        const LowPlyHistory *lp,
                        const CapturePieceToHistory *cph,
                        const PieceToHistory **ch, Move cm, Move *killers, int ply)
     : pos_(p),
-      ci_(ci),
       main_history_(mh),
       low_ply_history_(lp),
       capture_history_(cph),
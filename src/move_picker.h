@@ -41,10 +41,9 @@ class MovePicker {
   MovePicker(const Position &, Move, Value, const CapturePieceToHistory *);
   MovePicker(const Position &, Move, Depth, const ButterflyHistory *,
              const CapturePieceToHistory *, const PieceToHistory **, Square);
-  MovePicker(const Position &, const CheckInfo *, Move, Depth,
-             const ButterflyHistory *, const LowPlyHistory *,
-             const CapturePieceToHistory *, const PieceToHistory **, Move,
-             Move *, int);
+  MovePicker(const Position &, Move, Depth, const ButterflyHistory *,
+             const LowPlyHistory *, const CapturePieceToHistory *,
+             const PieceToHistory **, Move, Move *, int);
   Move NextMove();
 
  private:
@@ -56,7 +55,6 @@ class MovePicker {
   ExtMove *end() { return end_moves_; }
 
   const Position &pos_;
-  const CheckInfo *ci_;
   const ButterflyHistory *main_history_;
   const LowPlyHistory *low_ply_history_;
   const CapturePieceToHistory *capture_history_;
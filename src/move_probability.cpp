@@ -27,7 +27,7 @@ int16_t g_score_capture[kPieceTypeMax][kPieceTypeMax][kNumberOfColor]
                        [Eval::kScoreEnd];
 int16_t g_score_check[2][kNumberOfColor][Eval::kScoreEnd];
 
-Value evaluate(const Position &pos, const CheckInfo &ci, Move move) {
+Value evaluate(const Position &pos, Move move) {
   const Eval::KPPIndex *list_black = pos.black_kpp_list();
   Eval::KPPIndex black_king_index = Eval::kFKing + pos.square_king(kBlack);
   Eval::KPPIndex white_king_index = Eval::kEKing + pos.square_king(kWhite);
@@ -45,7 +45,7 @@ Value evaluate(const Position &pos, const CheckInfo &ci, Move move) {
     capture = move_capture(move);
   }
 
-  bool gives_check = pos.gives_check(move, ci);
+  bool gives_check = pos.gives_check(move);
   Color color = pos.side_to_move();
   auto from_to = g_score_from_to[from][to][color];
   auto piece_to = g_score_piece_to[after_type][to][color];
@@ -118,10 +118,9 @@ struct LearningParamArray {
 };
 
 int get_move_ranking(const Position &pos, Move move) {
-  CheckInfo ci(pos);
   std::vector<ExtMove> legal_moves;
   for (auto m : MoveList<kLegalForSearch>(pos)) {
-    m.value = evaluate(pos, ci, m.move);
+    m.value = evaluate(pos, m.move);
     legal_moves.push_back(m);
   }
   std::sort(
@@ -339,12 +338,11 @@ struct Gradient {
                                 [Eval::kScoreEnd];
   std::atomic<int> count_check[2][kNumberOfColor][Eval::kScoreEnd];
 
-  void increment(const Position &pos, const CheckInfo &ci, Move m, float delta);
+  void increment(const Position &pos, Move m, float delta);
   void clear();
 };
 
-void Gradient::increment(const Position &pos, const CheckInfo &ci, Move m,
-                         float delta) {
+void Gradient::increment(const Position &pos, Move m, float delta) {
   const Eval::KPPIndex *list_black = pos.black_kpp_list();
   Eval::KPPIndex black_king_index = Eval::kFKing + pos.square_king(kBlack);
   Eval::KPPIndex white_king_index = Eval::kEKing + pos.square_king(kWhite);
@@ -361,7 +359,7 @@ void Gradient::increment(const Position &pos, const CheckInfo &ci, Move m,
     if (move_is_promote(m)) after_type = after_type + kFlagPromoted;
     capture = move_capture(m);
   }
-  bool gives_check = pos.gives_check(m, ci);
+  bool gives_check = pos.gives_check(m);
   Color color = pos.side_to_move();
   for (int i = 0; i < Eval::kListNum; ++i) {
     add_atomic_float(score_from_to[from][to][color][list_black[i]], delta);
@@ -509,10 +507,9 @@ double compute_gradient(std::vector<KifuData> &position_list,
     MoveList<kLegalForSearch> list(positions[thread_id]);
     double delta = 0.0;
 
-    CheckInfo ci(positions[thread_id]);
     std::valarray<double> values(list.size());
     for (size_t j = 0; j < list.size(); ++j)
-      values[j] = (double)evaluate(positions[thread_id], ci, list[j]) / 1024.0;
+      values[j] = (double)evaluate(positions[thread_id], list[j]) / 1024.0;
     values = std::exp(values - values.max());
     values = values / values.sum();
     for (size_t j = 0; j < list.size(); ++j) {
@@ -521,7 +518,7 @@ double compute_gradient(std::vector<KifuData> &position_list,
         d = 1.0 - values[j];
       else
         d = -values[j];
-      gradient->increment(positions[thread_id], ci, list[j], d);
+      gradient->increment(positions[thread_id], list[j], d);
       delta += d * d;
     }
 
@@ -10,7 +10,7 @@ bool
 init();
 
 Value
-evaluate(const Position &pos, const CheckInfo &ci, Move move);
+evaluate(const Position &pos, Move move);
 
 void
 read(const std::string &book_file);
@@ -218,6 +218,17 @@ void NnFeatureLearner::QuantizeParameters() {
     quantized_kp_[i] =
         static_cast<std::int16_t>(std::floor(kp_[i] * kQuantizeScale + 0.5));
   }
+
+  if (compact_kp_) {
+    // sƂ̔{̔{Ɋۂ߂Ă
+    std::int8_t compact[eval::kFeatureDemention];
+    for (int row = 0; row < eval::kKpRowNum; row++) {
+      std::int16_t* kp = quantized_kp_ + row * eval::kFeatureDemention;
+      const std::int16_t scale = eval::CompressKpRow(kp, compact);
+      for (int i = 0; i < eval::kFeatureDemention; i++)
+        kp[i] = static_cast<std::int16_t>(compact[i] * scale);
+    }
+  }
 }
 
 void NnFeatureLearner::OutputParamesters(const std::string& file_name) const {
@@ -22,6 +22,8 @@ class NnFeatureLearner {
   void InitializeParameters();
   void LoadParameters();
   void QuantizeParameters();
+  // kpをint8形式で書き出しても変わらない値に量子化する
+  void set_compact_kp(bool compact_kp) { compact_kp_ = compact_kp; }
   void OutputParamesters(const std::string& file_name) const;
 
  private:
@@ -41,6 +43,7 @@ class NnFeatureLearner {
   int rel_kp_num_[kPieceMax][17][17][eval::kFeatureDemention];
   std::vector<float> output_;
   std::vector<float> gradient_;
+  bool compact_kp_ = false;
 
   static constexpr float kQuantizeScale = 127.0f;
 };
\ No newline at end of file
@@ -310,6 +310,7 @@ void NnNetworkLearner::QuantizeParameters() {
     quantized_weights2_[i] = static_cast<std::int8_t>(
         std::floor(weights2_[i] * kOutputWeightScale + 0.5));
   }
+  eval::g_network.PrepareWeights();
 }
 
 void NnNetworkLearner::OutputParamesters(const std::string& file_name) const {
@@ -103,30 +103,6 @@ inline bool can_promote(Color color, uint32_t from, uint32_t to) {
 }
 }  // namespace
 
-CheckInfo::CheckInfo(const Position &pos) {
-  Color enemy = ~pos.side_to_move();
-  Square king = pos.square_king(enemy);
-  const BitBoard occupied = pos.occupied();
-
-  pinned = pos.pinned_pieces(pos.side_to_move());
-  discover_check_candidates = pos.discovered_check_candidates();
-
-  check_squares[kPawn] = PawnAttacksTable[enemy][king];
-  check_squares[kLance] = lance_attack(occupied, enemy, king);
-  check_squares[kKnight] = KnightAttacksTable[enemy][king];
-  check_squares[kSilver] = SilverAttacksTable[enemy][king];
-  check_squares[kBishop] = bishop_attack(occupied, king);
-  check_squares[kRook] = rook_attack(occupied, king);
-  check_squares[kGold] = GoldAttacksTable[enemy][king];
-  check_squares[kKing].init();
-  check_squares[kPromotedPawn] = check_squares[kGold];
-  check_squares[kPromotedLance] = check_squares[kGold];
-  check_squares[kPromotedKnight] = check_squares[kGold];
-  check_squares[kPromotedSilver] = check_squares[kGold];
-  check_squares[kHorse] = check_squares[kBishop] | KingAttacksTable[king];
-  check_squares[kDragon] = check_squares[kRook] | KingAttacksTable[king];
-}
-
 void Position::initialize() { initialize_zobrist(); }
 
 void Position::set(const std::string &sfen, Thread *t) {
@@ -196,6 +172,8 @@ void Position::set(const std::string &sfen, Thread *t) {
 
   this_thread_ = t;
   state_->hand_black = hand_[kBlack];
+  if (repetition_table_ != nullptr)
+    repetition_table_->push(state_, state_->board_key);
   state_->material = compute_material();
   state_->checkers_bb =
       attacks_to(square_king_[side_to_move_], ~side_to_move_, occupied());
@@ -317,6 +295,8 @@ Position &Position::operator=(const Position &pos) {
   start_state_ = *state_;
   state_ = &start_state_;
   nodes_searched_ = 0;
+  // 千日手の表は元の局面のものなので、使う場合はset_repetition_tableし直す
+  repetition_table_ = nullptr;
   return *this;
 }
 
@@ -338,7 +318,7 @@ void Position::clear() {
 }
 
 void Position::do_move(Move m, StateInfo &new_state) {
-  do_move(m, new_state, gives_check(m, CheckInfo(*this)));
+  do_move(m, new_state, gives_check(m));
 }
 
 void Position::do_move(Move m, StateInfo &new_state, bool gives_check) {
@@ -358,7 +338,7 @@ void Position::do_move(Move m, StateInfo &new_state, bool gives_check) {
 
   Color us = side_to_move_;
   board_key ^= Zobrist::side;
-  chenged_index_num_ = 0;
+  state_->changed_num = 0;
 
   if (from >= kBoardSquare) {
     const PieceType drop = TypeOf(from);
@@ -376,16 +356,16 @@ void Position::do_move(Move m, StateInfo &new_state, bool gives_check) {
         kpp_list_index_[PieceTypeToSquareHandTable[us][drop] + hand_num];
     assert(list_index < 38);
     state_->changed_value[kBlack][0] = kpp_list_[kBlack][list_index];
-    new_index_value_[kBlack][0] = PieceToIndexBlackTable[squares_[to]] + to;
+    state_->new_value[kBlack][0] = PieceToIndexBlackTable[squares_[to]] + to;
     kpp_list_[kBlack][list_index] = PieceToIndexBlackTable[squares_[to]] + to;
     state_->changed_value[kWhite][0] = kpp_list_[kWhite][list_index];
-    new_index_value_[kWhite][0] =
+    state_->new_value[kWhite][0] =
         PieceToIndexWhiteTable[squares_[to]] + inverse(to);
     kpp_list_[kWhite][list_index] =
         PieceToIndexWhiteTable[squares_[to]] + inverse(to);
     kpp_list_index_[to] = list_index;
     state_->list_index_move = list_index;
-    chenged_index_num_++;
+    state_->changed_num++;
   } else {
     const PieceType piece_move = move_piece_type(m);
     const bool is_promote = move_is_promote(m);
@@ -423,19 +403,19 @@ void Position::do_move(Move m, StateInfo &new_state, bool gives_check) {
       uint8_t captured_index = kpp_list_index_[to];
       int hand_num = number_of(hand_[us], piece_capture);
       state_->changed_value[kBlack][1] = kpp_list_[kBlack][captured_index];
-      new_index_value_[kBlack][1] =
+      state_->new_value[kBlack][1] =
           PieceTypeToBlackHandIndexTable[us][piece_capture] + hand_num;
       kpp_list_[kBlack][captured_index] =
           PieceTypeToBlackHandIndexTable[us][piece_capture] + hand_num;
       state_->changed_value[kWhite][1] = kpp_list_[kWhite][captured_index];
-      new_index_value_[kWhite][1] =
+      state_->new_value[kWhite][1] =
           PieceTypeToWhiteHandIndexTable[us][piece_capture] + hand_num;
       kpp_list_[kWhite][captured_index] =
           PieceTypeToWhiteHandIndexTable[us][piece_capture] + hand_num;
       kpp_list_index_[PieceTypeToSquareHandTable[us][piece_capture] +
                       hand_num] = captured_index;
       state_->list_index_capture = captured_index;
-      chenged_index_num_++;
+      state_->changed_num++;
     }
 
     if (piece_move != kKing) {
@@ -443,15 +423,15 @@ void Position::do_move(Move m, StateInfo &new_state, bool gives_check) {
       assert(kpp_index < 38);
       kpp_list_index_[to] = kpp_index;
       state_->changed_value[kBlack][0] = kpp_list_[kBlack][kpp_index];
-      new_index_value_[kBlack][0] = PieceToIndexBlackTable[squares_[to]] + to;
+      state_->new_value[kBlack][0] = PieceToIndexBlackTable[squares_[to]] + to;
       kpp_list_[kBlack][kpp_index] = PieceToIndexBlackTable[squares_[to]] + to;
       state_->changed_value[kWhite][0] = kpp_list_[kWhite][kpp_index];
-      new_index_value_[kWhite][0] =
+      state_->new_value[kWhite][0] =
           PieceToIndexWhiteTable[squares_[to]] + inverse(to);
       kpp_list_[kWhite][kpp_index] =
           PieceToIndexWhiteTable[squares_[to]] + inverse(to);
       state_->list_index_move = kpp_index;
-      chenged_index_num_++;
+      state_->changed_num++;
     }
   }
 
@@ -459,6 +439,11 @@ void Position::do_move(Move m, StateInfo &new_state, bool gives_check) {
   state_->board_key = board_key;
   state_->hand_key = hand_key;
   state_->hand_black = hand_[kBlack];
+  if (repetition_table_ != nullptr) repetition_table_->push(state_, board_key);
+  state_->attacked_computed[kBlack] = false;
+  state_->attacked_computed[kWhite] = false;
+  state_->check_squares_computed = 0;
+  state_->check_blockers_computed = false;
   side_to_move_ = ~side_to_move_;
   if (gives_check) {
     state_->continuous_checks[us]++;
@@ -476,12 +461,18 @@ void Position::do_null_move(StateInfo &new_state) {
   state_ = &new_state;
 
   state_->board_key ^= Zobrist::side;
+  if (repetition_table_ != nullptr)
+    repetition_table_->push(state_, state_->board_key);
+  // 王手の情報は手番側から見たものなので求め直す
+  state_->check_squares_computed = 0;
+  state_->check_blockers_computed = false;
   prefetch(TT.FirstEntry(key()));
 
   side_to_move_ = ~side_to_move_;
 }
 
 void Position::undo_null_move() {
+  if (repetition_table_ != nullptr) repetition_table_->pop(state_->board_key);
   state_ = state_->previous;
   side_to_move_ = ~side_to_move_;
 }
@@ -547,31 +538,79 @@ void Position::undo_move(Move move) {
     }
   }
   occupied_ = piece_board_[kBlack][kOccupied] | piece_board_[kWhite][kOccupied];
+  if (repetition_table_ != nullptr) repetition_table_->pop(state_->board_key);
   state_ = state_->previous;
 }
 
-bool Position::gives_check(Move m, const CheckInfo &ci) const {
+bool Position::gives_check(Move m) const {
   PieceType type = move_piece_type(m);
   Square to = move_to(m);
-  Color enemy = ~side_to_move_;
   Square from = move_from(m);
 
-  if (from >= kBoardSquare) {
-    type = TypeOf(from);
-    return (MaskTable[to] & ci.check_squares[type]);
-  } else {
-    if (move_is_promote(m)) type = type + kFlagPromoted;
+  if (from >= kBoardSquare) return MaskTable[to] & check_squares(TypeOf(from));
 
-    // 直接の王手
-    if (MaskTable[to] & ci.check_squares[type]) return true;
+  if (move_is_promote(m)) type = type + kFlagPromoted;
 
-    // 駒が動くことによって王手がかかる場合
-    if (ci.discover_check_candidates &&
-        (ci.discover_check_candidates & MaskTable[from]) &&
-        !aligned(from, to, square_king_[enemy]))
-      return true;
+  // 直接の王手
+  if (MaskTable[to] & check_squares(type)) return true;
+
+  // 駒が動くことによって王手がかかる場合
+  if (!state_->check_blockers_computed) compute_check_blockers();
+  const BitBoard &candidates = state_->check_info.discover_check_candidates;
+  return candidates && (candidates & MaskTable[from]) &&
+         !aligned(from, to, square_king_[~side_to_move_]);
+}
+
+void Position::compute_check_squares(PieceType type) const {
+  const Color enemy = ~side_to_move_;
+  const Square king = square_king_[enemy];
+  BitBoard bb;
+
+  switch (type) {
+    case kPawn:
+      bb = PawnAttacksTable[enemy][king];
+      break;
+    case kLance:
+      bb = lance_attack(occupied_, enemy, king);
+      break;
+    case kKnight:
+      bb = KnightAttacksTable[enemy][king];
+      break;
+    case kSilver:
+      bb = SilverAttacksTable[enemy][king];
+      break;
+    case kBishop:
+      bb = bishop_attack(occupied_, king);
+      break;
+    case kRook:
+      bb = rook_attack(occupied_, king);
+      break;
+    case kGold:
+    case kPromotedPawn:
+    case kPromotedLance:
+    case kPromotedKnight:
+    case kPromotedSilver:
+      bb = GoldAttacksTable[enemy][king];
+      break;
+    case kHorse:
+      bb = check_squares(kBishop) | KingAttacksTable[king];
+      break;
+    case kDragon:
+      bb = check_squares(kRook) | KingAttacksTable[king];
+      break;
+    default:
+      bb.init();
+      break;
   }
-  return false;
+
+  state_->check_info.check_squares[type] = bb;
+  state_->check_squares_computed |= 1 << type;
+}
+
+void Position::compute_check_blockers() const {
+  state_->check_info.pinned = pinned_pieces(side_to_move_);
+  state_->check_info.discover_check_candidates = discovered_check_candidates();
+  state_->check_blockers_computed = true;
 }
 
 bool Position::gives_mate_by_drop_pawn(Square sq) const {
@@ -589,6 +628,10 @@ bool Position::gives_mate_by_drop_pawn(Square sq) const {
   occupy.xor_bit(sq);
   BitBoard movable =
       KingAttacksTable[square_king_[enemy]] & ~piece_board_[enemy][kOccupied];
+  // 歩を打っても利きが遮られるだけなので、打つ前に利きのないマスには逃げられる
+  BitBoard escape = movable;
+  escape.not_and(attacked_squares(color));
+  if (escape.test()) return false;
   do {
     Square to = movable.pop_bit();
     // 敵の王が動けるならばその時点で打ち歩づめではない
@@ -964,6 +1007,11 @@ bool Position::see_ge(Move m, Value v, Color c) const {
     balance -= static_cast<Value>(ExchangePieceValueTable[next_victim]);
 
     if (balance >= v) return true;
+
+    // fromに利きがなければ、動いた後ろから新たに利きが通ることもない
+    if (!(attacked_squares(side_to_move) &
+          (MaskTable[to] | MaskTable[from])))
+      return true;
   } else {
     next_victim = TypeOf(from);
     balance = kValueZero;
@@ -973,6 +1021,9 @@ bool Position::see_ge(Move m, Value v, Color c) const {
 
     if (balance >= v) return true;
 
+    // 駒を打っても打った場所への利きは変わらない
+    if (!(attacked_squares(side_to_move) & MaskTable[to])) return true;
+
     occupied.xor_bit(to);
   }
   attackers = attacks_to(to, occupied) & occupied;
@@ -1004,6 +1055,26 @@ bool Position::see_ge(Move m, Value v, Color c) const {
   }
 }
 
+void Position::compute_attacked_squares(Color color) const {
+  BitBoard bb = pawn_attack(color, piece_board_[color][kPawn]);
+  BitBoard piece = piece_board_[color][kLance];
+  while (piece.test()) bb |= lance_attack(occupied_, color, piece.pop_bit());
+  piece = piece_board_[color][kKnight];
+  while (piece.test()) bb |= KnightAttacksTable[color][piece.pop_bit()];
+  piece = piece_board_[color][kSilver];
+  while (piece.test()) bb |= SilverAttacksTable[color][piece.pop_bit()];
+  piece = total_gold(color);
+  while (piece.test()) bb |= GoldAttacksTable[color][piece.pop_bit()];
+  piece = bishop_horse(color);
+  while (piece.test()) bb |= bishop_attack(occupied_, piece.pop_bit());
+  piece = rook_dragon(color);
+  while (piece.test()) bb |= rook_attack(occupied_, piece.pop_bit());
+  piece = horse_dragon_king(color);
+  while (piece.test()) bb |= KingAttacksTable[piece.pop_bit()];
+  state_->attacked_bb[color] = bb;
+  state_->attacked_computed[color] = true;
+}
+
 uint64_t Position::key_after(Move m) const {
   uint64_t board_key = state_->board_key;
   uint64_t hand_key = state_->hand_key;
@@ -1043,36 +1114,71 @@ uint64_t Position::exclusion_key() const {
   return (state_->board_key + state_->hand_key) ^ Zobrist::exclusion;
 }
 
+namespace {
+// 同じboard_keyの局面がdistance手前にある場合の千日手の種類
+Repetition judge_repetition(const StateInfo *current, const StateInfo *state,
+                            int distance, Color side_to_move) {
+  if (state->hand_key == current->hand_key) {
+    if (current->continuous_checks[side_to_move] * 2 >= distance)
+      return kPerpetualCheckLose;
+    else if (current->continuous_checks[~side_to_move] * 2 >= distance)
+      return kPerpetualCheckWin;
+    else
+      return kRepetition;
+  }
+  if (is_hand_equal_or_win(state->hand_black, current->hand_black))
+    return kBlackWinRepetition;
+  else if (is_hand_equal_or_win(current->hand_black, state->hand_black))
+    return kBlackLoseRepetition;
+  return kNoRepetition;
+}
+}  // namespace
+
 Repetition Position::in_repetition() const {
+  if (repetition_table_ != nullptr) {
+    const RepetitionTable::Entry *matches[RepetitionTable::kMaxMatches];
+    const int num = repetition_table_->find(state_->board_key, matches);
+    const int current = repetition_table_->size() - 1;
+    for (int i = 0; i < num; ++i) {
+      const int distance = current - matches[i]->ply;
+      if (distance > state_->pilies_from_null) break;
+      const Repetition r =
+          judge_repetition(state_, matches[i]->state, distance, side_to_move_);
+      if (r != kNoRepetition) return r;
+    }
+    return kNoRepetition;
+  }
+
   StateInfo *state = state_;
-#ifdef REPETITION_CHECK_FULL
-  for (int i = 2; i <= state_->pilies_from_null; i += 2)
-#else
-  int m = std::min(state_->pilies_from_null, 16);
-  for (int i = 2; i <= m; i += 2)
-#endif
-  {
+  for (int i = 2; i <= state_->pilies_from_null; i += 2) {
     state = state->previous->previous;
     if (state->board_key == state_->board_key) {
-      if (state->hand_key == state_->hand_key) {
-        if (state_->continuous_checks[side_to_move_] * 2 >= i)
-          return kPerpetualCheckLose;
-        else if (state_->continuous_checks[~side_to_move_] * 2 >= i)
-          return kPerpetualCheckWin;
-        else
-          return kRepetition;
-      } else {
-        if (is_hand_equal_or_win(state->hand_black, state_->hand_black))
-          return kBlackWinRepetition;
-        else if (is_hand_equal_or_win(state_->hand_black, state->hand_black))
-          return kBlackLoseRepetition;
-      }
+      const Repetition r = judge_repetition(state_, state, i, side_to_move_);
+      if (r != kNoRepetition) return r;
     }
   }
 
   return kNoRepetition;
 }
 
+void Position::set_repetition_table(RepetitionTable *table) {
+  repetition_table_ = table;
+  table->clear();
+  const StateInfo *history[RepetitionTable::kMaxHistory];
+  int num = 0;
+  const StateInfo *state = state_;
+  for (int i = 0; i <= state_->pilies_from_null &&
+                  num < RepetitionTable::kMaxHistory;
+       ++i) {
+    history[num++] = state;
+    state = state->previous;
+  }
+  while (num > 0) {
+    --num;
+    table->push(history[num], history[num]->board_key);
+  }
+}
+
 std::ostream &operator<<(std::ostream &os, const Position &pos) {
   const char *print_name[] = {"  ", "P ", "L ", "N ", "S ", "B ", "R ", "G ",
                               "K ", "P+", "L+", "N+", "S+", "H ", "D ", "",
@@ -20,11 +20,13 @@
 #define _POSITION_H_
 
 #include <stdint.h>
+#include <algorithm>
 #include <cstddef>
 #include <iostream>
 #include <memory>
 #include <sstream>
 #include <stack>
+#include <vector>
 #include "bit_board.h"
 #include "evaluate.h"
 #include "move.h"
@@ -41,9 +43,9 @@ enum Repetition {
 
 class Thread;
 
+// 手番側が王手をかけるための情報
+// StateInfoに持ち、使う時に必要な分だけ求める
 struct CheckInfo {
-  explicit CheckInfo(const Position &);
-
   BitBoard discover_check_candidates;
   BitBoard pinned;
   BitBoard check_squares[kPieceTypeMax];
@@ -56,14 +58,96 @@ struct StateInfo {
   uint8_t list_index_move;
   uint8_t list_index_capture;
   Eval::KPPIndex changed_value[kNumberOfColor][2];
+  Eval::KPPIndex new_value[kNumberOfColor][2];
+  uint8_t changed_num;
 
   uint64_t board_key;
   uint64_t hand_key;
   Hand hand_black;
   BitBoard checkers_bb;
+  // 手番ごとの駒が利いているマス。手番ごとに最初に使う時に求める
+  BitBoard attacked_bb[kNumberOfColor];
+  bool attacked_computed[kNumberOfColor];
+  CheckInfo check_info;
+  // check_info.check_squaresの求めてある駒の種類のビット
+  uint16_t check_squares_computed;
+  // check_info.pinnedとdiscover_check_candidatesを求めてあるか
+  bool check_blockers_computed;
   StateInfo *previous;
 };
 
+// 千日手の判定に使う、探索中の手順と対局の履歴の局面の集合
+// スレッドごとに持ち、探索するPositionだけが使う
+// 局面は手順の順に入れて逆の順に取り除くので、開番地法でも空けるだけで消せる
+class RepetitionTable {
+ public:
+  struct Entry {
+    uint64_t board_key;
+    const StateInfo *state;
+    // 入れた順番。現局面との差が手数になる
+    int ply;
+  };
+
+  static constexpr int kSize = 1 << 13;
+  // 履歴はこれより前を入れない。残りは探索中の手順に使う
+  static constexpr int kMaxHistory = kSize / 2;
+  // 同じboard_keyの局面は近いものからこの数だけ調べる
+  static constexpr int kMaxMatches = 16;
+
+  RepetitionTable() : table_(kSize) {}
+
+  void clear() {
+    std::fill(table_.begin(), table_.end(), Entry());
+    size_ = 0;
+  }
+
+  void push(const StateInfo *state, uint64_t board_key) {
+    Entry *e = &table_[board_key & (kSize - 1)];
+    while (e->state != nullptr) e = next(e);
+    *e = {board_key, state, size_++};
+  }
+
+  void pop(uint64_t board_key) {
+    Entry *e = &table_[board_key & (kSize - 1)];
+    while (e->ply != size_ - 1 || e->state == nullptr) e = next(e);
+    e->state = nullptr;
+    --size_;
+  }
+
+  // 現局面以外のboard_keyが同じ局面を近い順にmatchesに入れて、その数を返す
+  int find(uint64_t board_key, const Entry **matches) const {
+    int num = 0;
+    for (const Entry *e = &table_[board_key & (kSize - 1)];
+         e->state != nullptr; e = next(e)) {
+      if (e->board_key != board_key || e->ply == size_ - 1) continue;
+      if (num < kMaxMatches) {
+        matches[num++] = e;
+        continue;
+      }
+      const Entry **farthest = std::min_element(
+          matches, matches + num,
+          [](const Entry *a, const Entry *b) { return a->ply < b->ply; });
+      if ((*farthest)->ply < e->ply) *farthest = e;
+    }
+    std::sort(matches, matches + num,
+              [](const Entry *a, const Entry *b) { return a->ply > b->ply; });
+    return num;
+  }
+
+  int size() const { return size_; }
+
+ private:
+  Entry *next(Entry *e) {
+    return e + 1 == table_.data() + kSize ? table_.data() : e + 1;
+  }
+  const Entry *next(const Entry *e) const {
+    return e + 1 == table_.data() + kSize ? table_.data() : e + 1;
+  }
+
+  std::vector<Entry> table_;
+  int size_ = 0;
+};
+
 class Position {
   friend std::ostream &operator<<(std::ostream &, const Position &);
 
@@ -97,7 +181,11 @@ class Position {
                         const BitBoard &pinned) const;
 
   bool in_check() const;
-  bool gives_check(Move m, const CheckInfo &ci) const;
+  bool gives_check(Move m) const;
+  // 全ての駒の種類の王手の情報。局面ごとに一度だけ求める
+  const CheckInfo &check_info() const;
+  // typeの駒で王手になるマス。使う駒の種類の分だけ求める
+  BitBoard check_squares(PieceType type) const;
   bool gives_mate_by_drop_pawn(Square sq) const;
 
   // Doing and undoing moves
@@ -126,6 +214,8 @@ class Position {
 
   BitBoard attacks_to(Square sq, Color color, const BitBoard &occupied) const;
   BitBoard attacks_to(Square sq, const BitBoard &occupied) const;
+  // colorの駒が利いているマス。局面ごとに一度だけ求める
+  BitBoard attacked_squares(Color color) const;
 
   uint64_t key() const;
   uint64_t key_after(Move m) const;
@@ -134,6 +224,8 @@ class Position {
   bool see_ge_reverse_move(Move m, Value v) const;
 
   Repetition in_repetition() const;
+  // 千日手の判定にtableを使うようにする。tableは現局面までの履歴で作り直す
+  void set_repetition_table(RepetitionTable *table);
   uint64_t exclusion_key() const;
   int continuous_checks(Color c) const;
 
@@ -142,9 +234,12 @@ class Position {
   int chenged_index_num() const;
   const Eval::KPPIndex *old_index_value(Color c) const;
   const Eval::KPPIndex *new_index_value(Color c) const;
+  const StateInfo *state_info() const;
 
   void print() const;
 
+  // 手番側のpinされている駒。局面ごとに一度だけ求める
+  BitBoard pinned_pieces() const;
   BitBoard pinned_pieces(Color c) const;
   BitBoard pinned_pieces(Color c, const BitBoard &occupied) const;
   BitBoard discovered_check_candidates() const;
@@ -159,6 +254,9 @@ class Position {
 
   void put_piece(Piece piece, Square sq);
   int compute_material() const;
+  void compute_attacked_squares(Color color) const;
+  void compute_check_squares(PieceType type) const;
+  void compute_check_blockers() const;
   bool is_pawn_exist(Square sq, Color color) const;
   BitBoard check_blockers(Color c, Color king_color,
                           const BitBoard &occupied) const;
@@ -171,14 +269,13 @@ class Position {
   Square square_king_[kNumberOfColor];
   uint8_t kpp_list_index_[kSquareHand];
   Eval::KPPIndex kpp_list_[kNumberOfColor][eval::kKpListLength];
-  Eval::KPPIndex new_index_value_[kNumberOfColor][2];
-  int chenged_index_num_;
   Color side_to_move_;
   StateInfo start_state_;
   uint64_t nodes_searched_;
   StateInfo *state_;
   int game_ply_;
   Thread *this_thread_;
+  RepetitionTable *repetition_table_;
 };
 
 inline bool Position::see_ge(Move m, Value v) const {
@@ -332,6 +429,29 @@ bool Position::is_attacked(Square sq, Color color,
   return bb.test();
 }
 
+inline BitBoard Position::attacked_squares(Color color) const {
+  if (!state_->attacked_computed[color]) compute_attacked_squares(color);
+  return state_->attacked_bb[color];
+}
+
+inline BitBoard Position::check_squares(PieceType type) const {
+  if (!(state_->check_squares_computed & (1 << type)))
+    compute_check_squares(type);
+  return state_->check_info.check_squares[type];
+}
+
+inline const CheckInfo &Position::check_info() const {
+  if (!state_->check_blockers_computed) compute_check_blockers();
+  for (int type = kPawn; type < kPieceTypeMax; type++)
+    check_squares(static_cast<PieceType>(type));
+  return state_->check_info;
+}
+
+inline BitBoard Position::pinned_pieces() const {
+  if (!state_->check_blockers_computed) compute_check_blockers();
+  return state_->check_info.pinned;
+}
+
 inline BitBoard Position::pinned_pieces(Color c) const {
   return check_blockers(c, c, occupied());
 }
@@ -353,6 +473,8 @@ inline bool Position::legal(Move m, BitBoard &pinned) const {
   PieceType type = move_piece_type(m);
   Square to = move_to(m);
   if (type == kKing) {
+    // 王手されていなければ玉が動いても敵の利きは変わらない
+    if (!in_check()) return !(attacked_squares(~side_to_move_) & MaskTable[to]);
     BitBoard oc = occupied();
     oc.xor_bit(from);
     return !is_attacked(to, side_to_move_, oc);
@@ -370,13 +492,14 @@ inline const Eval::KPPIndex *Position::white_kpp_list() const {
   return kpp_list_[kWhite];
 }
 
-inline int Position::chenged_index_num() const { return chenged_index_num_; }
+inline int Position::chenged_index_num() const { return state_->changed_num; }
 inline const Eval::KPPIndex *Position::old_index_value(Color c) const {
   return state_->changed_value[c];
 }
 inline const Eval::KPPIndex *Position::new_index_value(Color c) const {
-  return new_index_value_[c];
+  return state_->new_value[c];
 }
+inline const StateInfo *Position::state_info() const { return state_; }
 
 inline void Position::move_temporary(Square from, Square to, PieceType type,
                                      PieceType capture) {
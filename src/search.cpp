@@ -33,6 +33,7 @@
 #include <sstream>
 
 #include "evaluate.h"
+#include "mate_solver.h"
 #include "move_generator.h"
 #include "move_picker.h"
 #include "stats.h"
@@ -77,6 +78,11 @@ constexpr int FutilityMoveCount(bool improving, int depth) {
 
 int Reductions[kMaxMoves];
 
+// 探索中に調べる詰みの手数。MatePlyを奇数にしたもの
+int MatePly = 1;
+// 残り深さがこれより浅いノードでだけMatePly手の詰みを調べる
+constexpr Depth kMateProbeDepth = 4 * kOnePly;
+
 template <bool PvNode>
 inline Depth Reduction(bool i, Depth d, int mn) {
   int r = Reductions[d / kOnePly] * Reductions[mn] / 1024;
@@ -128,14 +134,34 @@ struct ThreadHolding {
   bool owning;
 };
 
-template <NodeType NT>
+template <NodeType NT, eval::Backend B>
 Value search(Position &pos, SearchStack *ss, Value alpha, Value beta,
              Depth depth, bool cut_node, bool skip_mate = false);
 
-template <NodeType NT, bool InCheck>
+template <NodeType NT, bool InCheck, eval::Backend B>
 Value qsearch(Position &pos, SearchStack *ss, Value alpha, Value beta,
               Depth depth, bool skip_mate = false);
 
+// 評価関数の種類ごとに実体化した探索を選ぶ。選ぶのは呼び出しごとに1度だけ
+Value search_root(eval::Backend backend, Position &pos, SearchStack *ss,
+                  Value alpha, Value beta, Depth depth) {
+  if (backend == eval::Backend::kKppt)
+    return search<kPV, eval::Backend::kKppt>(pos, ss, alpha, beta, depth,
+                                             false, false);
+  return search<kPV, eval::Backend::kNn>(pos, ss, alpha, beta, depth, false,
+                                         false);
+}
+
+template <bool InCheck>
+Value qsearch_root(eval::Backend backend, Position &pos, SearchStack *ss,
+                   Value alpha, Value beta) {
+  if (backend == eval::Backend::kKppt)
+    return qsearch<kPV, InCheck, eval::Backend::kKppt>(pos, ss, alpha, beta,
+                                                       kDepthZero);
+  return qsearch<kPV, InCheck, eval::Backend::kNn>(pos, ss, alpha, beta,
+                                                   kDepthZero);
+}
+
 Value value_to_tt(Value v, int ply);
 Value value_from_tt(Value v, int ply);
 void update_pv(Move *pv, Move move, Move *child_pv);
@@ -149,6 +175,7 @@ void UpdateContinuationHistories(SearchStack *ss, Piece pc, Square to,
 void UpdateQuietStats(const Position &pos, SearchStack *ss, Move move,
                       int bonus, int depth);
 void check_time();
+void search_mate(Position &pos);
 }  // namespace
 
 string usi_pv(const Position &pos, Depth depth, Value alpha, Value beta);
@@ -165,12 +192,18 @@ void Search::init() {
 }
 
 void Search::clear() {
-  TT.Clear();
+  // 読み込んだ置換表を対局で使う場合はKeep_Hashを指定する
+  if (!Options["Keep_Hash"]) TT.Clear();
 
   for (Thread *th : Threads) {
     th->counter_moves_.fill(kMoveNone);
     th->main_history_.fill(0);
     th->capture_history_.fill(0);
+    th->feature_refreshes_ = 0;
+    th->feature_updates_ = 0;
+    th->eval_probes_ = 0;
+    th->eval_hits_ = 0;
+    th->mate_cache_.Clear();
   }
 
   Threads.main()->previous_score = kValueInfinite;
@@ -178,11 +211,19 @@ void Search::clear() {
 }
 
 void MainThread::search() {
+  // go mateは通常の探索をせず、詰将棋の探索の結果だけを返す
+  if (Limits.mate) {
+    search_mate(root_pos_);
+    return;
+  }
+
   Color us = root_pos_.side_to_move();
   Time.init(Limits, us, root_pos_.game_ply());
   TT.NewSearch();
   bool search_best_thread = true;
 
+  MatePly = int(Options["MatePly"]) | 1;
+
   int contempt = Options["Contempt"];
   DrawValue[us] = kValueDraw - Value(contempt);
   DrawValue[~us] = kValueDraw + Value(contempt);
@@ -219,12 +260,9 @@ void MainThread::search() {
     th->max_ply_ = 0;
     th->root_depth_ = kDepthZero;
     th->best_move_changes_ = 0;
-    if (th != this) {
-      th->root_pos_ = Position(root_pos_, th);
-      th->root_moves_ = root_moves_;
-      th->start_searching();
-    }
+    if (th != this) th->prepare_searching();
   }
+  Threads.start_helpers();
 
   Thread::search();
 
@@ -302,6 +340,8 @@ void Thread::search() {
   Move last_best_move = kMoveNone;
   Depth last_best_move_depth = kDepthZero;
   MainThread *main_thread = (this == Threads.main() ? Threads.main() : nullptr);
+  // 評価関数の種類はgoごとに1度だけ読み、反復の途中で切り替わらないようにする
+  const eval::Backend backend = eval::CurrentBackend();
   double time_reduction = 1.0;
   double total_best_move_changes = 0;
   int iter_index = 0;
@@ -310,6 +350,7 @@ void Thread::search() {
   for (int i = 7; i > 0; i--)
     (ss - i)->continuation_history =
         &this->continuation_history_[0][0][kPieceNone][0];  // Use as sentinel
+  attach_accumulators(stack, kMaxPly + 10);
 
   ss->pv = pv;
   completed_depth_ = kDepthZero;
@@ -353,8 +394,8 @@ void Thread::search() {
       while (true) {
         Depth adjusted_depth =
             std::max(kOnePly, root_depth_ - failed_high_count * kOnePly);
-        best_value = ::search<kPV>(root_pos_, ss, alpha, beta, adjusted_depth,
-                                   false, false);
+        best_value =
+            search_root(backend, root_pos_, ss, alpha, beta, adjusted_depth);
 
         std::stable_sort(root_moves_.begin() + pv_index_,
                          root_moves_.begin() + pv_last_);
@@ -401,10 +442,6 @@ void Thread::search() {
       last_best_move_depth = root_depth_;
     }
 
-    if (Limits.mate && best_value >= kValueMateInMaxPly &&
-        kValueMate - best_value <= 2 * Limits.mate)
-      Signals.stop = true;
-
     if (root_depth_ > 10 && (best_value >= kValueMate - root_depth_ ||
                              best_value <= -kValueMate + root_depth_))
       break;
@@ -456,14 +493,14 @@ void Thread::search() {
 
 Value Search::search(Position &pos, SearchStack *ss, Value alpha, Value beta,
                      Depth depth) {
-  return ::search<kPV>(pos, ss, alpha, beta, depth, false, false);
+  return search_root(eval::CurrentBackend(), pos, ss, alpha, beta, depth);
 }
 
 Value Search::qsearch(Position &pos, SearchStack *ss, Value alpha, Value beta) {
   if (pos.in_check())
-    return ::qsearch<kPV, true>(pos, ss, alpha, beta, kDepthZero);
+    return qsearch_root<true>(eval::CurrentBackend(), pos, ss, alpha, beta);
   else
-    return ::qsearch<kPV, false>(pos, ss, alpha, beta, kDepthZero);
+    return qsearch_root<false>(eval::CurrentBackend(), pos, ss, alpha, beta);
 }
 
 bool Search::pv_is_draw(Position &pos) {
@@ -481,7 +518,7 @@ bool Search::pv_is_draw(Position &pos) {
 
 namespace {
 // 探索のメイン処理
-template <NodeType NT>
+template <NodeType NT, eval::Backend B>
 Value search(Position &pos, SearchStack *ss, Value alpha, Value beta,
              Depth depth, bool cut_node, bool skip_mate) {
   const bool pv_node = NT == kPV;
@@ -557,7 +594,7 @@ Value search(Position &pos, SearchStack *ss, Value alpha, Value beta,
     if (Signals.stop.load(std::memory_order_relaxed) ||
         repetition == kRepetition || ss->ply >= kMaxPly)
       return ss->ply >= kMaxPly && !ss->in_check
-                 ? eval::Evaluate(pos, ss)
+                 ? eval::Evaluate<B>(pos, ss)
                  : DrawValue[pos.side_to_move()];
 
     // 連続王手千日手
@@ -602,8 +639,10 @@ Value search(Position &pos, SearchStack *ss, Value alpha, Value beta,
   excluded_move = ss->excluded_move;
   if (excluded_move == kMoveNone) {
     tte = TT.Probe(position_key, &tt_hit);
+    ++this_thread->tt_probes_;
+    this_thread->tt_hits_ += tt_hit;
     tt_move = root_node ? this_thread->root_moves_[this_thread->pv_index_].pv[0]
-                        : (tt_hit ? tte->move() : kMoveNone);
+                        : (tt_hit ? tte->move(pos) : kMoveNone);
     tt_value = tt_hit ? value_from_tt(tte->value(), ss->ply) : kValueNone;
     tt_pv = (tt_hit && tte->pv_hit()) || pv_node;
   } else {
@@ -651,12 +690,15 @@ Value search(Position &pos, SearchStack *ss, Value alpha, Value beta,
     return tt_value;
   }
 
-  // 1手詰め判定
+  // 詰み判定。残り深さが浅いノードでは王手の連続による短手数の詰みも調べる
   // 処理が重いのでなるべくなら呼び出さないようにしたい
   if (!root_node && !skip_mate && !tt_hit && !ss->in_check) {
     Move mate_move;
-    if ((mate_move = search_mate1ply(pos)) != kMoveNone) {
-      ss->static_eval = best_value = MateIn(ss->ply + 1);
+    const int mate_ply =
+        SearchMate(pos, depth < kMateProbeDepth ? MatePly : 1,
+                   this_thread->mate_cache_, &mate_move);
+    if (mate_ply != 0) {
+      ss->static_eval = best_value = MateIn(ss->ply + mate_ply);
       tte->Save(position_key, value_to_tt(best_value, ss->ply), tt_pv,
                 kBoundExact, depth, mate_move, TT.generation());
 
@@ -665,7 +707,7 @@ Value search(Position &pos, SearchStack *ss, Value alpha, Value beta,
   }
 
   // 現局面の静的評価
-  ss->static_eval = pure_static_eval = eval::Evaluate(pos, ss);
+  ss->static_eval = pure_static_eval = eval::Evaluate<B>(pos, ss);
   if (ss->in_check) {
     ss->static_eval = eval = pure_static_eval = kValueNone;
     improving = false;
@@ -691,7 +733,7 @@ Value search(Position &pos, SearchStack *ss, Value alpha, Value beta,
 
   // Razoring
   if (!root_node && depth < 2 * kOnePly && eval <= alpha - kRazorMargin) {
-    return qsearch<NT, false>(pos, ss, alpha, beta, kDepthZero, true);
+    return qsearch<NT, false, B>(pos, ss, alpha, beta, kDepthZero, true);
   }
 
   improving = ss->static_eval >= (ss - 2)->static_eval ||
@@ -720,9 +762,9 @@ Value search(Position &pos, SearchStack *ss, Value alpha, Value beta,
     pos.do_null_move(st);
     (ss + 1)->evaluated = false;
     null_value = depth - re < kOnePly
-                     ? -qsearch<kNonPV, false>(pos, ss + 1, -beta, -beta + 1,
+                     ? -qsearch<kNonPV, false, B>(pos, ss + 1, -beta, -beta + 1,
                                                kDepthZero, true)
-                     : -search<kNonPV>(pos, ss + 1, -beta, -beta + 1,
+                     : -search<kNonPV, B>(pos, ss + 1, -beta, -beta + 1,
                                        depth - re, !cut_node, true);
     pos.undo_null_move();
 
@@ -741,14 +783,14 @@ Value search(Position &pos, SearchStack *ss, Value alpha, Value beta,
 
     MovePicker mp(pos, tt_move, rbeta - ss->static_eval,
                   &this_thread->capture_history_);
-    CheckInfo ci(pos);
+    BitBoard pinned = pos.pinned_pieces();
     int prob_cut_count = 0;
 
     while (
         (move = mp.NextMove()) != kMoveNone &&
         prob_cut_count < 2 + 2 * cut_node &&
         !(move == tt_move && tte->depth() >= depth - 4 && tt_value < rbeta)) {
-      if (move != excluded_move && pos.legal(move, ci.pinned)) {
+      if (move != excluded_move && pos.legal(move, pinned)) {
         ++prob_cut_count;
 
         ss->current_move = move;
@@ -758,13 +800,13 @@ Value search(Position &pos, SearchStack *ss, Value alpha, Value beta,
         pos.do_move(move, st);
         (ss + 1)->evaluated = false;
         value = ss->in_check
-                    ? -qsearch<kNonPV, true>(pos, ss + 1, -rbeta, -rbeta + 1,
+                    ? -qsearch<kNonPV, true, B>(pos, ss + 1, -rbeta, -rbeta + 1,
                                              kDepthZero, false)
-                    : -qsearch<kNonPV, false>(pos, ss + 1, -rbeta, -rbeta + 1,
+                    : -qsearch<kNonPV, false, B>(pos, ss + 1, -rbeta, -rbeta + 1,
                                               kDepthZero, false);
 
         if (value >= rbeta)
-          value = -search<kNonPV>(pos, ss + 1, -rbeta, -rbeta + 1,
+          value = -search<kNonPV, B>(pos, ss + 1, -rbeta, -rbeta + 1,
                                   depth - 4 * kOnePly, !cut_node, true);
         pos.undo_move(move);
         if (value >= rbeta) return value;
@@ -776,10 +818,10 @@ Value search(Position &pos, SearchStack *ss, Value alpha, Value beta,
   if (depth >= 6 * kOnePly && !tt_move &&
       (pv_node || ss->static_eval + 128 >= beta)) {
     Depth d = (3 * depth / (4 * kOnePly) - 2) * kOnePly;
-    search<NT>(pos, ss, alpha, beta, d, cut_node, true);
+    search<NT, B>(pos, ss, alpha, beta, d, cut_node, true);
 
     tte = TT.Probe(position_key, &tt_hit);
-    tt_move = tt_hit ? tte->move() : kMoveNone;
+    tt_move = tt_hit ? tte->move(pos) : kMoveNone;
     tt_pv = tt_hit && tte->pv_hit();
   }
 
@@ -791,8 +833,8 @@ moves_loop:
                                        nullptr,
                                        (ss - 6)->continuation_history};
   Move countermove = this_thread->counter_moves_[prev_piece][prev_sq];
-  CheckInfo ci(pos);
-  MovePicker mp(pos, &ci, tt_move, depth, &this_thread->main_history_,
+  BitBoard pinned = pos.pinned_pieces();
+  MovePicker mp(pos, tt_move, depth, &this_thread->main_history_,
                 &this_thread->low_ply_history_, &this_thread->capture_history_,
                 cont_hist, countermove, ss->killers,
                 depth > 12 ? ss->ply : kMaxPly);
@@ -836,18 +878,18 @@ moves_loop:
     capture = move_is_capture(move);
     moved_piece = move_piece(move, pos.side_to_move());
 
-    gives_check = pos.gives_check(move, ci);
+    gives_check = pos.gives_check(move);
     move_count_pruning =
         move_count >= FutilityMoveCount(improving, depth / kOnePly);
 
     // Singular extension search
     if (singular_extension_node && move == tt_move &&
-        pos.legal(move, ci.pinned)) {
+        pos.legal(move, pinned)) {
       Value singular_beta =
           std::max(tt_value - 8 * depth / kOnePly, -kValueMate);
       Depth d = (depth / (2 * kOnePly)) * kOnePly;
       ss->excluded_move = move;
-      value = search<kNonPV>(pos, ss, singular_beta - 1, singular_beta, d,
+      value = search<kNonPV, B>(pos, ss, singular_beta - 1, singular_beta, d,
                              cut_node, true);
       ss->excluded_move = kMoveNone;
 
@@ -857,7 +899,7 @@ moves_loop:
         return singular_beta;
       } else if (tt_value >= beta) {
         ss->excluded_move = move;
-        value = search<kNonPV>(pos, ss, beta - 1, beta, (depth + 3) / 2,
+        value = search<kNonPV, B>(pos, ss, beta - 1, beta, (depth + 3) / 2,
                                cut_node, true);
         ss->excluded_move = kMoveNone;
         if (value >= beta) return beta;
@@ -919,7 +961,7 @@ moves_loop:
 
     prefetch(TT.FirstEntry(pos.key_after(move)));
 
-    if (!root_node && !pos.legal(move, ci.pinned)) {
+    if (!root_node && !pos.legal(move, pinned)) {
       ss->move_count = --move_count;
       continue;
     }
@@ -933,6 +975,7 @@ moves_loop:
 
     // Make the move
     pos.do_move(move, st, gives_check);
+    eval::Prefetch<B>(pos, move);
     (ss + 1)->evaluated = false;
 
     // Reduced depth search (LMR)
@@ -973,7 +1016,7 @@ moves_loop:
 
       Depth d = std::max(new_depth - std::max(r, kDepthZero), kOnePly);
 
-      value = -search<kNonPV>(pos, ss + 1, -(alpha + 1), -alpha, d, true,
+      value = -search<kNonPV, B>(pos, ss + 1, -(alpha + 1), -alpha, d, true,
                               d < 3 * kOnePly);
 
       do_full_depth_search = (value > alpha && d != kDepthZero);
@@ -988,11 +1031,11 @@ moves_loop:
       value =
           new_depth < kOnePly
               ? (gives_check
-                     ? -qsearch<kNonPV, true>(pos, ss + 1, -(alpha + 1), -alpha,
+                     ? -qsearch<kNonPV, true, B>(pos, ss + 1, -(alpha + 1), -alpha,
                                               kDepthZero)
-                     : -qsearch<kNonPV, false>(pos, ss + 1, -(alpha + 1),
+                     : -qsearch<kNonPV, false, B>(pos, ss + 1, -(alpha + 1),
                                                -alpha, kDepthZero))
-              : -search<kNonPV>(pos, ss + 1, -(alpha + 1), -alpha, new_depth,
+              : -search<kNonPV, B>(pos, ss + 1, -(alpha + 1), -alpha, new_depth,
                                 !cut_node, new_depth < 3 * kOnePly);
       if (did_lmr && !capture) {
         int bonus =
@@ -1010,11 +1053,11 @@ moves_loop:
       (ss + 1)->pv[0] = kMoveNone;
 
       value = new_depth < kOnePly
-                  ? (gives_check ? -qsearch<kPV, true>(pos, ss + 1, -beta,
+                  ? (gives_check ? -qsearch<kPV, true, B>(pos, ss + 1, -beta,
                                                        -alpha, kDepthZero)
-                                 : -qsearch<kPV, false>(pos, ss + 1, -beta,
+                                 : -qsearch<kPV, false, B>(pos, ss + 1, -beta,
                                                         -alpha, kDepthZero))
-                  : -search<kPV>(pos, ss + 1, -beta, -alpha, new_depth, false,
+                  : -search<kPV, B>(pos, ss + 1, -beta, -alpha, new_depth, false,
                                  new_depth < 3 * kOnePly);
     }
 
@@ -1097,7 +1140,7 @@ moves_loop:
 }
 
 // 静止探索
-template <NodeType NT, bool InCheck>
+template <NodeType NT, bool InCheck, eval::Backend B>
 Value qsearch(Position &pos, SearchStack *ss, Value alpha, Value beta,
               Depth depth, bool skip_mate) {
   const bool PvNode = NT == kPV;
@@ -1166,7 +1209,7 @@ Value qsearch(Position &pos, SearchStack *ss, Value alpha, Value beta,
       return kValueSamePosition;
   }
 #else
-  if (ss->ply >= kMaxPly) return eval::Evaluate(pos, ss);
+  if (ss->ply >= kMaxPly) return eval::Evaluate<B>(pos, ss);
 #endif
   tt_depth =
       InCheck || depth >= kDepthQsChecks ? kDepthQsChecks : kDepthQsNoChecks;
@@ -1174,7 +1217,9 @@ Value qsearch(Position &pos, SearchStack *ss, Value alpha, Value beta,
   // Transposition table lookup
   position_key = pos.key();
   tte = TT.Probe(position_key, &tt_hit);
-  tt_move = tt_hit ? tte->move() : kMoveNone;
+  ++this_thread->tt_probes_;
+  this_thread->tt_hits_ += tt_hit;
+  tt_move = tt_hit ? tte->move(pos) : kMoveNone;
   tt_value = tt_hit ? value_from_tt(tte->value(), ss->ply) : kValueNone;
   pv_hit = tt_hit && tte->pv_hit();
 
@@ -1184,7 +1229,7 @@ Value qsearch(Position &pos, SearchStack *ss, Value alpha, Value beta,
     return tt_value;
   }
 
-  ss->static_eval = eval::Evaluate(pos, ss);
+  ss->static_eval = eval::Evaluate<B>(pos, ss);
 
   // 現局面の静的評価
   if (InCheck) {
@@ -1232,7 +1277,7 @@ Value qsearch(Position &pos, SearchStack *ss, Value alpha, Value beta,
                                        nullptr,
                                        (ss - 6)->continuation_history};
 
-  CheckInfo ci(pos);
+  BitBoard pinned = pos.pinned_pieces();
   MovePicker mp(pos, tt_move, depth, &this_thread->main_history_,
                 &this_thread->capture_history_, cont_hist,
                 move_to((ss - 1)->current_move));
@@ -1240,7 +1285,7 @@ Value qsearch(Position &pos, SearchStack *ss, Value alpha, Value beta,
   while ((move = mp.NextMove()) != kMoveNone) {
     assert(is_ok(move));
 
-    gives_check = pos.gives_check(move, ci);
+    gives_check = pos.gives_check(move);
 
     ++move_count;
 
@@ -1272,7 +1317,7 @@ Value qsearch(Position &pos, SearchStack *ss, Value alpha, Value beta,
 
     prefetch(TT.FirstEntry(pos.key_after(move)));
 
-    if (!pos.legal(move, ci.pinned)) {
+    if (!pos.legal(move, pinned)) {
       --move_count;
       continue;
     }
@@ -1284,12 +1329,13 @@ Value qsearch(Position &pos, SearchStack *ss, Value alpha, Value beta,
                                            [move_to(move)];
 
     pos.do_move(move, st, gives_check);
+    eval::Prefetch<B>(pos, move);
     (ss + 1)->evaluated = false;
 
     value =
         gives_check
-            ? -qsearch<NT, true>(pos, ss + 1, -beta, -alpha, depth - kOnePly)
-            : -qsearch<NT, false>(pos, ss + 1, -beta, -alpha, depth - kOnePly);
+            ? -qsearch<NT, true, B>(pos, ss + 1, -beta, -alpha, depth - kOnePly)
+            : -qsearch<NT, false, B>(pos, ss + 1, -beta, -alpha, depth - kOnePly);
     pos.undo_move(move);
 
     assert(value > -kValueInfinite && value < kValueInfinite);
@@ -1443,6 +1489,30 @@ void check_time() {
     Signals.stop = true;
 }
 
+// Limits.mateはミリ秒の制限時間で、負の値は時間の制限なし
+void search_mate(Position &pos) {
+  const TimePoint start = now();
+  std::vector<Move> pv;
+  Mate.Resize(Options["MateHash"]);
+  const MateSolver::Result result =
+      Mate.Solve(pos, Limits.mate > 0 ? Limits.mate : 0, pv);
+
+  const TimePoint elapsed = now() - start + 1;
+  sync_cout << "info time " << elapsed << " nodes " << Mate.nodes() << " nps "
+            << Mate.nodes() * 1000 / elapsed << sync_endl;
+
+  if (result == MateSolver::Result::kMate) {
+    std::stringstream ss;
+    ss << "checkmate";
+    for (Move m : pv) ss << " " << USI::format_move(m);
+    sync_cout << ss.str() << sync_endl;
+  } else if (result == MateSolver::Result::kNoMate) {
+    sync_cout << "checkmate nomate" << sync_endl;
+  } else {
+    sync_cout << "checkmate timeout" << sync_endl;
+  }
+}
+
 }  // namespace
 
 string usi_pv(const Position &pos, Depth depth, Value alpha, Value beta) {
@@ -1496,7 +1566,7 @@ bool RootMove::extract_ponder_from_tt(Position &pos) {
   pos.do_move(pv[0], st);
   TTEntry *tte = TT.Probe(pos.key(), &found);
   if (found) {
-    Move m = tte->move();
+    Move m = tte->move(pos);
     if (MoveList<kLegal>(pos).contains(m)) {
       pv.push_back(m);
       result = true;
@@ -48,9 +48,11 @@ struct SearchStack {
   Move killers[2];
   Value static_eval;
   Eval::EvalParts eval_parts;
-  eval::Feature feature;
+  // Thread::accumulators_の要素を指す
+  eval::Feature *feature;
   Value material;
   bool evaluated;
+  bool accumulated;
   int stat_score;
   int move_count;
   bool in_check;
@@ -108,6 +110,7 @@ struct LimitsType
   int depth;
   int64_t nodes;
   int movetime;
+  // go mateの制限時間(ミリ秒)。負の値はinfinite
   int mate;
   int infinite;
   int ponder;
@@ -23,6 +23,7 @@
 
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 
 #include "move_generator.h"
 #include "search.h"
@@ -38,8 +39,8 @@ Thread::Thread()
 {
   reset_calls_ = false;
   exit_        = false;
-  Clear();
   index_  = Threads.size();
+  numa_node_ = static_cast<int>(index_ % Numa::node_count());
   std::unique_lock<std::mutex> lk(mutex_);
   searching_ = true;
   native_thread_ = std::thread(&Thread::idle_loop, this);
@@ -52,11 +53,26 @@ Thread::~Thread()
   exit_ = true;
   sleep_condition_.notify_one();
   mutex_.unlock();
+  {
+    std::lock_guard<std::mutex> lk(Threads.start_mutex_);
+  }
+  Threads.start_condition_.notify_all();
   native_thread_.join();
 }
 
 void Thread::Clear() {
   eval_hash_.Clear();
+  feature_hash_.Clear();
+  refresh_table_.Clear();
+  kppt_hash_.Clear();
+  kpp_list_.Clear();
+  mate_cache_.Clear();
+  feature_refreshes_ = 0;
+  feature_updates_ = 0;
+  tt_probes_ = 0;
+  tt_hits_ = 0;
+  eval_probes_ = 0;
+  eval_hits_ = 0;
   counter_moves_.fill(kMoveNone);
   main_history_.fill(0);
   low_ply_history_.fill(0);
@@ -98,6 +114,14 @@ int Thread::BestMoveCount(Move move) const {
   return rm != root_moves_.begin() + pv_last_ ? rm->best_move_count : 0;
 }
 
+void
+Thread::attach_accumulators(SearchStack *stack, int num)
+{
+  assert(num <= kMaxAccumulators);
+  for (int i = 0; i < num; ++i)
+    stack[i].feature = &accumulators_[i];
+}
+
 void
 Thread::start_searching(bool resume)
 {
@@ -109,9 +133,89 @@ Thread::start_searching(bool resume)
   sleep_condition_.notify_one();
 }
 
+void
+Thread::prepare_searching()
+{
+  std::lock_guard<std::mutex> lk(mutex_);
+  searching_ = true;
+}
+
+// 探索の開始を待つ。スピンした後はThreadPoolの条件変数で眠る
+bool
+Thread::wait_for_start(uint64_t &epoch)
+{
+  if (Threads.spin_time_ > 0)
+  {
+    const auto spin_end = std::chrono::steady_clock::now()
+                        + std::chrono::microseconds(Threads.spin_time_);
+    while (Threads.start_epoch_.load(std::memory_order_acquire) == epoch && !exit_)
+    {
+      _mm_pause();
+      if (std::chrono::steady_clock::now() > spin_end)
+        break;
+    }
+  }
+
+  std::unique_lock<std::mutex> lk(Threads.start_mutex_);
+  Threads.start_condition_.wait(lk, [&] { return Threads.start_epoch_ != epoch || exit_; });
+  epoch = Threads.start_epoch_;
+  return !exit_;
+}
+
+void
+Thread::bind_numa()
+{
+  if (numa_bound_ == Threads.numa_binding_)
+    return;
+
+  numa_bound_ = Threads.numa_binding_;
+  Numa::bind_this_thread(numa_bound_ ? numa_node_ : -1);
+}
+
+void
+Thread::resize_eval_hash()
+{
+  // 使わない表や共有する場合の自分の表は最小にしてメモリを空ける
+  const bool kppt = eval::CurrentBackend() == eval::Backend::kKppt;
+  const bool shared = !kppt && Options["SharedEvalHash"] > 0;
+  eval_hash_.Resize(shared || kppt ? 0 : int(Options["EvalHash"]));
+  feature_hash_.Resize(kppt ? 0 : int(Options["EvalFeatureHash"]));
+  kppt_hash_.Resize(kppt ? int(Options["EvalHash"]) : 0);
+  value_hash_ = shared ? &Threads.shared_eval_hash_ : &eval_hash_;
+}
+
 void
 Thread::idle_loop()
 {
+  // 表を最初に触ったスレッドのノードにメモリが割り当てられるので、
+  // ノードに固定してから確保と初期化を行う。生成側はsearching_がfalseになるまで待っている
+  bind_numa();
+  resize_eval_hash();
+  Clear();
+
+  // helperは全員が同時に起こされ、自分で局面をコピーして探索を始める
+  if (index_ != 0)
+  {
+    uint64_t epoch = Threads.start_epoch_;
+    while (true)
+    {
+      {
+        std::lock_guard<std::mutex> lk(mutex_);
+        searching_ = false;
+        sleep_condition_.notify_one();
+      }
+
+      if (!wait_for_start(epoch))
+        break;
+
+      root_pos_ = Position(Threads.root_pos_, this);
+      root_pos_.set_repetition_table(&repetition_table_);
+      root_moves_ = Threads.root_moves_;
+      search();
+    }
+    return;
+  }
+
   while (!exit_)
   {
     std::unique_lock<std::mutex> lk(mutex_);
@@ -125,13 +229,27 @@ Thread::idle_loop()
     lk.unlock();
 
     if (!exit_)
+    {
+      // mainは作り直さないので、設定が変わっていたらここで固定し直す
+      bind_numa();
       search();
+    }
   }
 }
 
+size_t
+ThreadPool::shared_eval_hash_size()
+{
+  // KPPTの表は差分計算用の値を持つので共有しない
+  if (eval::CurrentBackend() == eval::Backend::kKppt)
+    return 0;
+  return Options["SharedEvalHash"];
+}
+
 void
 ThreadPool::init()
 {
+  shared_eval_hash_.Resize(shared_eval_hash_size());
   push_back(new MainThread);
   read_usi_options();
 }
@@ -150,6 +268,8 @@ void
 ThreadPool::read_usi_options()
 {
   size_t requested = Options["Threads"];
+  spin_time_ = Options["ThreadSpinTime"];
+  numa_binding_ = Options["NumaBinding"];
 
   assert(requested > 0);
 
@@ -163,6 +283,55 @@ ThreadPool::read_usi_options()
   }
 }
 
+void
+ThreadPool::rebind_numa()
+{
+  main()->wait_for_search_finished();
+
+  while (size() > 1)
+  {
+    delete back();
+    pop_back();
+  }
+  read_usi_options();
+}
+
+void
+ThreadPool::resize_eval_hash()
+{
+  main()->wait_for_search_finished();
+
+  shared_eval_hash_.Resize(shared_eval_hash_size());
+  for (Thread *th : *this)
+    th->resize_eval_hash();
+}
+
+void
+ThreadPool::start_helpers()
+{
+  {
+    std::lock_guard<std::mutex> lk(start_mutex_);
+    ++start_epoch_;
+  }
+  start_condition_.notify_all();
+}
+
+void
+ThreadPool::clear_eval_hash()
+{
+  main()->wait_for_search_finished();
+
+  shared_eval_hash_.Clear();
+  for (Thread *th : *this)
+  {
+    th->eval_hash_.Clear();
+    th->feature_hash_.Clear();
+    th->refresh_table_.Clear();
+    th->kppt_hash_.Clear();
+    th->kpp_list_.Clear();
+  }
+}
+
 int64_t
 ThreadPool::nodes_searched()
 {
@@ -187,6 +356,7 @@ ThreadPool::start_thinking
 
   main()->root_moves_.clear();
   main()->root_pos_ = pos;
+  main()->root_pos_.set_repetition_table(&main()->repetition_table_);
   Limits = limits;
   if (states.get())
   {
@@ -205,5 +375,8 @@ ThreadPool::start_thinking
       main()->root_moves_.push_back(RootMove(m.move));
   }
 
+  root_pos_ = pos;
+  root_moves_ = main()->root_moves_;
+
   main()->start_searching();
 }
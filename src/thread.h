@@ -33,6 +33,7 @@
 #include <vector>
 
 #include "evaluate.h"
+#include "mate_solver.h"
 #include "move_picker.h"
 #include "position.h"
 #include "search.h"
@@ -41,9 +42,16 @@ class Thread {
   std::thread native_thread_;
   std::mutex mutex_;
   std::condition_variable sleep_condition_;
-  bool exit_;
+  std::atomic_bool exit_;
   bool searching_;
 
+  bool wait_for_start(uint64_t &epoch);
+
+  // ノードへの固定をThreadPoolの設定に合わせる。探索するスレッド上で呼ぶ
+  void bind_numa();
+
+  bool numa_bound_ = false;
+
  public:
   void *operator new(size_t size) { return _mm_malloc(size, alignof(Thread)); }
 
@@ -61,21 +69,53 @@ class Thread {
 
   void start_searching(bool resume = false);
 
+  // helperを探索中にする。実際の開始はThreadPool::start_helpersで行う
+  void prepare_searching();
+
   void wait_for_search_finished();
 
   void wait(std::atomic_bool &b);
 
   int BestMoveCount(Move move) const;
 
+  // stackの先頭からnum個にaccumulators_の要素を割り当てる
+  void attach_accumulators(SearchStack *stack, int num);
+
+  // EvalHash,EvalFeatureHash,SharedEvalHash,EvalTypeの設定に合わせて表を確保し直す
+  void resize_eval_hash();
+
+  static constexpr int kMaxAccumulators = kMaxPly + 10;
+
   size_t index_;
+  // 固定先のノード。NumaBindingが無効な場合も評価関数の複製の選択以外には使わない
+  int numa_node_;
   size_t pv_index_;
   size_t pv_last_;
   uint64_t tt_hit_average_;
   int max_ply_;
   int calls_count_;
+  uint64_t feature_refreshes_;
+  uint64_t feature_updates_;
+  uint64_t tt_probes_;
+  uint64_t tt_hits_;
+  uint64_t eval_probes_;
+  uint64_t eval_hits_;
   std::atomic<uint64_t> best_move_changes_;
 
-  eval::HashTable eval_hash_;
+  eval::HashTable<eval::ValueEntry> eval_hash_;
+  // 評価値を引く表。SharedEvalHashが有効な場合は全スレッドで共有する表を指す
+  eval::HashTable<eval::ValueEntry> *value_hash_ = &eval_hash_;
+  eval::HashTable<eval::Entry> feature_hash_;
+  eval::RefreshTable refresh_table_;
+  // SearchStackごとの特徴量。SearchStackと分けてキャッシュラインに揃える
+  eval::Feature accumulators_[kMaxAccumulators];
+  // EvalTypeがkpptの場合に使う表
+  eval::HashTable<Eval::Entry> kppt_hash_;
+  Eval::KppListTable kpp_list_;
+  // 探索中の短手数の詰み探索の結果
+  MateCache mate_cache_;
+  // root_pos_から探索中の局面までの千日手の判定に使う表
+  RepetitionTable repetition_table_;
   Position root_pos_;
   Search::RootMoveVector root_moves_;
   Depth root_depth_;
@@ -108,7 +148,37 @@ struct ThreadPool : public std::vector<Thread *> {
 
   void read_usi_options();
 
+  void resize_eval_hash();
+
+  // helperを作り直して、NumaBindingの設定に合わせてノードに固定する
+  void rebind_numa();
+
+  void clear_eval_hash();
+
+  // SharedEvalHashの表の大きさ(MB)。共有しない評価関数の場合は0
+  size_t shared_eval_hash_size();
+
+  // prepare_searchingしたhelperを一斉に起こす
+  void start_helpers();
+
   int64_t nodes_searched();
+
+  // helperはここから局面と指し手をそれぞれコピーして探索を始める
+  Position root_pos_;
+  Search::RootMoveVector root_moves_;
+
+  bool numa_binding_ = false;
+
+  // SharedEvalHashが有効な場合に全スレッドで使う評価値の表
+  // entryは8byteの1語にkeyと評価値を詰めてあるので、ロックなしで読み書きしても
+  // 書きかけの値を他の局面の評価値として読むことはない
+  eval::HashTable<eval::ValueEntry> shared_eval_hash_;
+
+  // helperが探索の開始を待つ間にスピンする時間(マイクロ秒)
+  int spin_time_ = 0;
+  std::atomic<uint64_t> start_epoch_{0};
+  std::mutex start_mutex_;
+  std::condition_variable start_condition_;
 };
 
 extern ThreadPool Threads;
@@ -22,36 +22,145 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+#include <cstdio>
 #include <cstring>
 #include <iostream>
+#include <thread>
+#include <vector>
 
+#include "thread.h"
 #include "transposition_table.h"
+#include "usi.h"
 
 TranspositionTable TT;
 
 void TranspositionTable::Resize(uint64_t mb_size) {
-  size_t new_cluster_count = size_t(1)
-                             << msb((mb_size * 1024 * 1024) / sizeof(Cluster));
+  size_t new_cluster_count = (mb_size * 1024 * 1024) / sizeof(Cluster);
 
   if (new_cluster_count == cluster_count_) return;
 
   cluster_count_ = new_cluster_count;
 
-  free(mem_);
-  mem_ = calloc(cluster_count_ * sizeof(Cluster) + kCacheLineSize - 1, 1);
+  file_.close();
+  table_ = static_cast<Cluster *>(
+      mem_.allocate(cluster_count_ * sizeof(Cluster)));
 
-  if (!mem_) {
+  if (!table_) {
     std::cerr << "Failed to allocate " << mb_size
               << "MB for transposition table." << std::endl;
     exit(EXIT_FAILURE);
   }
 
-  table_ = (Cluster *)((uintptr_t(mem_) + kCacheLineSize - 1) &
-                       ~(kCacheLineSize - 1));
+  // ここでページを割り当てておき、最初の探索でページフォルトが起きないようにする
+  Clear();
 }
 
 void TranspositionTable::Clear() {
-  std::memset(table_, 0, cluster_count_ * sizeof(Cluster));
+  const size_t thread_count =
+      std::max<size_t>(1, std::min<size_t>(Options["Threads"], cluster_count_));
+  const size_t stride = cluster_count_ / thread_count;
+  std::vector<std::thread> threads;
+
+  // 各スレッドが触った領域はそのスレッドのNUMAノードに割り当てられる
+  // NumaBindingが有効なら探索スレッドと同じ規則でノードに固定して均等に分ける
+  const bool binding = Threads.numa_binding_;
+  for (size_t i = 0; i < thread_count; ++i) {
+    threads.emplace_back([this, i, stride, thread_count, binding]() {
+      if (binding) Numa::bind_this_thread(static_cast<int>(i % Numa::node_count()));
+      const size_t start = stride * i;
+      const size_t count =
+          (i + 1 == thread_count) ? cluster_count_ - start : stride;
+      std::memset(&table_[start], 0, count * sizeof(Cluster));
+    });
+  }
+
+  for (auto &th : threads) th.join();
+}
+
+namespace {
+// 置換表ファイルのヘッダ。この後にclusterをそのまま並べる
+// entryの形式やclusterへの割り当て方が変わったらversionを上げる
+struct HashFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_size;
+  uint32_t cluster_size;
+  uint8_t generation;
+  uint8_t reserved0[3];
+  uint64_t cluster_count;
+  uint8_t reserved1[32];
+};
+static_assert(sizeof(HashFileHeader) == 64, "");
+
+constexpr char kHashFileMagic[8] = {'N', 'O', 'Z', 'O', 'M', 'I', 'T', 'T'};
+// 1: 12byteのentry, 鍵の上位32bitで照合し、回転した鍵のmul_hi64で割り当てる
+// 2: 10byteのentryに16bitの指し手, 64byteのclusterに6entry
+constexpr uint32_t kHashFileVersion = 2;
+}  // namespace
+
+bool TranspositionTable::Save(const std::string &path) const {
+  HashFileHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kHashFileMagic, sizeof(header.magic));
+  header.version = kHashFileVersion;
+  header.entry_size = sizeof(TTEntry);
+  header.cluster_size = kClusterSize;
+  header.generation = generation_;
+  header.cluster_count = cluster_count_;
+
+  // Loadした表はpathのファイルをマップしたままなので、pathを直接書き直すと
+  // 書き出す前の部分が切り詰められてしまう。別名で書いてから置き換える
+  const std::string temp_path = temporary_path(path);
+  auto fp = std::fopen(temp_path.c_str(), "wb");
+  if (fp == nullptr) {
+    std::cerr << "Failed to open " << temp_path << "." << std::endl;
+    return false;
+  }
+  bool success = std::fwrite(&header, sizeof(header), 1, fp) == 1 &&
+                 std::fwrite(table_, sizeof(Cluster), cluster_count_, fp) ==
+                     cluster_count_;
+  success &= std::fclose(fp) == 0;
+  if (!success) std::remove(temp_path.c_str());
+  if (!success || !replace_file(temp_path, path)) {
+    std::cerr << "write error " << path << "." << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool TranspositionTable::Load(const std::string &path) {
+  MappedFile file;
+  if (!file.open(path, true)) {
+    std::cerr << "Failed to open " << path << "." << std::endl;
+    return false;
+  }
+
+  HashFileHeader header;
+  if (file.size() < sizeof(header)) {
+    std::cerr << path << ": file too small." << std::endl;
+    return false;
+  }
+  std::memcpy(&header, file.data(), sizeof(header));
+  if (std::memcmp(header.magic, kHashFileMagic, sizeof(header.magic)) != 0 ||
+      header.version != kHashFileVersion ||
+      header.entry_size != sizeof(TTEntry) ||
+      header.cluster_size != kClusterSize || header.cluster_count == 0) {
+    std::cerr << path << ": incompatible hash file." << std::endl;
+    return false;
+  }
+  if (file.size() != sizeof(header) + header.cluster_count * sizeof(Cluster)) {
+    std::cerr << path << ": unexpected file size." << std::endl;
+    return false;
+  }
+
+  // ヘッダが64byteなのでclusterもキャッシュラインに揃う
+  mem_.free();
+  file_.swap(file);
+  table_ = reinterpret_cast<Cluster *>(file_.data() + sizeof(header));
+  cluster_count_ = header.cluster_count;
+  generation_ = header.generation;
+  return true;
 }
 
 TTEntry *TranspositionTable::Probe(const Key key, bool *found) const {
@@ -87,12 +196,16 @@ TTEntry *TranspositionTable::Probe(const Key key, bool *found) const {
 }
 
 int TranspositionTable::Hashfull() const {
+  // 先頭から1000entry分を調べて使用率を千分率で返す
+  // どのclusterも同じ確率で選ばれるので先頭だけを見ればよい
+  const size_t cluster_num =
+      std::min<size_t>(1000 / kClusterSize, cluster_count_);
   int count = 0;
-  for (int i = 0; i < 1000 / kClusterSize; ++i) {
+  for (size_t i = 0; i < cluster_num; ++i) {
     const TTEntry *tte = &table_[i].entry[0];
     for (int j = 0; j < kClusterSize; ++j) {
       if ((tte[j].generation_and_bound8_ & 0xFC) == generation_) ++count;
     }
   }
-  return count;
+  return static_cast<int>(count * 1000 / (cluster_num * kClusterSize));
 }
@@ -31,15 +31,27 @@
 #include "types.h"
 
 // key        32 bit Stockfishは16bitだが、衝突が多いので32bitにする
-// move       32 bit
+// move       16 bit 移動元、移動先、成りだけを持つ。駒の種類は局面から復元する
 // value      16 bit
 // generation  5 bit
 // pv node     1 bit
 // bound type  2 bit
 // depth       8 bit
+//
+// 1 clusterに6 entryを詰めて64byteに収めるため、2byte境界に詰めて並べる
+#pragma pack(push, 2)
 class TTEntry {
  public:
-  Move move() const { return static_cast<Move>(move32_); }
+  // 保存した時と同じ局面で呼ぶ。別の局面の手はpseudo_legalで弾かれる
+  Move move(const Position &pos) const {
+    const Move m = static_cast<Move>(move16_);
+    const Square from = move_from(m);
+    if (m == kMoveNone || from >= kBoardSquare) return m;
+
+    const Square to = move_to(m);
+    return move_init(from, to, pos.piece_type(from), pos.piece_type(to),
+                     move_is_promote(m));
+  }
 
   Value value() const { return static_cast<Value>(value16_); }
 
@@ -54,7 +66,7 @@ class TTEntry {
   }
 
   void Save(Key k, Value v, bool pv_hit, Bound b, Depth d, Move m, uint8_t g) {
-    if (m || (k >> 32) != key32_) move32_ = m;
+    if (m || (k >> 32) != key32_) move16_ = static_cast<uint16_t>(m & 0x7FFF);
 
     if ((k >> 32) != key32_ || d / kOnePly > depth8_ - 4 || b == kBoundExact) {
       key32_ = static_cast<uint32_t>(k >> 32);
@@ -70,44 +82,60 @@ class TTEntry {
   uint8_t generation() const { return generation_and_bound8_ & 0xFC; }
 
   uint32_t key32_;
-  uint32_t move32_;
+  uint16_t move16_;
   int16_t value16_;
   uint8_t generation_and_bound8_;
   int8_t depth8_;
 };
+#pragma pack(pop)
+
+static_assert(sizeof(TTEntry) == 10, "");
 
 class TranspositionTable {
   static const int kCacheLineSize = 64;
 
-  static const int kClusterSize = 4;
+  static const int kClusterSize = 6;
 
-  struct Cluster {
+  // 1度のProbeでキャッシュミスが1回で済むようにキャッシュラインに揃える
+  struct alignas(kCacheLineSize) Cluster {
     TTEntry entry[kClusterSize];
   };
+  static_assert(sizeof(Cluster) == kCacheLineSize, "");
 
  public:
-  ~TranspositionTable() { free(mem_); }
-
   void NewSearch() { generation_ += 8; }
 
   TTEntry *Probe(const Key key, bool *found) const;
 
+  // cluster数は2のべき乗とは限らないので、乗算の上位bitで割り当てる
+  // 上位32bitはentryの照合に使うので、下位32bitが上に来るように回転させる
   TTEntry *FirstEntry(const Key key) const {
-    return &table_[(size_t)key & (cluster_count_ - 1)].entry[0];
+    return &table_[mul_hi64((key << 32) | (key >> 32), cluster_count_)]
+                .entry[0];
   }
 
   void Resize(uint64_t mb_size);
 
+  // 探索スレッドの数だけスレッドを立てて分担して0にする
   void Clear();
 
   int Hashfull() const;
 
   uint8_t generation() const { return generation_; }
 
+  bool large_pages() const { return mem_.large_pages(); }
+
+  // 置換表をファイルに保存する。読み込みはファイルをマップするので一瞬で終わる
+  bool Save(const std::string &path) const;
+
+  bool Load(const std::string &path);
+
  private:
   size_t cluster_count_;
   Cluster *table_;
-  void *mem_;
+  LargePageMemory mem_;
+  // Loadした場合はファイルをマップした領域を置換表として使う
+  MappedFile file_;
   uint8_t generation_;
 };
 
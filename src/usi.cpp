@@ -21,10 +21,13 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <cstdlib>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include "evaluate.h"
 #include "position.h"
@@ -120,6 +123,55 @@ setoption(istringstream& is)
     sync_cout << "No such option: " << name << sync_endl;
 }
 
+// 1行に1局面のSFENを書いたファイルを読み、評価値を1行ずつ出力する
+// 局面をまとめて評価関数に渡し、重みの読み込みを局面間で使い回す
+void
+evalbatch(istringstream& is)
+{
+  const int kBlockSize = 1024;
+  string path, sfen;
+  is >> path;
+
+  // まとめて計算するのはNNだけ
+  if (eval::CurrentBackend() != eval::Backend::kNn)
+  {
+    cerr << "evalbatch requires EvalType nn" << endl;
+    return;
+  }
+
+  ifstream file(path.c_str());
+  if (!file.is_open())
+  {
+    cerr << "Unable to open file " << path << endl;
+    return;
+  }
+
+  vector<Position> positions(kBlockSize);
+  vector<const Position*> pointers(kBlockSize);
+  vector<Value> values(kBlockSize);
+  for (int i = 0; i < kBlockSize; ++i)
+    pointers[i] = &positions[i];
+
+  while (true)
+  {
+    int num = 0;
+    while (num < kBlockSize && getline(file, sfen))
+    {
+      if (!sfen.empty())
+        positions[num++].set(sfen, Threads.main());
+    }
+    if (num == 0)
+      break;
+
+    eval::EvaluateBatch(pointers.data(), num, values.data());
+
+    stringstream ss;
+    for (int i = 0; i < num; ++i)
+      ss << (i == 0 ? "" : "\n") << values[i];
+    sync_cout << ss.str() << sync_endl;
+  }
+}
+
 void 
 go(const Position &pos, istringstream &is) 
 {
@@ -173,7 +225,11 @@ go(const Position &pos, istringstream &is)
     }
     else if (token == "mate")
     {
-      is >> limits.mate;
+      // 時間の指定がない場合と0以下の場合もinfiniteとして扱う
+      int time = -1;
+      if (is >> token && token != "infinite")
+        time = std::atoi(token.c_str());
+      limits.mate = time > 0 ? time : -1;
     }
     else if (token == "infinite")
     {
@@ -275,10 +331,47 @@ USI::loop(int argc, char* argv[])
       Move move = search_mate1ply(pos);
       sync_cout << USI::format_move(move) << sync_endl;
     } else if (token == "eval") {
-      SearchStack ss[2];
-      ss[0].evaluated = false;
-      ss[1].evaluated = false;
-      sync_cout << eval::Evaluate(pos, &ss[1]) << sync_endl;
+      SearchStack ss[2] = {};
+      pos.this_thread()->attach_accumulators(ss, 2);
+      if (eval::CurrentBackend() == eval::Backend::kKppt)
+        sync_cout << eval::Evaluate<eval::Backend::kKppt>(pos, &ss[1])
+                  << sync_endl;
+      else
+        sync_cout << eval::Evaluate<eval::Backend::kNn>(pos, &ss[1])
+                  << sync_endl;
+    }
+    else if (token == "evalbatch")
+    {
+      evalbatch(is);
+    }
+    else if (token == "evalsave")
+    {
+      // 読み込んでいる評価関数を評価関数ファイルの形式で書き出す
+      // int8を指定した場合は入力層の重みをint8形式にする
+      // パスを省略した場合はEvalDirのEvalFileに書き出す
+      string path = eval::EvalPath(Options["EvalFile"]);
+      string format_name;
+      if (is >> token) {
+        if (token == "int8" || token == "int16")
+          format_name = token;
+        else {
+          path = token;
+          is >> format_name;
+        }
+      }
+      eval::KpFormat format = format_name == "int8" ? eval::KpFormat::kInt8
+                                                    : eval::KpFormat::kInt16;
+      if (eval::SaveWeightFile(path, format))
+        sync_cout << "info string saved " << path << sync_endl;
+    }
+    else if (token == "savehash" || token == "loadhash")
+    {
+      string path = Options["HashFile"];
+      is >> path;
+      Threads.main()->wait_for_search_finished();
+      if (token == "savehash" ? TT.Save(path) : TT.Load(path))
+        sync_cout << "info string " << (token == "savehash" ? "saved " : "loaded ")
+                  << path << sync_endl;
     }
     else
     {
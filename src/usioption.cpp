@@ -41,7 +41,12 @@ namespace USI
 void 
 on_eval(const Option &) 
 { 
+  // 探索中の重みを読み込み直したり解放したりしないように、探索の終了を待つ
+  Threads.main()->wait_for_search_finished();
   eval::Init(); 
+  // 評価関数の種類によって使う表が異なる
+  Threads.resize_eval_hash();
+  Threads.clear_eval_hash();
 }
 
 void 
@@ -50,6 +55,13 @@ on_threads(const Option &)
   Threads.read_usi_options(); 
 }
 
+void 
+on_numa_binding(const Option &) 
+{ 
+  Threads.rebind_numa(); 
+  eval::ReplicateParameters(); 
+}
+
 void 
 on_hash_size(const Option &o) 
 { 
@@ -62,6 +74,12 @@ on_clear_hash(const Option &)
   TT.Clear(); 
 }
 
+void 
+on_eval_hash_size(const Option &) 
+{ 
+  Threads.resize_eval_hash(); 
+}
+
 bool 
 ci_less(char c1, char c2) 
 { 
@@ -80,8 +98,20 @@ init(OptionsMap& o)
   o["BookFile"]                    = Option("book.bin");
   o["Contempt"]                    = Option(0, -kValueMate, kValueMate);
   o["Threads"]                     = Option(1, 1, 128, on_threads);
-  o["USI_Hash"]                    = Option(32, 1, 16384, on_hash_size);
+  o["ThreadSpinTime"]              = Option(0, 0, 100000, on_threads);
+  o["NumaBinding"]                 = Option(false, on_numa_binding);
+  o["USI_Hash"]                    = Option(32, 1, 33554432, on_hash_size);
   o["Clear_Hash"]                  = Option(on_clear_hash);
+  o["Keep_Hash"]                   = Option(false);
+  o["HashFile"]                    = Option("hash.bin");
+  o["EvalHash"]                    = Option(16, 1, 1024, on_eval_hash_size);
+  o["EvalFeatureHash"]             = Option(16, 1, 1024, on_eval_hash_size);
+  o["SharedEvalHash"]              = Option(0, 0, 65536, on_eval_hash_size);
+  o["EvalDir"]                     = Option(".", on_eval);
+  o["EvalFile"]                    = Option("nn.bin", on_eval);
+  o["EvalType"]                    = Option("nn", on_eval);
+  o["MateHash"]                    = Option(64, 1, 65536);
+  o["MatePly"]                     = Option(1, 1, 7);
   o["USI_Ponder"]                  = Option(true);
   o["OwnBook"]                     = Option(true);
   o["MultiPV"]                     = Option(1, 1, 500);